@@ -26,9 +26,11 @@
 #ifdef _MSC_VER
 #  define _CRT_SECURE_NO_WARNINGS
 #  define _CRT_DISABLE_PERFCRIT_LOCKS
+#  define fseeko _fseeki64
 #  define ftello _ftelli64
 #else
 #  define _FILE_OFFSET_BITS 64
+#  define _POSIX_C_SOURCE 200112L
 #endif
 
 #ifdef __MINGW32__
@@ -40,24 +42,97 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(_WIN32)
+#  include <fcntl.h>
+#  include <io.h>
+#endif
+
 #include "crush.h"
+#include "crush_mmap.h"
+#include "crush_thread.h"
 #include "parg.h"
 
 /*
- * The default block size used to process data.
+ * The default and maximum block size used to process data.
  */
 #ifndef BLOCK_SIZE
 #  define BLOCK_SIZE (64 * 1024 * 1024UL)
 #endif
 
+/*
+ * The minimum block size for --block-size.
+ */
+#ifndef MIN_BLOCK_SIZE
+#  define MIN_BLOCK_SIZE (4 * 1024UL)
+#endif
+
+/*
+ * Block size that --memory-limit reduces to before reducing threads and
+ * level. Blocks of at least twice the window lose little ratio.
+ */
+#define FIT_BLOCK_SIZE (4 * 1024 * 1024UL)
+
+/*
+ * Block size that --memory-limit reduces to before reducing level. Down to
+ * this, smaller blocks at a level lose less ratio than the level below.
+ */
+#define FIT_MIN_BLOCK_SIZE (64 * 1024UL)
+
+/*
+ * Block size above which levels 8 and up use the windowed parse. It is used
+ * for every block then, including a smaller last one, so workmem is sized
+ * for the windowed parse only.
+ */
+#define WINDOW_BLOCK_SIZE (4 * 1024 * 1024UL)
+
+/*
+ * Workmem of at least this size is allocated with huge pages.
+ */
+#define HUGE_WORKMEM_SIZE (16 * 1024 * 1024UL)
+
+/*
+ * The maximum number of threads used to compress blocks.
+ */
+#ifndef MAX_THREADS
+#  define MAX_THREADS 256
+#endif
+
+/*
+ * The maximum number of candidates per byte for --adaptive.
+ */
+#define MAX_NODE_BUDGET 4096UL
+
 /*
  * Unsigned char type.
  */
 typedef unsigned char byte;
 
+/*
+ * Optional block index file, see CRUSH_INDEX_MAGIC in crush.h.
+ *
+ * When compressing with --index, the index is written to a file named like
+ * the output with INDEX_SUFFIX appended, which crush_reader_open() also uses
+ * for random access. The compressed file itself is unchanged.
+ */
+#define INDEX_SUFFIX CRUSH_INDEX_SUFFIX
+#define INDEX_MAGIC CRUSH_INDEX_MAGIC
+
+struct index_entry {
+	unsigned long packedsize;
+	unsigned long depackedsize;
+};
+
+struct block_index {
+	struct index_entry *entries;
+	size_t num_entries;
+	size_t capacity;
+};
+
 /*
  * Get the low-order 8 bits of a value.
  */
@@ -80,207 +155,1562 @@ write_le32(byte *p, unsigned long val)
 }
 
 /*
- * Read a 32-bit unsigned value in little-endian order.
+ * Read a 32-bit unsigned value in little-endian order.
+ */
+static unsigned long
+read_le32(const byte *p)
+{
+	return ((unsigned long) octet(p[0]))
+	     | ((unsigned long) octet(p[1]) << 8)
+	     | ((unsigned long) octet(p[2]) << 16)
+	     | ((unsigned long) octet(p[3]) << 24);
+}
+
+/*
+ * Append an entry to block index, returns 0 on success.
+ */
+static int
+index_add(struct block_index *idx, unsigned long packedsize,
+          unsigned long depackedsize)
+{
+	if (idx->num_entries == idx->capacity) {
+		size_t capacity = idx->capacity ? 2 * idx->capacity : 64;
+		struct index_entry *entries;
+
+		entries = (struct index_entry *) realloc(idx->entries,
+		                                         capacity * sizeof(*entries));
+
+		if (entries == NULL) {
+			return 1;
+		}
+
+		idx->entries = entries;
+		idx->capacity = capacity;
+	}
+
+	idx->entries[idx->num_entries].packedsize = packedsize;
+	idx->entries[idx->num_entries].depackedsize = depackedsize;
+	idx->num_entries++;
+
+	return 0;
+}
+
+/*
+ * Open index file of packedname, returns NULL on error.
+ */
+static FILE *
+index_open(const char *packedname, const char *mode)
+{
+	char *name;
+	FILE *file;
+
+	if ((name = (char *) malloc(strlen(packedname) + sizeof(INDEX_SUFFIX))) == NULL) {
+		return NULL;
+	}
+
+	strcpy(name, packedname);
+	strcat(name, INDEX_SUFFIX);
+
+	file = fopen(name, mode);
+
+	free(name);
+
+	return file;
+}
+
+/*
+ * Write block index file of packedname, returns 0 on success.
+ */
+static int
+index_write(const struct block_index *idx, const char *packedname)
+{
+	byte buf[8];
+	FILE *indexfile;
+	size_t i;
+	int res = 1;
+
+	if ((indexfile = index_open(packedname, "wb")) == NULL) {
+		return 1;
+	}
+
+	write_le32(buf, INDEX_MAGIC);
+	write_le32(buf + 4, (unsigned long) idx->num_entries);
+
+	if (fwrite(buf, 1, 8, indexfile) != 8) {
+		goto out;
+	}
+
+	for (i = 0; i < idx->num_entries; ++i) {
+		write_le32(buf, idx->entries[i].packedsize);
+		write_le32(buf + 4, idx->entries[i].depackedsize);
+
+		if (fwrite(buf, 1, 8, indexfile) != 8) {
+			goto out;
+		}
+	}
+
+	res = 0;
+
+out:
+	if (fclose(indexfile) != 0) {
+		res = 1;
+	}
+
+	return res;
+}
+
+/*
+ * Read block index file of packedname, returns 0 if a valid index was found.
+ *
+ * The blocks in the index must account for all of packedfile, which is left
+ * at the start of the file.
+ */
+static int
+index_read(struct block_index *idx, const char *packedname, FILE *packedfile)
+{
+	byte buf[8];
+	FILE *indexfile = NULL;
+	long long filesize, offset = 0;
+	unsigned long num_entries;
+	unsigned long i;
+	int res = 1;
+
+	if (strcmp(packedname, "-") == 0
+	 || (indexfile = index_open(packedname, "rb")) == NULL
+	 || fseeko(packedfile, 0, SEEK_END) != 0
+	 || (filesize = ftello(packedfile)) < 0
+	 || fread(buf, 1, 8, indexfile) != 8
+	 || read_le32(buf) != INDEX_MAGIC) {
+		goto out;
+	}
+
+	num_entries = read_le32(buf + 4);
+
+	if ((long long) num_entries > filesize / 4) {
+		goto out;
+	}
+
+	for (i = 0; i < num_entries; ++i) {
+		unsigned long packedsize, depackedsize;
+
+		if (fread(buf, 1, 8, indexfile) != 8) {
+			goto out;
+		}
+
+		packedsize = read_le32(buf);
+		depackedsize = read_le32(buf + 4);
+
+		if (depackedsize > BLOCK_SIZE
+		 || packedsize > crush_max_packed_size(depackedsize)
+		 || index_add(idx, packedsize, depackedsize)) {
+			goto out;
+		}
+
+		offset += 4 + (long long) packedsize;
+	}
+
+	/* Blocks must account for the entire file */
+	if (offset == filesize && fread(buf, 1, 1, indexfile) == 0) {
+		res = 0;
+	}
+
+out:
+	if (res != 0) {
+		idx->num_entries = 0;
+	}
+
+	if (indexfile != NULL) {
+		fclose(indexfile);
+	}
+
+	fseeko(packedfile, 0, SEEK_SET);
+
+	return res;
+}
+
+static unsigned int
+ratio(long long x, long long y)
+{
+	if (x <= LLONG_MAX / 100) {
+		x *= 100;
+	}
+	else {
+		y /= 100;
+	}
+
+	if (y == 0) {
+		y = 1;
+	}
+
+	return (unsigned int) (x / y);
+}
+
+static void
+printf_error(const char *fmt, ...)
+{
+	va_list arg;
+
+	fputs("bcrush: ", stderr);
+
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+
+	fputs("\n", stderr);
+}
+
+static void
+printf_usage(const char *fmt, ...)
+{
+	va_list arg;
+
+	fputs("bcrush: ", stderr);
+
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+
+	fputs("\n"
+	      "usage: bcrush [-123456789 | --optimal] [-a N] [-b SIZE] [-i] [-m | -p]\n"
+	      "              [-T N] [--split-block] [--memory-limit SIZE]\n"
+	      "              [--token-weight N] [-v] INFILE OUTFILE\n"
+	      "       bcrush -d [-m | -p] [-T N] [--memory-limit SIZE] [-v] INFILE OUTFILE\n"
+	      "       bcrush -V | --version\n"
+	      "       bcrush -h | --help\n", stderr);
+}
+
+/*
+ * State for compressing one block, possibly on a separate thread.
+ */
+struct pack_job {
+	byte *data;
+	byte *packed;
+	byte *workmem;
+	size_t workmem_size;
+	size_t n_read;
+	size_t packedsize;
+	int level;
+	unsigned long node_budget;
+	int token_weight;
+	int num_threads;
+	int windowed;
+	int keep_stats;
+	struct crush_stats stats;
+	struct crush_thread thread;
+};
+
+/*
+ * Get workmem size for compressing a block of block_size bytes at level
+ * using num_threads.
+ */
+static size_t
+pack_workmem_size(unsigned long block_size, int level, int num_threads)
+{
+	struct crush_params params;
+
+	crush_params_level(&params, level);
+
+	params.num_threads = num_threads < CRUSH_MAX_THREADS
+	                   ? num_threads : CRUSH_MAX_THREADS;
+	params.windowed = block_size > WINDOW_BLOCK_SIZE;
+
+	return crush_workmem_size_params(block_size, &params);
+}
+
+/*
+ * Allocate workmem for job.
+ *
+ * The match finders randomly access large workmem, so using huge pages for
+ * it reduces TLB misses.
+ */
+static int
+pack_job_alloc_workmem(struct pack_job *job, size_t size)
+{
+	struct crush_allocator allocator;
+
+	job->workmem_size = size;
+
+	if (size >= HUGE_WORKMEM_SIZE) {
+		crush_allocator_huge(&allocator, 0);
+		job->workmem = (byte *) allocator.alloc(allocator.opaque, size);
+	}
+	else {
+		job->workmem = (byte *) malloc(size);
+	}
+
+	return job->workmem != NULL ? 0 : 1;
+}
+
+static void
+pack_job_free_workmem(struct pack_job *job)
+{
+	struct crush_allocator allocator;
+
+	if (job->workmem == NULL) {
+		return;
+	}
+
+	if (job->workmem_size >= HUGE_WORKMEM_SIZE) {
+		crush_allocator_huge(&allocator, 0);
+		allocator.free(allocator.opaque, job->workmem, job->workmem_size);
+	}
+	else {
+		free(job->workmem);
+	}
+
+	job->workmem = NULL;
+}
+
+/*
+ * Get the number of blocks compressed at a time, which is num_threads, or
+ * less if the input size is known and it has fewer blocks.
+ */
+static int
+pack_num_jobs(long long insize, unsigned long block_size, int num_threads)
+{
+	long long num_blocks;
+
+	if (insize < 0) {
+		return num_threads;
+	}
+
+	num_blocks = insize > 0 ? (insize - 1) / (long long) block_size + 1 : 1;
+
+	return num_blocks < num_threads ? (int) num_blocks : num_threads;
+}
+
+/*
+ * Get the memory used for compressing num_jobs blocks at a time.
+ *
+ * Each job has workmem, the first one for parsing with num_threads if
+ * split_block is set. There are num_sets of block buffers and buffers for
+ * the compressed blocks. With mmap there are no block buffers, and the
+ * compressed blocks are only buffered when using more than one thread.
+ */
+static unsigned long long
+pack_memory_size(unsigned long block_size, int level, int num_threads,
+                 int split_block, int num_jobs, int num_sets, int use_mmap)
+{
+	unsigned long long size;
+	unsigned long long bufsize;
+
+	size = pack_workmem_size(block_size, level, split_block ? num_threads : 1)
+	     + (unsigned long long) (num_jobs - 1) * pack_workmem_size(block_size, level, 1);
+
+	if (use_mmap) {
+		bufsize = num_threads > 1 ? crush_max_packed_size(block_size) : 0;
+	}
+	else {
+		bufsize = (unsigned long long) block_size + crush_max_packed_size(block_size);
+	}
+
+	return size + (unsigned long long) num_sets * num_jobs * bufsize;
+}
+
+/*
+ * Get the block size fit_memory_limit reduces to before reducing threads.
+ */
+static unsigned long
+fit_block_size(int level)
+{
+	struct crush_params params;
+
+	crush_params_level(&params, level);
+
+	return params.parser == CRUSH_PARSER_BTPARSE ? 2 * WINDOW_BLOCK_SIZE
+	                                             : FIT_BLOCK_SIZE;
+}
+
+/*
+ * Reduce block size, threads and level until compressing uses at most
+ * limit bytes of memory, returns 0 on success.
+ *
+ * The number of threads does not change the output, so after reducing the
+ * block size to FIT_BLOCK_SIZE, we reduce threads before anything else.
+ * Then the block size is reduced to FIT_MIN_BLOCK_SIZE, and only then the
+ * level, starting over from the requested block size and threads at each
+ * lower level. Levels 8 and up stop at the smallest block size over
+ * WINDOW_BLOCK_SIZE at first instead, since the windowed parse uses less
+ * workmem than a 4 MiB block without it.
+ */
+static int
+fit_memory_limit(unsigned long long limit, long long insize, int num_sets,
+                 int use_mmap, int split_block, unsigned long *block_size,
+                 int *level, int *num_threads)
+{
+	const unsigned long req_block_size = *block_size;
+	const int req_num_threads = *num_threads;
+
+	for (;;) {
+		int num_jobs = pack_num_jobs(insize, *block_size, *num_threads);
+		unsigned long fit_size = fit_block_size(*level);
+
+		if (pack_memory_size(*block_size, *level, *num_threads, split_block,
+		                     num_jobs, num_sets, use_mmap) <= limit) {
+			return 0;
+		}
+
+		if (*block_size > fit_size) {
+			*block_size = *block_size / 2 > fit_size
+			            ? *block_size / 2 : fit_size;
+		}
+		else if (*num_threads > 1) {
+			--*num_threads;
+		}
+		else if (*block_size > FIT_MIN_BLOCK_SIZE) {
+			*block_size = *block_size / 2 > FIT_MIN_BLOCK_SIZE
+			            ? *block_size / 2 : FIT_MIN_BLOCK_SIZE;
+		}
+		else if (*level > 1) {
+			--*level;
+			*block_size = req_block_size;
+			*num_threads = req_num_threads;
+		}
+		else if (*block_size > MIN_BLOCK_SIZE) {
+			*block_size = *block_size / 2 > MIN_BLOCK_SIZE
+			            ? *block_size / 2 : MIN_BLOCK_SIZE;
+		}
+		else {
+			return 1;
+		}
+	}
+}
+
+/*
+ * Get parameters for compressing at level.
+ *
+ * If node_budget is not 0, the leparse and btparse parsers adapt the search
+ * depth to check about node_budget candidates per position, with no fixed
+ * limit, so they can search deeper than the level where that helps.
+ * token_weight is passed on, and only used by them.
+ */
+static void
+pack_params(struct crush_params *params, int level, unsigned long node_budget,
+            int token_weight)
+{
+	crush_params_level(params, level);
+
+	params->token_weight = token_weight;
+
+	if (node_budget > 0
+	 && (params->parser == CRUSH_PARSER_LEPARSE
+	  || params->parser == CRUSH_PARSER_BTPARSE)) {
+		params->max_depth = ULONG_MAX;
+		params->node_budget = node_budget;
+	}
+}
+
+static void
+pack_job_run(void *arg)
+{
+	struct pack_job *job = (struct pack_job *) arg;
+	struct crush_params params;
+
+	pack_params(&params, job->level, job->node_budget, job->token_weight);
+
+	params.num_threads = job->num_threads;
+	params.windowed = job->windowed;
+
+	job->packedsize = crush_pack_params_ex(job->data, job->packed,
+	                                       (unsigned long) job->n_read,
+	                                       job->workmem, &params,
+	                                       job->keep_stats ? &job->stats : NULL);
+}
+
+/*
+ * Add the statistics of a block to the total.
+ */
+static void
+stats_add(struct crush_stats *total, const struct crush_stats *stats)
+{
+	int i;
+
+	total->num_literals += stats->num_literals;
+	total->num_matches += stats->num_matches;
+
+	for (i = 0; i < 6; ++i) {
+		total->len_buckets[i] += stats->len_buckets[i];
+	}
+
+	for (i = 0; i < 16; ++i) {
+		total->offs_slots[i] += stats->offs_slots[i];
+	}
+
+	total->num_searches += stats->num_searches;
+	total->num_nodes += stats->num_nodes;
+	total->num_depth_limited += stats->num_depth_limited;
+	total->find_time += stats->find_time;
+	total->output_time += stats->output_time;
+}
+
+static void
+print_stats(const struct crush_stats *stats, int level,
+            unsigned long node_budget)
+{
+	struct crush_params params;
+	int i;
+
+	pack_params(&params, level, node_budget, 0);
+
+	fprintf(stderr, "literals %lu matches %lu\n",
+	        stats->num_literals, stats->num_matches);
+
+	fputs("length buckets", stderr);
+	for (i = 0; i < 6; ++i) {
+		fprintf(stderr, " %c %lu", 'A' + i, stats->len_buckets[i]);
+	}
+
+	fputs("\noffset slots", stderr);
+	for (i = 0; i < 16; ++i) {
+		fprintf(stderr, " %lu", stats->offs_slots[i]);
+	}
+	fputs("\n", stderr);
+
+	fprintf(stderr, "searches %llu nodes %llu (%.2f per search)",
+	        stats->num_searches, stats->num_nodes,
+	        stats->num_searches ? (double) stats->num_nodes / (double) stats->num_searches : 0.0);
+
+	if (params.node_budget > 0) {
+		fprintf(stderr, " depth limited %llu (%u%% at adaptive depth)",
+		        stats->num_depth_limited,
+		        ratio((long long) stats->num_depth_limited, (long long) stats->num_searches));
+	}
+	else if (params.max_depth != ULONG_MAX) {
+		fprintf(stderr, " depth limited %llu (%u%% at max_depth %lu)",
+		        stats->num_depth_limited,
+		        ratio((long long) stats->num_depth_limited, (long long) stats->num_searches),
+		        params.max_depth);
+	}
+	fputs("\n", stderr);
+
+	fprintf(stderr, "time find %.2f output %.2f\n",
+	        stats->find_time, stats->output_time);
+}
+
+/*
+ * Run jobs, the first one on this thread, returns 0 on success.
+ *
+ * With split_block, when there are fewer jobs than threads, the spare
+ * threads are given to the first job, which has workmem for parsing its
+ * block with all of them.
+ */
+static int
+run_pack_jobs(struct pack_job *jobs, int num_jobs, int num_threads,
+              int split_block)
+{
+	int i;
+
+	jobs[0].num_threads = 1;
+
+	if (split_block) {
+		jobs[0].num_threads = num_threads - num_jobs + 1 < CRUSH_MAX_THREADS
+		                    ? num_threads - num_jobs + 1 : CRUSH_MAX_THREADS;
+	}
+
+	for (i = 1; i < num_jobs; ++i) {
+		jobs[i].num_threads = 1;
+	}
+
+	for (i = 1; i < num_jobs; ++i) {
+		if (crush_thread_create(&jobs[i].thread, pack_job_run, &jobs[i])) {
+			printf_error("unable to create thread");
+
+			while (--i > 0) {
+				crush_thread_join(&jobs[i].thread);
+			}
+
+			return 1;
+		}
+	}
+
+	pack_job_run(&jobs[0]);
+
+	for (i = 1; i < num_jobs; ++i) {
+		crush_thread_join(&jobs[i].thread);
+	}
+
+	return 0;
+}
+
+/*
+ * Open file for reading, or standard input if name is "-".
+ */
+static FILE *
+open_input(const char *name)
+{
+	if (strcmp(name, "-") == 0) {
+#if defined(_WIN32)
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		return stdin;
+	}
+
+	return fopen(name, "rb");
+}
+
+/*
+ * Open file for writing, or standard output if name is "-".
+ */
+static FILE *
+open_output(const char *name)
+{
+	if (strcmp(name, "-") == 0) {
+#if defined(_WIN32)
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		return stdout;
+	}
+
+	return fopen(name, "wb");
+}
+
+/*
+ * Close file from open_input or open_output.
+ */
+static void
+close_file(FILE *file)
+{
+	if (file == stdout) {
+		fflush(file);
+	}
+	else if (file != stdin) {
+		fclose(file);
+	}
+}
+
+/*
+ * Reading up to num_jobs blocks from a file.
+ *
+ * The sizes read are kept here until the jobs are set up for compression,
+ * since a writer thread may still be using the sizes of the previous blocks
+ * in the same jobs.
+ */
+struct pack_reader {
+	FILE *file;
+	struct pack_job *jobs;
+	unsigned long block_size;
+	int max_jobs;
+	int num_jobs;
+	size_t n_read[MAX_THREADS];
+	struct crush_thread thread;
+};
+
+static void
+pack_reader_run(void *arg)
+{
+	struct pack_reader *rd = (struct pack_reader *) arg;
+
+	for (rd->num_jobs = 0; rd->num_jobs < rd->max_jobs; ++rd->num_jobs) {
+		rd->n_read[rd->num_jobs] = fread(rd->jobs[rd->num_jobs].data, 1,
+		                                 rd->block_size, rd->file);
+
+		if (rd->n_read[rd->num_jobs] == 0) {
+			break;
+		}
+	}
+}
+
+/*
+ * Writing compressed blocks to a file, and adding up their sizes.
+ */
+struct pack_writer {
+	FILE *file;
+	struct pack_job *jobs;
+	int num_jobs;
+	int write_index;
+	int res;
+	struct block_index idx;
+	long long insize;
+	long long outsize;
+	struct crush_stats stats;
+	struct crush_thread thread;
+};
+
+static void
+pack_writer_run(void *arg)
+{
+	struct pack_writer *wr = (struct pack_writer *) arg;
+	byte header[4];
+	int i;
+
+	/* Write blocks in input order */
+	for (i = 0; i < wr->num_jobs; ++i) {
+		const struct pack_job *job = &wr->jobs[i];
+
+		/* Check for compression error */
+		if (job->packedsize == 0) {
+			printf_error("an error occured while compressing");
+			wr->res = 1;
+			return;
+		}
+
+		/* Put block-specific values into header */
+		write_le32(header, (unsigned long) job->n_read);
+
+		/* Write header and compressed data */
+		fwrite(header, 1, sizeof(header), wr->file);
+		fwrite(job->packed, 1, job->packedsize, wr->file);
+
+		/* Sum input and output size */
+		wr->insize += job->n_read;
+		wr->outsize += job->packedsize + sizeof(header);
+		stats_add(&wr->stats, &job->stats);
+
+		if (wr->write_index && index_add(&wr->idx, (unsigned long) job->packedsize,
+		                                 (unsigned long) job->n_read)) {
+			printf_error("not enough memory");
+			wr->res = 1;
+			return;
+		}
+	}
+}
+
+/*
+ * Compress from file or standard input.
+ *
+ * In pipelined mode there are two sets of block buffers. While the blocks
+ * of one set are compressed, the next blocks are read into the other set on
+ * a reader thread, and the previous compressed blocks are written from it
+ * on a writer thread. This overlaps I/O with compression, at the cost of
+ * twice the memory for blocks.
+ *
+ * Blocks are block_size bytes, and up to num_jobs of them are compressed at
+ * a time using num_threads. With split_block, spare threads parse the first
+ * block of each batch.
+ */
+static int
+compress_file(const char *oldname, const char *packedname, int be_verbose,
+              int level, unsigned long node_budget, int token_weight,
+              unsigned long block_size, int num_threads, int num_jobs,
+              int split_block, int write_index, int pipelined)
+{
+	FILE *oldfile = NULL;
+	FILE *packedfile = NULL;
+	struct pack_job *jobs = NULL;
+	struct pack_reader rd;
+	struct pack_writer wr;
+	static const char rotator[] = "-\\|/";
+	unsigned int counter = 0;
+	const int num_sets = pipelined ? 2 : 1;
+	int cur = 0;
+	int writing = 0;
+	clock_t clocks;
+	int i;
+	int res = 1;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.write_index = write_index;
+
+	/* Allocate memory, the sets share workmem */
+	if ((jobs = (struct pack_job *) calloc(num_sets * num_jobs, sizeof(*jobs))) == NULL) {
+		printf_error("not enough memory");
+		goto out;
+	}
+
+	for (i = 0; i < num_sets * num_jobs; ++i) {
+		jobs[i].level = level;
+		jobs[i].windowed = block_size > WINDOW_BLOCK_SIZE;
+		jobs[i].node_budget = node_budget;
+		jobs[i].token_weight = token_weight;
+		jobs[i].keep_stats = be_verbose > 1;
+
+		if ((jobs[i].data = (byte *) malloc(block_size)) == NULL
+		 || (jobs[i].packed = (byte *) malloc(crush_max_packed_size(block_size))) == NULL
+		 || (i < num_jobs
+		  && pack_job_alloc_workmem(&jobs[i], pack_workmem_size(block_size, level, i == 0 && split_block ? num_threads : 1)))) {
+			printf_error("not enough memory");
+			goto out;
+		}
+
+		if (i >= num_jobs) {
+			jobs[i].workmem = jobs[i - num_jobs].workmem;
+		}
+	}
+
+	/* Open input file */
+	if ((oldfile = open_input(oldname)) == NULL) {
+		printf_usage("unable to open input file '%s'", oldname);
+		goto out;
+	}
+
+	/* Create output file */
+	if ((packedfile = open_output(packedname)) == NULL) {
+		printf_usage("unable to open output file '%s'", packedname);
+		goto out;
+	}
+
+	wr.file = packedfile;
+
+	rd.file = oldfile;
+	rd.block_size = block_size;
+	rd.max_jobs = num_jobs;
+
+	clocks = clock();
+
+	/* Read the first blocks */
+	rd.jobs = jobs;
+	pack_reader_run(&rd);
+
+	while (rd.num_jobs > 0) {
+		struct pack_job *cur_jobs = &jobs[cur * num_jobs];
+		const int cur_num_jobs = rd.num_jobs;
+		int reading = 0;
+		int failed;
+
+		for (i = 0; i < cur_num_jobs; ++i) {
+			cur_jobs[i].n_read = rd.n_read[i];
+		}
+
+		/* Read the next blocks into the other set while compressing */
+		if (pipelined && cur_num_jobs == num_jobs) {
+			rd.jobs = &jobs[(cur ^ 1) * num_jobs];
+
+			if (crush_thread_create(&rd.thread, pack_reader_run, &rd)) {
+				printf_error("unable to create thread");
+				goto out;
+			}
+
+			reading = 1;
+		}
+
+		/* Show a little progress indicator */
+		if (be_verbose) {
+			fprintf(stderr, "%c\r", rotator[counter]);
+			counter = (counter + 1) & 0x03;
+		}
+
+		/* Compress data blocks */
+		failed = run_pack_jobs(cur_jobs, cur_num_jobs, num_threads, split_block);
+
+		if (reading) {
+			crush_thread_join(&rd.thread);
+		}
+
+		if (writing) {
+			crush_thread_join(&wr.thread);
+			writing = 0;
+		}
+
+		if (failed || wr.res != 0) {
+			goto out;
+		}
+
+		/* Write the compressed blocks, on a thread if pipelined */
+		wr.jobs = cur_jobs;
+		wr.num_jobs = cur_num_jobs;
+
+		if (pipelined) {
+			if (crush_thread_create(&wr.thread, pack_writer_run, &wr)) {
+				printf_error("unable to create thread");
+				goto out;
+			}
+
+			writing = 1;
+		}
+		else {
+			pack_writer_run(&wr);
+
+			if (wr.res != 0) {
+				goto out;
+			}
+		}
+
+		if (cur_num_jobs < num_jobs) {
+			break;
+		}
+
+		if (pipelined) {
+			cur ^= 1;
+		}
+		else {
+			pack_reader_run(&rd);
+		}
+	}
+
+	if (writing) {
+		crush_thread_join(&wr.thread);
+		writing = 0;
+
+		if (wr.res != 0) {
+			goto out;
+		}
+	}
+
+	if (write_index && index_write(&wr.idx, packedname)) {
+		printf_usage("unable to write index file '%s" INDEX_SUFFIX "'", packedname);
+		goto out;
+	}
+
+	clocks = clock() - clocks;
+
+	/* Show result */
+	if (be_verbose) {
+		fprintf(stderr, "in %lld out %lld ratio %u%% time %.2f\n",
+		        wr.insize, wr.outsize, ratio(wr.outsize, wr.insize),
+		        (double) clocks / (double) CLOCKS_PER_SEC);
+	}
+
+	if (be_verbose > 1) {
+		print_stats(&wr.stats, level, node_budget);
+	}
+
+	res = 0;
+
+out:
+	if (writing) {
+		crush_thread_join(&wr.thread);
+	}
+
+	/* Close files */
+	if (packedfile != NULL) {
+		close_file(packedfile);
+	}
+	if (oldfile != NULL) {
+		close_file(oldfile);
+	}
+
+	/* Free memory */
+	free(wr.idx.entries);
+
+	if (jobs != NULL) {
+		for (i = 0; i < num_sets * num_jobs; ++i) {
+			if (i < num_jobs) {
+				pack_job_free_workmem(&jobs[i]);
+			}
+			free(jobs[i].packed);
+			free(jobs[i].data);
+		}
+
+		free(jobs);
+	}
+
+	return res;
+}
+
+/*
+ * Compress using memory-mapped files.
+ *
+ * Blocks are compressed directly from the input mapping. The output file is
+ * created with room for the maximum compressed size, and truncated at the
+ * end. With a single thread, blocks are compressed directly into the output
+ * mapping.
+ */
+static int
+compress_file_mmap(const char *oldname, const char *packedname,
+                   int be_verbose, int level, unsigned long node_budget,
+                   int token_weight, unsigned long block_size, int num_threads, int num_jobs,
+                   int split_block, int write_index)
+{
+	struct crush_map inmap, outmap;
+	struct pack_job *jobs = NULL;
+	struct block_index idx = { NULL, 0, 0 };
+	long long outsize = 0;
+	static const char rotator[] = "-\\|/";
+	unsigned int counter = 0;
+	size_t inpos = 0, outpos = 0;
+	size_t num_blocks, maxsize;
+	struct crush_stats stats;
+	clock_t clocks;
+	int i, cur_num_jobs;
+	int res = 1;
+
+	memset(&stats, 0, sizeof(stats));
+
+	crush_map_init(&inmap);
+	crush_map_init(&outmap);
+
+	/* Allocate memory */
+	if ((jobs = (struct pack_job *) calloc(num_jobs, sizeof(*jobs))) == NULL) {
+		printf_error("not enough memory");
+		goto out;
+	}
+
+	for (i = 0; i < num_jobs; ++i) {
+		jobs[i].level = level;
+		jobs[i].windowed = block_size > WINDOW_BLOCK_SIZE;
+		jobs[i].node_budget = node_budget;
+		jobs[i].token_weight = token_weight;
+		jobs[i].keep_stats = be_verbose > 1;
+
+		if (pack_job_alloc_workmem(&jobs[i], pack_workmem_size(block_size, level, i == 0 && split_block ? num_threads : 1))
+		 || (num_threads > 1
+		  && (jobs[i].packed = (byte *) malloc(crush_max_packed_size(block_size))) == NULL)) {
+			printf_error("not enough memory");
+			goto out;
+		}
+	}
+
+	/* Map input file */
+	if (crush_map_read(&inmap, oldname)) {
+		printf_usage("unable to open input file '%s'", oldname);
+		goto out;
+	}
+
+	/* Create output file with room for the worst case */
+	num_blocks = inmap.size / block_size + 1;
+
+	if (num_blocks > SIZE_MAX / (4 + crush_max_packed_size(block_size))) {
+		printf_error("input file too large to map");
+		goto out;
+	}
+
+	maxsize = num_blocks * (4 + crush_max_packed_size(block_size));
+
+	if (crush_map_write(&outmap, packedname, maxsize)) {
+		printf_usage("unable to open output file '%s'", packedname);
+		goto out;
+	}
+
+	clocks = clock();
+
+	while (inpos < inmap.size) {
+		/* Take up to num_jobs blocks from input mapping */
+		for (cur_num_jobs = 0; cur_num_jobs < num_jobs && inpos < inmap.size; ++cur_num_jobs) {
+			jobs[cur_num_jobs].data = inmap.data + inpos;
+			jobs[cur_num_jobs].n_read = inmap.size - inpos < block_size
+			                          ? inmap.size - inpos : block_size;
+			inpos += jobs[cur_num_jobs].n_read;
+		}
+
+		if (num_threads == 1) {
+			jobs[0].packed = outmap.data + outpos + 4;
+		}
+
+		/* Show a little progress indicator */
+		if (be_verbose) {
+			fprintf(stderr, "%c\r", rotator[counter]);
+			counter = (counter + 1) & 0x03;
+		}
+
+		/* Compress data blocks */
+		if (run_pack_jobs(jobs, cur_num_jobs, num_threads, split_block)) {
+			goto out;
+		}
+
+		/* Write blocks in input order */
+		for (i = 0; i < cur_num_jobs; ++i) {
+			/* Check for compression error */
+			if (jobs[i].packedsize == 0) {
+				printf_error("an error occured while compressing");
+				goto out;
+			}
+
+			write_le32(outmap.data + outpos, (unsigned long) jobs[i].n_read);
+
+			if (jobs[i].packed != outmap.data + outpos + 4) {
+				memcpy(outmap.data + outpos + 4, jobs[i].packed, jobs[i].packedsize);
+			}
+
+			outpos += 4 + jobs[i].packedsize;
+			stats_add(&stats, &jobs[i].stats);
+
+			if (write_index && index_add(&idx, (unsigned long) jobs[i].packedsize,
+			                             (unsigned long) jobs[i].n_read)) {
+				printf_error("not enough memory");
+				goto out;
+			}
+		}
+	}
+
+	outsize = (long long) outpos;
+
+	/* Set final size of output file */
+	if (crush_map_close(&outmap, outpos, 1)) {
+		printf_error("an error occured while writing");
+		goto out;
+	}
+
+	if (write_index && index_write(&idx, packedname)) {
+		printf_usage("unable to write index file '%s" INDEX_SUFFIX "'", packedname);
+		goto out;
+	}
+
+	clocks = clock() - clocks;
+
+	/* Show result */
+	if (be_verbose) {
+		fprintf(stderr, "in %lld out %lld ratio %u%% time %.2f\n",
+		        (long long) inmap.size, outsize, ratio(outsize, (long long) inmap.size),
+		        (double) clocks / (double) CLOCKS_PER_SEC);
+	}
+
+	if (be_verbose > 1) {
+		print_stats(&stats, level, node_budget);
+	}
+
+	res = 0;
+
+out:
+	/* Close files */
+	crush_map_close(&outmap, outpos, 1);
+	crush_map_close(&inmap, 0, 0);
+
+	/* Free memory */
+	free(idx.entries);
+
+	if (jobs != NULL) {
+		for (i = 0; i < num_jobs; ++i) {
+			pack_job_free_workmem(&jobs[i]);
+			if (num_threads > 1) {
+				free(jobs[i].packed);
+			}
+		}
+
+		free(jobs);
+	}
+
+	return res;
+}
+
+/*
+ * State for decompressing one block, possibly on a separate thread.
+ */
+struct depack_job {
+	byte *packed;
+	byte *data;
+	size_t capacity;
+	size_t packedsize;
+	size_t depackedsize;
+	unsigned long res;
+	struct crush_thread thread;
+};
+
+static void
+depack_job_run(void *arg)
+{
+	struct depack_job *job = (struct depack_job *) arg;
+
+	job->res = crush_depack_safe(job->packed, (unsigned long) job->packedsize,
+	                             job->data, (unsigned long) job->depackedsize);
+}
+
+/*
+ * Run jobs, the first one on this thread, returns 0 on success.
  */
-static unsigned long
-read_le32(const byte *p)
+static int
+run_depack_jobs(struct depack_job *jobs, int num_jobs)
 {
-	return ((unsigned long) octet(p[0]))
-	     | ((unsigned long) octet(p[1]) << 8)
-	     | ((unsigned long) octet(p[2]) << 16)
-	     | ((unsigned long) octet(p[3]) << 24);
+	int i;
+
+	for (i = 1; i < num_jobs; ++i) {
+		if (crush_thread_create(&jobs[i].thread, depack_job_run, &jobs[i])) {
+			printf_error("unable to create thread");
+
+			while (--i > 0) {
+				crush_thread_join(&jobs[i].thread);
+			}
+
+			return 1;
+		}
+	}
+
+	depack_job_run(&jobs[0]);
+
+	for (i = 1; i < num_jobs; ++i) {
+		crush_thread_join(&jobs[i].thread);
+	}
+
+	return 0;
 }
 
-static unsigned int
-ratio(long long x, long long y)
+/*
+ * Decompress blocks in parallel, using the block index to read each
+ * compressed block into memory.
+ *
+ * The buffers of the jobs are allocated for the largest block in the index.
+ * If each thread needs more than limit divided by num_threads bytes, fewer
+ * threads are used.
+ */
+static int
+decompress_indexed(FILE *packedfile, FILE *newfile,
+                   const struct block_index *idx,
+                   struct depack_job *jobs, int num_threads,
+                   unsigned long long limit, int be_verbose)
 {
-	if (x <= LLONG_MAX / 100) {
-		x *= 100;
+	byte header[4];
+	static const char rotator[] = "-\\|/";
+	unsigned int counter = 0;
+	unsigned long max_packedsize = 0, max_depackedsize = 0;
+	unsigned long long jobsize;
+	size_t next_entry;
+	int i, num_jobs;
+
+	for (next_entry = 0; next_entry < idx->num_entries; ++next_entry) {
+		const struct index_entry *entry = &idx->entries[next_entry];
+
+		if (entry->packedsize > max_packedsize) {
+			max_packedsize = entry->packedsize;
+		}
+		if (entry->depackedsize > max_depackedsize) {
+			max_depackedsize = entry->depackedsize;
+		}
 	}
-	else {
-		y /= 100;
+
+	jobsize = (unsigned long long) max_packedsize + max_depackedsize;
+
+	if (jobsize > limit) {
+		printf_error("decompressing needs %llu bytes, more than memory limit",
+		             jobsize);
+		return 1;
 	}
 
-	if (y == 0) {
-		y = 1;
+	if ((unsigned long long) num_threads * jobsize > limit) {
+		num_threads = (int) (limit / jobsize);
 	}
 
-	return (unsigned int) (x / y);
-}
+	if ((size_t) num_threads > idx->num_entries) {
+		num_threads = idx->num_entries > 0 ? (int) idx->num_entries : 1;
+	}
 
-static void
-printf_error(const char *fmt, ...)
-{
-	va_list arg;
+	/* Allocate memory */
+	for (i = 0; i < num_threads; ++i) {
+		if ((jobs[i].data = (byte *) malloc(max_depackedsize + 1)) == NULL
+		 || (jobs[i].packed = (byte *) malloc(max_packedsize + 1)) == NULL) {
+			printf_error("not enough memory");
+			return 1;
+		}
+	}
 
-	fputs("bcrush: ", stderr);
+	next_entry = 0;
 
-	va_start(arg, fmt);
-	vfprintf(stderr, fmt, arg);
-	va_end(arg);
+	while (next_entry < idx->num_entries) {
+		/* Read up to one compressed block per thread */
+		for (num_jobs = 0; num_jobs < num_threads && next_entry < idx->num_entries; ++num_jobs, ++next_entry) {
+			const struct index_entry *entry = &idx->entries[next_entry];
 
-	fputs("\n", stderr);
+			if (fread(header, 1, sizeof(header), packedfile) != sizeof(header)
+			 || read_le32(header) != entry->depackedsize
+			 || fread(jobs[num_jobs].packed, 1, entry->packedsize, packedfile) != entry->packedsize) {
+				printf_error("an error occured while reading");
+				return 1;
+			}
+
+			jobs[num_jobs].packedsize = entry->packedsize;
+			jobs[num_jobs].depackedsize = entry->depackedsize;
+		}
+
+		/* Show a little progress indicator */
+		if (be_verbose) {
+			fprintf(stderr, "%c\r", rotator[counter]);
+			counter = (counter + 1) & 0x03;
+		}
+
+		/* Decompress data blocks */
+		if (run_depack_jobs(jobs, num_jobs)) {
+			return 1;
+		}
+
+		/* Write blocks in order */
+		for (i = 0; i < num_jobs; ++i) {
+			/* Check for decompression error */
+			if (jobs[i].res != jobs[i].depackedsize) {
+				printf_error("an error occured while decompressing");
+				return 1;
+			}
+
+			fwrite(jobs[i].data, 1, jobs[i].depackedsize, newfile);
+		}
+	}
+
+	return 0;
 }
 
+/*
+ * Writing a decompressed block to a file.
+ */
+struct depack_writer {
+	FILE *file;
+	const byte *data;
+	size_t size;
+	struct crush_thread thread;
+};
+
 static void
-printf_usage(const char *fmt, ...)
+depack_writer_run(void *arg)
 {
-	va_list arg;
-
-	fputs("bcrush: ", stderr);
-
-	va_start(arg, fmt);
-	vfprintf(stderr, fmt, arg);
-	va_end(arg);
+	struct depack_writer *wr = (struct depack_writer *) arg;
 
-	fputs("\n"
-	      "usage: bcrush [-56789 | --optimal] [-v] INFILE OUTFILE\n"
-	      "       bcrush -d [-v] INFILE OUTFILE\n"
-	      "       bcrush -V | --version\n"
-	      "       bcrush -h | --help\n", stderr);
+	fwrite(wr->data, 1, wr->size, wr->file);
 }
 
+/*
+ * Decompress from file or standard input.
+ *
+ * In pipelined mode, files without an index are decompressed alternately
+ * into two buffers, and each block is written on a writer thread while the
+ * next one is decompressed. Files with an index are decompressed in
+ * parallel when using more than one thread, and do not need this.
+ *
+ * Buffers are allocated for the size of the blocks in the file, and limit
+ * is the maximum memory to use for them.
+ */
 static int
-compress_file(const char *oldname, const char *packedname, int be_verbose,
-              int level)
+decompress_file(const char *packedname, const char *newname, int be_verbose,
+                int num_threads, int pipelined, unsigned long long limit)
 {
 	byte header[4];
-	FILE *oldfile = NULL;
+	FILE *newfile = NULL;
 	FILE *packedfile = NULL;
-	byte *data = NULL;
-	byte *packed = NULL;
-	byte *workmem = NULL;
+	struct depack_job *jobs = NULL;
+	struct block_index idx = { NULL, 0, 0 };
+	struct depack_writer wr;
 	long long insize = 0, outsize = 0;
 	static const char rotator[] = "-\\|/";
 	unsigned int counter = 0;
-	size_t n_read;
+	const int num_jobs = pipelined && num_threads < 2 ? 2 : num_threads;
+	const int num_bufs = pipelined ? 2 : 1;
+	int writing = 0;
+	int cur = 0;
+	size_t entry;
 	clock_t clocks;
+	int i;
 	int res = 1;
 
 	/* Allocate memory */
-	if ((data = (byte *) malloc(BLOCK_SIZE)) == NULL
-	 || (packed = (byte *) malloc(crush_max_packed_size(BLOCK_SIZE))) == NULL
-	 || (workmem = (byte *) malloc(crush_workmem_size_level(BLOCK_SIZE, level))) == NULL) {
+	if ((jobs = (struct depack_job *) calloc(num_jobs, sizeof(*jobs))) == NULL) {
 		printf_error("not enough memory");
 		goto out;
 	}
 
 	/* Open input file */
-	if ((oldfile = fopen(oldname, "rb")) == NULL) {
-		printf_usage("unable to open input file '%s'", oldname);
+	if ((packedfile = open_input(packedname)) == NULL) {
+		printf_usage("unable to open input file '%s'", packedname);
 		goto out;
 	}
 
 	/* Create output file */
-	if ((packedfile = fopen(packedname, "wb")) == NULL) {
-		printf_usage("unable to open output file '%s'", packedname);
+	if ((newfile = open_output(newname)) == NULL) {
+		printf_usage("unable to open output file '%s'", newname);
 		goto out;
 	}
 
+	wr.file = newfile;
+
 	clocks = clock();
 
-	/* While we are able to read data from input file .. */
-	while ((n_read = fread(data, 1, BLOCK_SIZE, oldfile)) > 0) {
-		size_t packedsize;
+	/* Use block index to decompress in parallel if available */
+	if (num_threads > 1 && index_read(&idx, packedname, packedfile) == 0) {
+		if (decompress_indexed(packedfile, newfile, &idx, jobs,
+		                       num_threads, limit, be_verbose)) {
+			goto out;
+		}
 
-		/* Show a little progress indicator */
-		if (be_verbose) {
-			fprintf(stderr, "%c\r", rotator[counter]);
-			counter = (counter + 1) & 0x03;
+		for (entry = 0; entry < idx.num_entries; ++entry) {
+			outsize += (long long) idx.entries[entry].depackedsize;
 		}
+	}
+	else {
+		/* While we are able to read a header from input file .. */
+		while (fread(header, 1, sizeof(header), packedfile) == sizeof(header)) {
+			size_t hdr_depackedsize, depackedsize;
+
+			/* Show a little progress indicator */
+			if (be_verbose) {
+				fprintf(stderr, "%c\r", rotator[counter]);
+				counter = (counter + 1) & 0x03;
+			}
 
-		/* Compress data block */
-		packedsize = crush_pack_level(data, packed, (unsigned long) n_read,
-		                              workmem, level);
+			/* Get original size from header */
+			hdr_depackedsize = (size_t) read_le32(header);
 
-		/* Check for compression error */
-		if (packedsize == 0) {
-			printf_error("an error occured while compressing");
-			goto out;
-		}
+			/* Check blocksize is sufficient */
+			if (hdr_depackedsize > BLOCK_SIZE) {
+				printf_usage("compressed file requires block size"
+					     " >= %lu bytes", hdr_depackedsize);
+				goto out;
+			}
 
-		/* Put block-specific values into header */
-		write_le32(header, (unsigned long) n_read);
+			/* Grow buffer if block is larger than previous ones */
+			if (hdr_depackedsize > jobs[cur].capacity) {
+				if ((unsigned long long) num_bufs * hdr_depackedsize > limit) {
+					printf_error("decompressing needs %llu bytes, more than memory limit",
+					             (unsigned long long) num_bufs * hdr_depackedsize);
+					goto out;
+				}
 
-		/* Write header and compressed data */
-		fwrite(header, 1, sizeof(header), packedfile);
-		fwrite(packed, 1, packedsize, packedfile);
+				free(jobs[cur].data);
 
-		/* Sum input and output size */
-		insize += n_read;
-		outsize += packedsize + sizeof(header);
+				if ((jobs[cur].data = (byte *) malloc(hdr_depackedsize)) == NULL) {
+					printf_error("not enough memory");
+					goto out;
+				}
+
+				jobs[cur].capacity = hdr_depackedsize;
+			}
+
+			/* Decompress data */
+			depackedsize = crush_depack_file(packedfile, jobs[cur].data,
+			                                 (unsigned long) hdr_depackedsize);
+
+			/* Check for decompression error */
+			if (depackedsize != hdr_depackedsize) {
+				printf_error("an error occured while decompressing");
+				goto out;
+			}
+
+			/* Write decompressed data, on a thread if pipelined */
+			if (writing) {
+				crush_thread_join(&wr.thread);
+				writing = 0;
+			}
+
+			wr.data = jobs[cur].data;
+			wr.size = depackedsize;
+			outsize += (long long) depackedsize;
+
+			if (pipelined) {
+				if (crush_thread_create(&wr.thread, depack_writer_run, &wr)) {
+					printf_error("unable to create thread");
+					goto out;
+				}
+
+				writing = 1;
+				cur ^= 1;
+			}
+			else {
+				depack_writer_run(&wr);
+			}
+		}
+
+		if (writing) {
+			crush_thread_join(&wr.thread);
+			writing = 0;
+		}
 	}
 
 	clocks = clock() - clocks;
 
+	/* The input size is only known if it is seekable */
+	insize = ftello(packedfile);
+
 	/* Show result */
-	if (be_verbose) {
+	if (be_verbose && insize >= 0) {
 		fprintf(stderr, "in %lld out %lld ratio %u%% time %.2f\n",
-		        insize, outsize, ratio(outsize, insize),
+		        insize, outsize, ratio(insize, outsize),
+		        (double) clocks / (double) CLOCKS_PER_SEC);
+	}
+	else if (be_verbose) {
+		fprintf(stderr, "out %lld time %.2f\n", outsize,
 		        (double) clocks / (double) CLOCKS_PER_SEC);
 	}
 
 	res = 0;
 
 out:
+	if (writing) {
+		crush_thread_join(&wr.thread);
+	}
+
 	/* Close files */
 	if (packedfile != NULL) {
-		fclose(packedfile);
+		close_file(packedfile);
 	}
-	if (oldfile != NULL) {
-		fclose(oldfile);
+	if (newfile != NULL) {
+		close_file(newfile);
 	}
 
 	/* Free memory */
-	if (workmem != NULL) {
-		free(workmem);
-	}
-	if (packed != NULL) {
-		free(packed);
-	}
-	if (data != NULL) {
-		free(data);
+	free(idx.entries);
+
+	if (jobs != NULL) {
+		for (i = 0; i < num_jobs; ++i) {
+			free(jobs[i].packed);
+			free(jobs[i].data);
+		}
+
+		free(jobs);
 	}
 
 	return res;
 }
 
+/*
+ * Decompress using memory-mapped files.
+ *
+ * This needs the block index to know where blocks start and the size of the
+ * output, so files without one are decompressed with decompress_file. Blocks
+ * are decompressed directly from the input mapping into the output mapping.
+ */
 static int
-decompress_file(const char *packedname, const char *newname, int be_verbose)
+decompress_file_mmap(const char *packedname, const char *newname,
+                     int be_verbose, int num_threads, unsigned long long limit)
 {
-	byte header[4];
-	FILE *newfile = NULL;
+	struct crush_map inmap, outmap;
 	FILE *packedfile = NULL;
-	byte *data = NULL;
-	long long insize = 0, outsize = 0;
+	struct depack_job *jobs = NULL;
+	struct block_index idx = { NULL, 0, 0 };
 	static const char rotator[] = "-\\|/";
 	unsigned int counter = 0;
+	size_t inpos = 0, outpos = 0, outsize = 0;
+	size_t next_entry;
 	clock_t clocks;
+	int i, num_jobs;
 	int res = 1;
 
+	crush_map_init(&inmap);
+	crush_map_init(&outmap);
+
+	/* Read block index */
+	if ((packedfile = fopen(packedname, "rb")) == NULL) {
+		printf_usage("unable to open input file '%s'", packedname);
+		goto out;
+	}
+
+	if (index_read(&idx, packedname, packedfile) != 0) {
+		fclose(packedfile);
+		free(idx.entries);
+		return decompress_file(packedname, newname, be_verbose, num_threads, 0,
+		                       limit);
+	}
+
+	for (next_entry = 0; next_entry < idx.num_entries; ++next_entry) {
+		if (idx.entries[next_entry].depackedsize > SIZE_MAX - outsize) {
+			printf_error("output file too large to map");
+			goto out;
+		}
+
+		outsize += idx.entries[next_entry].depackedsize;
+	}
+
 	/* Allocate memory */
-	if ((data = (byte *) malloc(BLOCK_SIZE)) == NULL) {
+	if ((jobs = (struct depack_job *) calloc(num_threads, sizeof(*jobs))) == NULL) {
 		printf_error("not enough memory");
 		goto out;
 	}
 
-	/* Open input file */
-	if ((packedfile = fopen(packedname, "rb")) == NULL) {
+	/* Map input file, and create output file of final size */
+	if (crush_map_read(&inmap, packedname)) {
 		printf_usage("unable to open input file '%s'", packedname);
 		goto out;
 	}
 
-	/* Create output file */
-	if ((newfile = fopen(newname, "wb")) == NULL) {
+	if (crush_map_write(&outmap, newname, outsize)) {
 		printf_usage("unable to open output file '%s'", newname);
 		goto out;
 	}
 
 	clocks = clock();
 
-	/* While we are able to read a header from input file .. */
-	while (fread(header, 1, sizeof(header), packedfile) == sizeof(header)) {
-		size_t hdr_depackedsize, depackedsize;
+	next_entry = 0;
+
+	while (next_entry < idx.num_entries) {
+		/* Take up to one compressed block per thread */
+		for (num_jobs = 0; num_jobs < num_threads && next_entry < idx.num_entries; ++num_jobs, ++next_entry) {
+			const struct index_entry *entry = &idx.entries[next_entry];
+
+			if (read_le32(inmap.data + inpos) != entry->depackedsize) {
+				printf_error("an error occured while reading");
+				goto out;
+			}
+
+			jobs[num_jobs].packed = inmap.data + inpos + 4;
+			jobs[num_jobs].data = outmap.data + outpos;
+			jobs[num_jobs].packedsize = entry->packedsize;
+			jobs[num_jobs].depackedsize = entry->depackedsize;
+
+			inpos += 4 + entry->packedsize;
+			outpos += entry->depackedsize;
+		}
 
 		/* Show a little progress indicator */
 		if (be_verbose) {
@@ -288,39 +1718,32 @@ decompress_file(const char *packedname, const char *newname, int be_verbose)
 			counter = (counter + 1) & 0x03;
 		}
 
-		/* Get original size from header */
-		hdr_depackedsize = (size_t) read_le32(header);
-
-		/* Check blocksize is sufficient */
-		if (hdr_depackedsize > BLOCK_SIZE) {
-			printf_usage("compressed file requires block size"
-				     " >= %lu bytes", hdr_depackedsize);
+		/* Decompress data blocks */
+		if (run_depack_jobs(jobs, num_jobs)) {
 			goto out;
 		}
 
-		/* Decompress data */
-		depackedsize = crush_depack_file(packedfile, data,
-		                                 (unsigned long) hdr_depackedsize);
-
 		/* Check for decompression error */
-		if (depackedsize != hdr_depackedsize) {
-			printf_error("an error occured while decompressing");
-			goto out;
+		for (i = 0; i < num_jobs; ++i) {
+			if (jobs[i].res != jobs[i].depackedsize) {
+				printf_error("an error occured while decompressing");
+				goto out;
+			}
 		}
+	}
 
-		/* Write decompressed data */
-		fwrite(data, 1, depackedsize, newfile);
+	if (crush_map_close(&outmap, outsize, 1)) {
+		printf_error("an error occured while writing");
+		goto out;
 	}
 
 	clocks = clock() - clocks;
 
-	insize = ftello(packedfile);
-	outsize = ftello(newfile);
-
 	/* Show result */
 	if (be_verbose) {
 		fprintf(stderr, "in %lld out %lld ratio %u%% time %.2f\n",
-		        insize, outsize, ratio(insize, outsize),
+		        (long long) inmap.size, (long long) outsize,
+		        ratio((long long) inmap.size, (long long) outsize),
 		        (double) clocks / (double) CLOCKS_PER_SEC);
 	}
 
@@ -331,32 +1754,121 @@ out:
 	if (packedfile != NULL) {
 		fclose(packedfile);
 	}
-	if (newfile != NULL) {
-		fclose(newfile);
-	}
+	crush_map_close(&outmap, outsize, 1);
+	crush_map_close(&inmap, 0, 0);
 
 	/* Free memory */
-	if (data != NULL) {
-		free(data);
-	}
+	free(idx.entries);
+	free(jobs);
 
 	return res;
 }
 
+/*
+ * Get the size of file name, or -1 if it is standard input or the size is
+ * not known.
+ */
+static long long
+input_size(const char *name)
+{
+	FILE *file;
+	long long size = -1;
+
+	if (strcmp(name, "-") == 0 || (file = fopen(name, "rb")) == NULL) {
+		return -1;
+	}
+
+	if (fseeko(file, 0, SEEK_END) == 0) {
+		size = ftello(file);
+	}
+
+	fclose(file);
+
+	return size;
+}
+
+/*
+ * Parse a size with an optional K, M or G suffix, returns 0 on success.
+ */
+static int
+parse_size(const char *s, unsigned long long *size)
+{
+	unsigned long long val;
+	char *end;
+	int shift = 0;
+
+	if (*s < '0' || *s > '9') {
+		return 1;
+	}
+
+	errno = 0;
+	val = strtoull(s, &end, 10);
+
+	if (errno != 0) {
+		return 1;
+	}
+
+	switch (*end) {
+	case 'K':
+	case 'k':
+		shift = 10;
+		++end;
+		break;
+	case 'M':
+	case 'm':
+		shift = 20;
+		++end;
+		break;
+	case 'G':
+	case 'g':
+		shift = 30;
+		++end;
+		break;
+	default:
+		break;
+	}
+
+	if (*end != '\0' || val > (ULLONG_MAX >> shift)) {
+		return 1;
+	}
+
+	*size = val << shift;
+
+	return 0;
+}
+
 static void
 print_syntax(void)
 {
 	fputs("usage: bcrush [options] INFILE OUTFILE\n"
 	      "\n"
 	      "options:\n"
-	      "  -5                     compress faster (default)\n"
+	      "  -1                     compress faster\n"
+	      "  -5                     default compression level\n"
 	      "  -9                     compress better\n"
 	      "      --optimal          optimal but very slow compression\n"
+	      "  -a, --adaptive N       adapt search depth to check about N match\n"
+	      "                         candidates per byte (levels 5 and up)\n"
+	      "  -b, --block-size SIZE  compress in blocks of SIZE bytes (default 64M)\n"
 	      "  -d, --decompress       decompress\n"
 	      "  -h, --help             print this help and exit\n"
-	      "  -v, --verbose          verbose mode\n"
+	      "  -i, --index            write OUTFILE.idx for parallel decompression\n"
+	      "  -m, --mmap             use memory-mapped files\n"
+	      "      --memory-limit SIZE\n"
+	      "                         reduce block size, threads and level to use at\n"
+	      "                         most SIZE bytes of memory\n"
+	      "  -p, --pipeline         overlap reading and writing with (de)compression\n"
+	      "      --split-block      give spare threads to parsing a block over 4M\n"
+	      "                         (levels 8 and up, experimental)\n"
+	      "  -T, --threads N        use N threads\n"
+	      "      --token-weight N   count each literal and match as N bits more, for\n"
+	      "                         fewer tokens, N from 1 to 16 (levels 5 and up)\n"
+	      "  -v, --verbose          verbose mode, twice for statistics\n"
 	      "  -V, --version          print version and exit\n"
 	      "\n"
+	      "Use - as INFILE or OUTFILE for standard input or output. SIZE may have\n"
+	      "a suffix of K, M or G.\n"
+	      "\n"
 	      "PLEASE NOTE: This is an experiment, use at your own risk.\n", stdout);
 }
 
@@ -378,14 +1890,35 @@ main(int argc, char *argv[])
 	const char *infile = NULL;
 	const char *outfile = NULL;
 	int flag_decompress = 0;
+	int flag_index = 0;
+	int flag_mmap = 0;
+	int flag_pipeline = 0;
+	int flag_split = 0;
 	int flag_verbose = 0;
 	int level = 5;
+	unsigned long node_budget = 0;
+	int token_weight = 0;
+	int num_threads = 1;
+	int num_jobs;
+	unsigned long block_size = BLOCK_SIZE;
+	unsigned long long memory_limit = ULLONG_MAX;
+	unsigned long long size;
+	long long insize;
 	int c;
 
 	const struct parg_option long_options[] = {
+		{ "adaptive", PARG_REQARG, NULL, 'a' },
+		{ "block-size", PARG_REQARG, NULL, 'b' },
 		{ "decompress", PARG_NOARG, NULL, 'd' },
 		{ "help", PARG_NOARG, NULL, 'h' },
+		{ "index", PARG_NOARG, NULL, 'i' },
+		{ "memory-limit", PARG_REQARG, NULL, 'M' },
+		{ "mmap", PARG_NOARG, NULL, 'm' },
 		{ "optimal", PARG_NOARG, NULL, 'x' },
+		{ "pipeline", PARG_NOARG, NULL, 'p' },
+		{ "split-block", PARG_NOARG, NULL, 'S' },
+		{ "threads", PARG_REQARG, NULL, 'T' },
+		{ "token-weight", PARG_REQARG, NULL, 'W' },
 		{ "verbose", PARG_NOARG, NULL, 'v' },
 		{ "version", PARG_NOARG, NULL, 'V' },
 		{ 0, 0, 0, 0 }
@@ -393,7 +1926,7 @@ main(int argc, char *argv[])
 
 	parg_init(&ps);
 
-	while ((c = parg_getopt_long(&ps, argc, argv, "56789dhvVx", long_options, NULL)) != -1) {
+	while ((c = parg_getopt_long(&ps, argc, argv, "123456789a:b:dhimpT:vVx", long_options, NULL)) != -1) {
 		switch (c) {
 		case 1:
 			if (infile == NULL) {
@@ -407,6 +1940,10 @@ main(int argc, char *argv[])
 				return EXIT_FAILURE;
 			}
 			break;
+		case '1':
+		case '2':
+		case '3':
+		case '4':
 		case '5':
 		case '6':
 		case '7':
@@ -417,6 +1954,23 @@ main(int argc, char *argv[])
 		case 'x':
 			level = 10;
 			break;
+		case 'a':
+			node_budget = strtoul(ps.optarg, NULL, 10);
+			if (node_budget < 1 || node_budget > MAX_NODE_BUDGET) {
+				printf_usage("adaptive budget must be between 1 and %lu",
+				             MAX_NODE_BUDGET);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'b':
+			if (parse_size(ps.optarg, &size)
+			 || size < MIN_BLOCK_SIZE || size > BLOCK_SIZE) {
+				printf_usage("block size must be between %lu and %lu bytes",
+				             MIN_BLOCK_SIZE, BLOCK_SIZE);
+				return EXIT_FAILURE;
+			}
+			block_size = (unsigned long) size;
+			break;
 		case 'd':
 			flag_decompress = 1;
 			break;
@@ -424,8 +1978,42 @@ main(int argc, char *argv[])
 			print_syntax();
 			return EXIT_SUCCESS;
 			break;
+		case 'i':
+			flag_index = 1;
+			break;
+		case 'm':
+			flag_mmap = 1;
+			break;
+		case 'M':
+			if (parse_size(ps.optarg, &memory_limit)) {
+				printf_usage("invalid memory limit '%s'", ps.optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			flag_pipeline = 1;
+			break;
+		case 'S':
+			flag_split = 1;
+			break;
+		case 'T':
+			num_threads = atoi(ps.optarg);
+			if (num_threads < 1 || num_threads > MAX_THREADS) {
+				printf_usage("number of threads must be between 1 and %d",
+				             MAX_THREADS);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'W':
+			token_weight = atoi(ps.optarg);
+			if (token_weight < 1 || token_weight > CRUSH_MAX_TOKEN_WEIGHT) {
+				printf_usage("token weight must be between 1 and %d",
+				             CRUSH_MAX_TOKEN_WEIGHT);
+				return EXIT_FAILURE;
+			}
+			break;
 		case 'v':
-			flag_verbose = 1;
+			flag_verbose++;
 			break;
 		case 'V':
 			print_version();
@@ -443,11 +2031,74 @@ main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	/* The index is written to a file next to the output */
+	if (flag_index && !flag_decompress && strcmp(outfile, "-") == 0) {
+		printf_usage("cannot write index for standard output");
+		return EXIT_FAILURE;
+	}
+
+	/* Standard input and output cannot be mapped */
+	if (strcmp(infile, "-") == 0 || strcmp(outfile, "-") == 0) {
+		flag_mmap = 0;
+	}
+
 	if (flag_decompress) {
-		return decompress_file(infile, outfile, flag_verbose);
+		if (flag_mmap) {
+			return decompress_file_mmap(infile, outfile, flag_verbose,
+			                            num_threads, memory_limit);
+		}
+
+		return decompress_file(infile, outfile, flag_verbose, num_threads,
+		                       flag_pipeline, memory_limit);
 	}
 	else {
-		return compress_file(infile, outfile, flag_verbose, level);
+		const int num_sets = flag_pipeline && !flag_mmap ? 2 : 1;
+		unsigned long req_block_size;
+		int req_level, req_num_threads;
+
+		/* Use smaller blocks for small files */
+		insize = input_size(infile);
+
+		if (insize >= 0 && (unsigned long long) insize < block_size) {
+			block_size = insize > 0 ? (unsigned long) insize : 1;
+		}
+
+		req_block_size = block_size;
+		req_level = level;
+		req_num_threads = num_threads;
+
+		if (fit_memory_limit(memory_limit, insize, num_sets, flag_mmap,
+		                     flag_split, &block_size, &level, &num_threads)) {
+			printf_error("compressing needs %llu bytes, more than memory limit",
+			             pack_memory_size(block_size, level, num_threads, flag_split,
+			                              pack_num_jobs(insize, block_size, num_threads),
+			                              num_sets, flag_mmap));
+			return EXIT_FAILURE;
+		}
+
+		num_jobs = pack_num_jobs(insize, block_size, num_threads);
+
+		/* Show the settings chosen if the memory limit changed them */
+		if (flag_verbose || block_size != req_block_size
+		 || level != req_level || num_threads != req_num_threads) {
+			fprintf(stderr, "block size %lu level %d threads %d memory %llu\n",
+			        block_size, level, num_threads,
+			        pack_memory_size(block_size, level, num_threads,
+			                         flag_split, num_jobs, num_sets,
+			                         flag_mmap));
+		}
+
+		if (flag_mmap) {
+			return compress_file_mmap(infile, outfile, flag_verbose, level,
+			                          node_budget, token_weight,
+			                          block_size, num_threads, num_jobs,
+			                          flag_split, flag_index);
+		}
+
+		return compress_file(infile, outfile, flag_verbose, level,
+		                     node_budget, token_weight, block_size,
+		                     num_threads, num_jobs, flag_split, flag_index,
+		                     flag_pipeline);
 	}
 
 	return EXIT_SUCCESS;
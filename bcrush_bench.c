@@ -0,0 +1,935 @@
+/*
+ * bcrush-bench - Benchmark CRUSH compression with BriefLZ algorithms
+ *
+ * Copyright (c) 2018-2020 Joergen Ibsen
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *   1. The origin of this software must not be misrepresented; you must
+ *      not claim that you wrote the original software. If you use this
+ *      software in a product, an acknowledgment in the product
+ *      documentation would be appreciated but is not required.
+ *
+ *   2. Altered source versions must be plainly marked as such, and must
+ *      not be misrepresented as being the original software.
+ *
+ *   3. This notice may not be removed or altered from any source
+ *      distribution.
+ */
+
+#ifdef _MSC_VER
+#  define _CRT_SECURE_NO_WARNINGS
+#else
+#  define _POSIX_C_SOURCE 200112L
+#endif
+
+#if defined(__MINGW32__) && !defined(__USE_MINGW_ANSI_STDIO)
+#  define __USE_MINGW_ANSI_STDIO 1
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <dirent.h>
+#  include <sys/stat.h>
+#  include <time.h>
+#endif
+
+#include "crush.h"
+#include "parg.h"
+
+/*
+ * Files are split into blocks of this size, like bcrush does.
+ */
+#ifndef BLOCK_SIZE
+#  define BLOCK_SIZE (64 * 1024 * 1024UL)
+#endif
+
+#define MAX_LEVEL 10
+
+/*
+ * Unsigned char type.
+ */
+typedef unsigned char byte;
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	FORMAT_JSON
+};
+
+/*
+ * List of files to benchmark.
+ */
+struct file_list {
+	char **names;
+	size_t num_names;
+	size_t capacity;
+};
+
+/*
+ * Result for one file at one level.
+ *
+ * Times are the fastest of the repeats, in seconds.
+ */
+struct bench_result {
+	const char *name;
+	int level;
+	unsigned long long insize;
+	unsigned long long outsize;
+	size_t workmem_size;
+	double pack_time;
+	double depack_time;
+	double safe_time;
+	double file_time;
+};
+
+/*
+ * Data for one file, split into blocks.
+ */
+struct bench_data {
+	byte *data;
+	byte *packed;
+	byte *depacked;
+	unsigned long *packedsize;
+	size_t size;
+	size_t num_blocks;
+	FILE *packedfile;
+};
+
+static void
+printf_error(const char *fmt, ...)
+{
+	va_list arg;
+
+	fputs("bcrush-bench: ", stderr);
+
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+
+	fputs("\n", stderr);
+}
+
+static void
+printf_usage(const char *fmt, ...)
+{
+	va_list arg;
+
+	fputs("bcrush-bench: ", stderr);
+
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+
+	fputs("\n"
+	      "usage: bcrush-bench [-l LEVELS] [-r N] [-w N] [-f FORMAT] PATH...\n"
+	      "       bcrush-bench -V | --version\n"
+	      "       bcrush-bench -h | --help\n", stderr);
+}
+
+/*
+ * Get wall clock time in seconds from an arbitrary starting point.
+ */
+static double
+wall_time(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+
+	return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*
+ * Append a copy of name to file list, returns 0 on success.
+ */
+static int
+file_list_add(struct file_list *list, const char *name)
+{
+	char *copy;
+
+	if (list->num_names == list->capacity) {
+		size_t new_capacity = list->capacity ? 2 * list->capacity : 16;
+		char **names = (char **) realloc(list->names, new_capacity * sizeof(*names));
+
+		if (names == NULL) {
+			return 1;
+		}
+
+		list->names = names;
+		list->capacity = new_capacity;
+	}
+
+	copy = (char *) malloc(strlen(name) + 1);
+
+	if (copy == NULL) {
+		return 1;
+	}
+
+	strcpy(copy, name);
+
+	list->names[list->num_names++] = copy;
+
+	return 0;
+}
+
+static void
+file_list_free(struct file_list *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->num_names; ++i) {
+		free(list->names[i]);
+	}
+
+	free(list->names);
+
+	list->names = NULL;
+	list->num_names = 0;
+	list->capacity = 0;
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Join directory and file name, returns NULL on error.
+ */
+static char *
+join_path(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	char *path = (char *) malloc(dir_len + strlen(name) + 2);
+
+	if (path == NULL) {
+		return NULL;
+	}
+
+	strcpy(path, dir);
+
+	if (dir_len > 0 && dir[dir_len - 1] != '/' && dir[dir_len - 1] != '\\') {
+		strcat(path, "/");
+	}
+
+	strcat(path, name);
+
+	return path;
+}
+
+/*
+ * Add path to file list, returns 0 on success.
+ *
+ * If path is a directory, the regular files in it are added in sorted
+ * order. Subdirectories are not searched.
+ */
+static int
+file_list_add_path(struct file_list *list, const char *path)
+{
+	size_t first = list->num_names;
+	int res = 1;
+
+#if defined(_WIN32)
+	WIN32_FIND_DATAA fd;
+	HANDLE find;
+	DWORD attr = GetFileAttributesA(path);
+	char *pattern;
+
+	if (attr == INVALID_FILE_ATTRIBUTES) {
+		printf_error("unable to open '%s'", path);
+		return 1;
+	}
+
+	if (!(attr & FILE_ATTRIBUTE_DIRECTORY)) {
+		return file_list_add(list, path);
+	}
+
+	if ((pattern = join_path(path, "*")) == NULL) {
+		return 1;
+	}
+
+	find = FindFirstFileA(pattern, &fd);
+
+	free(pattern);
+
+	if (find == INVALID_HANDLE_VALUE) {
+		printf_error("unable to read directory '%s'", path);
+		return 1;
+	}
+
+	do {
+		char *name;
+
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			continue;
+		}
+
+		if ((name = join_path(path, fd.cFileName)) == NULL) {
+			goto out;
+		}
+
+		if (file_list_add(list, name)) {
+			free(name);
+			goto out;
+		}
+
+		free(name);
+	} while (FindNextFileA(find, &fd));
+
+	res = 0;
+
+out:
+	FindClose(find);
+#else
+	struct stat st;
+	struct dirent *entry;
+	DIR *dir;
+
+	if (stat(path, &st) != 0) {
+		printf_error("unable to open '%s'", path);
+		return 1;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		return file_list_add(list, path);
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		printf_error("unable to read directory '%s'", path);
+		return 1;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		char *name = join_path(path, entry->d_name);
+
+		if (name == NULL) {
+			goto out;
+		}
+
+		if (stat(name, &st) == 0 && S_ISREG(st.st_mode)
+		 && file_list_add(list, name)) {
+			free(name);
+			goto out;
+		}
+
+		free(name);
+	}
+
+	res = 0;
+
+out:
+	closedir(dir);
+#endif
+
+	/* Sort the files from this directory for stable output */
+	qsort(list->names + first, list->num_names - first,
+	      sizeof(list->names[0]), compare_names);
+
+	return res;
+}
+
+/*
+ * Parse list of levels like "1-9" or "1,5,9" into flags, returns 0 on
+ * success.
+ */
+static int
+parse_levels(const char *s, int *levels)
+{
+	int i;
+
+	for (i = 0; i <= MAX_LEVEL; ++i) {
+		levels[i] = 0;
+	}
+
+	while (*s != '\0') {
+		char *end;
+		long first = strtol(s, &end, 10);
+		long last = first;
+
+		if (end == s) {
+			return 1;
+		}
+
+		s = end;
+
+		if (*s == '-') {
+			++s;
+			last = strtol(s, &end, 10);
+
+			if (end == s) {
+				return 1;
+			}
+
+			s = end;
+		}
+
+		if (first < 1 || last > MAX_LEVEL || first > last) {
+			return 1;
+		}
+
+		for (i = (int) first; i <= (int) last; ++i) {
+			levels[i] = 1;
+		}
+
+		if (*s == ',') {
+			++s;
+		}
+		else if (*s != '\0') {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Read file into bench data, returns 0 on success.
+ */
+static int
+bench_data_load(struct bench_data *bd, const char *name)
+{
+	FILE *f;
+	long size;
+	size_t max_block;
+	int res = 1;
+
+	memset(bd, 0, sizeof(*bd));
+
+	if ((f = fopen(name, "rb")) == NULL) {
+		printf_error("unable to open '%s'", name);
+		return 1;
+	}
+
+	if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0
+	 || fseek(f, 0, SEEK_SET) != 0) {
+		printf_error("unable to get size of '%s'", name);
+		goto out;
+	}
+
+	bd->size = (size_t) size;
+	bd->num_blocks = (bd->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	max_block = bd->size < BLOCK_SIZE ? bd->size : BLOCK_SIZE;
+
+	bd->data = (byte *) malloc(bd->size ? bd->size : 1);
+	bd->depacked = (byte *) malloc(bd->size ? bd->size : 1);
+	bd->packed = (byte *) malloc(bd->num_blocks * crush_max_packed_size(max_block) + 1);
+	bd->packedsize = (unsigned long *) malloc((bd->num_blocks + 1) * sizeof(unsigned long));
+
+	if (bd->data == NULL || bd->depacked == NULL || bd->packed == NULL
+	 || bd->packedsize == NULL) {
+		printf_error("not enough memory for '%s'", name);
+		goto out;
+	}
+
+	if (fread(bd->data, 1, bd->size, f) != bd->size) {
+		printf_error("an error occured while reading '%s'", name);
+		goto out;
+	}
+
+	if ((bd->packedfile = tmpfile()) == NULL) {
+		printf_error("unable to create temporary file");
+		goto out;
+	}
+
+	res = 0;
+
+out:
+	fclose(f);
+
+	return res;
+}
+
+static void
+bench_data_free(struct bench_data *bd)
+{
+	if (bd->packedfile != NULL) {
+		fclose(bd->packedfile);
+	}
+
+	free(bd->data);
+	free(bd->depacked);
+	free(bd->packed);
+	free(bd->packedsize);
+
+	memset(bd, 0, sizeof(*bd));
+}
+
+static size_t
+block_size(const struct bench_data *bd, size_t i)
+{
+	return i + 1 < bd->num_blocks ? BLOCK_SIZE : bd->size - i * BLOCK_SIZE;
+}
+
+/*
+ * Compress all blocks, returns total compressed size.
+ */
+static unsigned long long
+bench_pack(struct bench_data *bd, void *workmem, int level)
+{
+	unsigned long long outsize = 0;
+	size_t i;
+
+	for (i = 0; i < bd->num_blocks; ++i) {
+		bd->packedsize[i] = crush_pack_level(bd->data + i * BLOCK_SIZE,
+		                                     bd->packed + outsize,
+		                                     (unsigned long) block_size(bd, i),
+		                                     workmem, level);
+		outsize += bd->packedsize[i];
+	}
+
+	return outsize;
+}
+
+/*
+ * Decompress all blocks with decoder, returns 0 if the result matches.
+ */
+static int
+bench_depack(struct bench_data *bd, int decoder)
+{
+	const byte *src = bd->packed;
+	size_t i;
+
+	if (decoder == 2) {
+		rewind(bd->packedfile);
+	}
+
+	for (i = 0; i < bd->num_blocks; ++i) {
+		byte *dst = bd->depacked + i * BLOCK_SIZE;
+		unsigned long size = (unsigned long) block_size(bd, i);
+		unsigned long res;
+
+		switch (decoder) {
+		case 0:
+			res = crush_depack(src, dst, size);
+			break;
+		case 1:
+			res = crush_depack_safe(src, bd->packedsize[i], dst, size);
+			break;
+		default:
+			res = crush_depack_file(bd->packedfile, dst, size);
+			break;
+		}
+
+		if (res != size) {
+			return 1;
+		}
+
+		src += bd->packedsize[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Decompress warmup times, then repeats times, returns fastest wall time
+ * or a negative value if decompression fails.
+ *
+ * decoder is 0 for crush_depack, 1 for crush_depack_safe, and 2 for
+ * crush_depack_file.
+ */
+static double
+bench_time_depack(struct bench_data *bd, int decoder, int warmup, int repeats)
+{
+	double best = -1.0;
+	int i;
+
+	for (i = 0; i < warmup + repeats; ++i) {
+		double t = wall_time();
+
+		if (bench_depack(bd, decoder)) {
+			return -1.0;
+		}
+
+		t = wall_time() - t;
+
+		if (i >= warmup && (best < 0.0 || t < best)) {
+			best = t;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Benchmark one file at one level, returns 0 on success.
+ */
+static int
+bench_level(struct bench_data *bd, const char *name, int level,
+            int warmup, int repeats, struct bench_result *r)
+{
+	size_t max_block = bd->size < BLOCK_SIZE ? bd->size : BLOCK_SIZE;
+	void *workmem;
+	double best = -1.0;
+	int i;
+	int res = 1;
+
+	r->name = name;
+	r->level = level;
+	r->insize = bd->size;
+	r->workmem_size = crush_workmem_size_level(max_block, level);
+
+	if ((workmem = malloc(r->workmem_size ? r->workmem_size : 1)) == NULL) {
+		printf_error("not enough memory for workmem");
+		return 1;
+	}
+
+	for (i = 0; i < warmup + repeats; ++i) {
+		double t = wall_time();
+
+		r->outsize = bench_pack(bd, workmem, level);
+
+		t = wall_time() - t;
+
+		if (i >= warmup && (best < 0.0 || t < best)) {
+			best = t;
+		}
+	}
+
+	r->pack_time = best;
+
+	/* Store compressed blocks in file for crush_depack_file */
+	rewind(bd->packedfile);
+
+	if (fwrite(bd->packed, 1, (size_t) r->outsize, bd->packedfile) != r->outsize
+	 || fflush(bd->packedfile) != 0) {
+		printf_error("an error occured while writing temporary file");
+		goto out;
+	}
+
+	r->depack_time = bench_time_depack(bd, 0, warmup, repeats);
+	r->safe_time = bench_time_depack(bd, 1, warmup, repeats);
+	r->file_time = bench_time_depack(bd, 2, warmup, repeats);
+
+	if (r->depack_time < 0.0 || r->safe_time < 0.0 || r->file_time < 0.0
+	 || memcmp(bd->data, bd->depacked, bd->size) != 0) {
+		printf_error("decompressed data does not match '%s' at level %d",
+		             name, level);
+		goto out;
+	}
+
+	res = 0;
+
+out:
+	free(workmem);
+
+	return res;
+}
+
+static double
+mb_per_sec(unsigned long long size, double t)
+{
+	return t > 0.0 ? (double) size / t / 1e6 : 0.0;
+}
+
+static double
+ratio_percent(const struct bench_result *r)
+{
+	return r->insize ? 100.0 * (double) r->outsize / (double) r->insize : 0.0;
+}
+
+/*
+ * Print string with characters escaped for JSON or CSV.
+ */
+static void
+print_quoted(const char *s, enum output_format format)
+{
+	putchar('"');
+
+	for (; *s != '\0'; ++s) {
+		unsigned char c = (unsigned char) *s;
+
+		if (format == FORMAT_CSV) {
+			if (c == '"') {
+				putchar('"');
+			}
+			putchar(c);
+		}
+		else if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		}
+		else if (c < 0x20) {
+			printf("\\u%04x", c);
+		}
+		else {
+			putchar(c);
+		}
+	}
+
+	putchar('"');
+}
+
+static void
+print_header(enum output_format format)
+{
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("%-24s %5s %12s %12s %7s %10s %9s %9s %9s %9s\n",
+		       "file", "level", "in", "out", "ratio", "workmem",
+		       "pack", "depack", "safe", "file");
+		break;
+	case FORMAT_CSV:
+		puts("file,level,in,out,ratio,workmem,pack_mbs,depack_mbs,safe_mbs,file_mbs");
+		break;
+	case FORMAT_JSON:
+		puts("[");
+		break;
+	}
+}
+
+static void
+print_result(const struct bench_result *r, enum output_format format, int first)
+{
+	const double pack = mb_per_sec(r->insize, r->pack_time);
+	const double depack = mb_per_sec(r->insize, r->depack_time);
+	const double safe = mb_per_sec(r->insize, r->safe_time);
+	const double file = mb_per_sec(r->insize, r->file_time);
+
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("%-24s %5d %12llu %12llu %6.2f%% %10lu %9.2f %9.2f %9.2f %9.2f\n",
+		       r->name, r->level, r->insize, r->outsize, ratio_percent(r),
+		       (unsigned long) r->workmem_size, pack, depack, safe, file);
+		break;
+	case FORMAT_CSV:
+		print_quoted(r->name, format);
+		printf(",%d,%llu,%llu,%.4f,%lu,%.2f,%.2f,%.2f,%.2f\n",
+		       r->level, r->insize, r->outsize, ratio_percent(r),
+		       (unsigned long) r->workmem_size, pack, depack, safe, file);
+		break;
+	case FORMAT_JSON:
+		printf("%s  {\"file\": ", first ? "" : ",\n");
+		print_quoted(r->name, format);
+		printf(", \"level\": %d, \"in\": %llu, \"out\": %llu, \"ratio\": %.4f, "
+		       "\"workmem\": %lu, \"pack_mbs\": %.2f, \"depack_mbs\": %.2f, "
+		       "\"safe_mbs\": %.2f, \"file_mbs\": %.2f}",
+		       r->level, r->insize, r->outsize, ratio_percent(r),
+		       (unsigned long) r->workmem_size, pack, depack, safe, file);
+		break;
+	}
+}
+
+static void
+print_footer(enum output_format format)
+{
+	if (format == FORMAT_JSON) {
+		puts("\n]");
+	}
+}
+
+static void
+print_syntax(void)
+{
+	fputs("usage: bcrush-bench [options] PATH...\n"
+	      "\n"
+	      "Benchmark compression levels and decoders on files, and on the files\n"
+	      "in directories. Speeds are in MB/s of uncompressed data, using the\n"
+	      "fastest wall clock time of the repeats.\n"
+	      "\n"
+	      "options:\n"
+	      "  -f, --format FORMAT    output format, text, csv or json\n"
+	      "  -h, --help             print this help and exit\n"
+	      "  -l, --levels LEVELS    levels to run, like 1-9 or 1,5,9 (default 1-9)\n"
+	      "  -r, --repeats N        timed runs of each test (default 3)\n"
+	      "  -V, --version          print version and exit\n"
+	      "  -w, --warmup N         untimed runs before each test (default 1)\n", stdout);
+}
+
+static void
+print_version(void)
+{
+	fputs("bcrush-bench " CRUSH_VER_STRING "\n"
+	      "\n"
+	      "Copyright (c) 2018-2020 Joergen Ibsen\n"
+	      "\n"
+	      "Licensed under the zlib license (Zlib).\n"
+	      "There is NO WARRANTY, to the extent permitted by law.\n", stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct parg_state ps;
+	struct file_list files = { NULL, 0, 0 };
+	struct bench_result *totals = NULL;
+	enum output_format format = FORMAT_TEXT;
+	int levels[MAX_LEVEL + 1];
+	int repeats = 3;
+	int warmup = 1;
+	int first = 1;
+	int res = EXIT_FAILURE;
+	size_t i;
+	int level;
+	int c;
+
+	const struct parg_option long_options[] = {
+		{ "format", PARG_REQARG, NULL, 'f' },
+		{ "help", PARG_NOARG, NULL, 'h' },
+		{ "levels", PARG_REQARG, NULL, 'l' },
+		{ "repeats", PARG_REQARG, NULL, 'r' },
+		{ "version", PARG_NOARG, NULL, 'V' },
+		{ "warmup", PARG_REQARG, NULL, 'w' },
+		{ 0, 0, 0, 0 }
+	};
+
+	parse_levels("1-9", levels);
+
+	parg_init(&ps);
+
+	while ((c = parg_getopt_long(&ps, argc, argv, "f:hl:r:Vw:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 1:
+			if (file_list_add_path(&files, ps.optarg)) {
+				goto out;
+			}
+			break;
+		case 'f':
+			if (strcmp(ps.optarg, "text") == 0) {
+				format = FORMAT_TEXT;
+			}
+			else if (strcmp(ps.optarg, "csv") == 0) {
+				format = FORMAT_CSV;
+			}
+			else if (strcmp(ps.optarg, "json") == 0) {
+				format = FORMAT_JSON;
+			}
+			else {
+				printf_usage("unknown format '%s'", ps.optarg);
+				goto out;
+			}
+			break;
+		case 'h':
+			print_syntax();
+			res = EXIT_SUCCESS;
+			goto out;
+			break;
+		case 'l':
+			if (parse_levels(ps.optarg, levels)) {
+				printf_usage("invalid levels '%s'", ps.optarg);
+				goto out;
+			}
+			break;
+		case 'r':
+			repeats = atoi(ps.optarg);
+			if (repeats < 1) {
+				printf_usage("number of repeats must be at least 1");
+				goto out;
+			}
+			break;
+		case 'V':
+			print_version();
+			res = EXIT_SUCCESS;
+			goto out;
+			break;
+		case 'w':
+			warmup = atoi(ps.optarg);
+			if (warmup < 0) {
+				printf_usage("number of warmup runs must be at least 0");
+				goto out;
+			}
+			break;
+		default:
+			printf_usage("unknown option '%s'", argv[ps.optind - 1]);
+			goto out;
+			break;
+		}
+	}
+
+	if (files.num_names == 0) {
+		printf_usage("no files to benchmark");
+		goto out;
+	}
+
+	if ((totals = (struct bench_result *) calloc(MAX_LEVEL + 1, sizeof(*totals))) == NULL) {
+		printf_error("not enough memory");
+		goto out;
+	}
+
+	print_header(format);
+
+	for (i = 0; i < files.num_names; ++i) {
+		struct bench_data bd;
+
+		if (bench_data_load(&bd, files.names[i])) {
+			bench_data_free(&bd);
+			goto out;
+		}
+
+		for (level = 1; level <= MAX_LEVEL; ++level) {
+			struct bench_result r;
+
+			if (!levels[level]) {
+				continue;
+			}
+
+			if (bench_level(&bd, files.names[i], level, warmup, repeats, &r)) {
+				bench_data_free(&bd);
+				goto out;
+			}
+
+			print_result(&r, format, first);
+			fflush(stdout);
+			first = 0;
+
+			/* Sum up times to get speed over all files */
+			totals[level].insize += r.insize;
+			totals[level].outsize += r.outsize;
+			totals[level].pack_time += r.pack_time;
+			totals[level].depack_time += r.depack_time;
+			totals[level].safe_time += r.safe_time;
+			totals[level].file_time += r.file_time;
+
+			if (r.workmem_size > totals[level].workmem_size) {
+				totals[level].workmem_size = r.workmem_size;
+			}
+		}
+
+		bench_data_free(&bd);
+	}
+
+	/* Show totals if there is more than one file */
+	if (files.num_names > 1) {
+		for (level = 1; level <= MAX_LEVEL; ++level) {
+			if (levels[level]) {
+				totals[level].name = "(total)";
+				totals[level].level = level;
+				print_result(&totals[level], format, first);
+				first = 0;
+			}
+		}
+	}
+
+	print_footer(format);
+
+	res = EXIT_SUCCESS;
+
+out:
+	free(totals);
+	file_list_free(&files);
+
+	return res;
+}
@@ -31,6 +31,12 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(CRUSH_NO_THREADS)
+#  include "crush_thread.h"
+#endif
 
 #if _MSC_VER >= 1400
 #  include <intrin.h>
@@ -43,9 +49,22 @@
 #  define CRUSH_BUILTIN_GCC
 #endif
 
-// Number of bits of hash to use for lookup.
+// Compare eight bytes at a time when finding match lengths on little-endian
+// targets with a count trailing zeros builtin. Define CRUSH_NO_WORD_COMPARE
+// to compare one byte at a time.
+#if !defined(CRUSH_NO_WORD_COMPARE)
+#  if defined(CRUSH_BUILTIN_MSVC) && (defined(_M_X64) || defined(_M_ARM64))
+#    define CRUSH_WORD_COMPARE
+#  elif defined(CRUSH_BUILTIN_GCC) && defined(__BYTE_ORDER__) \
+     && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#    define CRUSH_WORD_COMPARE
+#  endif
+#endif
+
+// Number of bits of hash to use for lookup in compression levels.
 //
-// The size of the lookup table (and thus workmem) depends on this.
+// The size of the lookup table (and thus workmem) depends on this. It can
+// also be set per call with crush_pack_params.
 //
 // Values between 10 and 18 work well. Lower values generally make compression
 // speed faster but ratio worse. The default value 17 (128k entries) is a
@@ -57,8 +76,6 @@
 
 #define LOOKUP_SIZE (1UL << CRUSH_HASH_BITS)
 
-#define WORKMEM_SIZE (LOOKUP_SIZE * sizeof(uint32_t))
-
 #define NO_MATCH_POS ((uint32_t) -1)
 
 struct lsb_bitwriter {
@@ -118,6 +135,24 @@ lbw_putbits(struct lsb_bitwriter *lbw, uint32_t bits, int num) {
 	lbw_putbits_no_flush(lbw, bits, num);
 }
 
+// Put num_bits bits from buf, as written by another bitwriter.
+static void
+lbw_putbuf(struct lsb_bitwriter *lbw, const unsigned char *buf,
+           unsigned long num_bits)
+{
+	for (; num_bits >= 16; num_bits -= 16, buf += 2) {
+		lbw_putbits(lbw, (uint32_t) buf[0] | ((uint32_t) buf[1] << 8), 16);
+	}
+
+	for (; num_bits >= 8; num_bits -= 8, ++buf) {
+		lbw_putbits(lbw, buf[0], 8);
+	}
+
+	if (num_bits > 0) {
+		lbw_putbits(lbw, buf[0] & ((1U << num_bits) - 1), (int) num_bits);
+	}
+}
+
 static int
 crush_log2(unsigned long n)
 {
@@ -140,6 +175,41 @@ crush_log2(unsigned long n)
 #endif
 }
 
+// Get the length of the match between the bytes at a and b, given that the
+// first len bytes are known to match, up to at most len_limit.
+static unsigned long
+crush_match_len(const unsigned char *a, const unsigned char *b,
+                unsigned long len, unsigned long len_limit)
+{
+#if defined(CRUSH_WORD_COMPARE)
+	while (len_limit - len >= 8) {
+		uint64_t x, y;
+
+		memcpy(&x, a + len, 8);
+		memcpy(&y, b + len, 8);
+
+		if (x != y) {
+			// The first differing byte is the lowest set byte
+#  if defined(CRUSH_BUILTIN_MSVC)
+			unsigned long lsb_pos;
+			_BitScanForward64(&lsb_pos, x ^ y);
+			return len + lsb_pos / 8;
+#  else
+			return len + (unsigned long) __builtin_ctzll(x ^ y) / 8;
+#  endif
+		}
+
+		len += 8;
+	}
+#endif
+
+	while (len < len_limit && a[len] == b[len]) {
+		++len;
+	}
+
+	return len;
+}
+
 // Hash three bytes starting a p.
 //
 // This is Fibonacci hashing, also known as Knuth's multiplicative hash. The
@@ -157,42 +227,381 @@ crush_hash3_bits(const unsigned char *p, int bits)
 	return (val * UINT32_C(2654435761)) >> (32 - bits);
 }
 
+// Hash four bytes starting a p.
+static unsigned long
+crush_hash4_bits(const unsigned char *p, int bits)
+{
+	assert(bits > 0 && bits <= 32);
+
+	uint32_t val = (uint32_t) p[0]
+	             | ((uint32_t) p[1] << 8)
+	             | ((uint32_t) p[2] << 16)
+	             | ((uint32_t) p[3] << 24);
+
+	return (val * UINT32_C(2654435761)) >> (32 - bits);
+}
+
+// Lookup tables store positions plus a tag base.
+//
+// This allows a crush_ctx to reuse the table for the next input without
+// clearing it, by using a base above every entry stored so far. Entries
+// below the base are from earlier inputs, and are treated as empty.
+//
+// A base of 0 means the contents of the table are unknown, so it is
+// cleared, and base 1 is used. Returns the base to use.
+//
+static uint32_t
+crush_lookup_init(uint32_t *lookup, unsigned long size, uint32_t base)
+{
+	if (base == 0) {
+		for (unsigned long i = 0; i < size; ++i) {
+			lookup[i] = 0;
+		}
+
+		base = 1;
+	}
+
+	return base;
+}
+
+// Get position from lookup table entry, or NO_MATCH_POS if empty.
+static unsigned long
+crush_lookup_pos(uint32_t entry, uint32_t base)
+{
+	return entry >= base ? entry - base : NO_MATCH_POS;
+}
+
+// Add a match search that checked num_nodes candidates to stats, if kept.
+static void
+crush_stats_search(struct crush_stats *stats, unsigned long num_nodes,
+                   const unsigned long max_depth)
+{
+	if (stats != NULL) {
+		stats->num_searches++;
+		stats->num_nodes += num_nodes;
+
+		if (num_nodes >= max_depth) {
+			stats->num_depth_limited++;
+		}
+	}
+}
+
+// Number of searches between adjustments of an adaptive search depth.
+#define DEPTH_REGION 4096
+
+// Match search depth, fixed at max_depth or adapted to a node budget.
+//
+// With a budget, the depth starts at the budget, capped at max_depth, and
+// is adjusted after each DEPTH_REGION searches from what they found:
+//
+//   - If they checked more than budget candidates on average, or the best
+//     match was in the deeper half of the candidates in less than one of
+//     256 searches, the extra depth costs more than it gains, so it is
+//     lowered by a quarter.
+//   - If they were under budget, more than one in 16 stopped at the depth,
+//     and more than one in 64 had the best match in the deeper half, it is
+//     raised by a quarter, up to max_depth.
+//
+// Raising needs searches stopping at the depth while under budget, so the
+// depth stays below about 16 times the budget even if max_depth is not
+// limited. The adjustments only depend on the input, so the output is the
+// same on every run.
+//
+struct crush_depth {
+	unsigned long depth;        // Current depth
+	unsigned long max_depth;    // Largest depth to use
+	unsigned long budget;       // Candidates per search, 0 if fixed
+	unsigned long num_searches; // Searches in this region
+	unsigned long num_nodes;    // Candidates checked in this region
+	unsigned long num_limited;  // Searches that stopped at depth
+	unsigned long num_deep;     // Searches with best in deeper half
+};
+
+static void
+crush_depth_init(struct crush_depth *depth, const unsigned long max_depth,
+                 const unsigned long budget)
+{
+	depth->depth = budget > 0 && budget < max_depth ? budget : max_depth;
+	depth->max_depth = max_depth;
+	depth->budget = budget;
+	depth->num_searches = 0;
+	depth->num_nodes = 0;
+	depth->num_limited = 0;
+	depth->num_deep = 0;
+}
+
+// Add a match search that checked num_nodes candidates, where the best
+// match was candidate best_node counting from 1, or 0 if none was used.
+static void
+crush_depth_search(struct crush_depth *depth, unsigned long num_nodes,
+                   unsigned long best_node)
+{
+	if (depth->budget == 0) {
+		return;
+	}
+
+	depth->num_nodes += num_nodes;
+	depth->num_limited += num_nodes >= depth->depth;
+	depth->num_deep += 2 * best_node > depth->depth;
+
+	if (++depth->num_searches < DEPTH_REGION) {
+		return;
+	}
+
+	const unsigned long d = depth->depth;
+
+	if (depth->num_nodes / DEPTH_REGION > depth->budget
+	 || depth->num_deep < DEPTH_REGION / 256) {
+		depth->depth = d - (d + 2) / 4;
+	}
+	else if (depth->num_limited > DEPTH_REGION / 16
+	      && depth->num_deep > DEPTH_REGION / 64) {
+		const unsigned long step = d / 4 + 1;
+
+		depth->depth = step < depth->max_depth - d ? d + step : depth->max_depth;
+	}
+
+	depth->num_searches = 0;
+	depth->num_nodes = 0;
+	depth->num_limited = 0;
+	depth->num_deep = 0;
+}
+
+// Get the start time of a parse phase, if stats are kept.
+static clock_t
+crush_stats_clock(const struct crush_stats *stats)
+{
+	return stats != NULL ? clock() : 0;
+}
+
+// Add the time since start to find_time, if stats are kept. Returns the
+// start time of the next phase.
+static clock_t
+crush_stats_find_time(struct crush_stats *stats, clock_t start)
+{
+	if (stats == NULL) {
+		return 0;
+	}
+
+	const clock_t now = clock();
+
+	stats->find_time += (double) (now - start) / CLOCKS_PER_SEC;
+
+	return now;
+}
+
+// Add the time since start to output_time, if stats are kept. Returns the
+// start time of the next phase.
+static clock_t
+crush_stats_output_time(struct crush_stats *stats, clock_t start)
+{
+	if (stats == NULL) {
+		return 0;
+	}
+
+	const clock_t now = clock();
+
+	stats->output_time += (double) (now - start) / CLOCKS_PER_SEC;
+
+	return now;
+}
+
+#define CRUSH_REP4(x) x, x, x, x
+#define CRUSH_REP8(x) CRUSH_REP4(x), CRUSH_REP4(x)
+#define CRUSH_REP32(x) CRUSH_REP8(x), CRUSH_REP8(x), CRUSH_REP8(x), CRUSH_REP8(x)
+#define CRUSH_REP128(x) CRUSH_REP32(x), CRUSH_REP32(x), CRUSH_REP32(x), CRUSH_REP32(x)
+#define CRUSH_REP512(x) CRUSH_REP128(x), CRUSH_REP128(x), CRUSH_REP128(x), CRUSH_REP128(x)
+
+// Number of bits used to encode the length of a match, indexed by
+// len - MIN_MATCH.
+//
+// This is the unary bucket prefix plus the bits within the bucket.
+//
+static const unsigned char crush_len_cost_table[] = {
+	CRUSH_REP4(1 + A_BITS),
+	CRUSH_REP4(2 + B_BITS),
+	CRUSH_REP4(3 + C_BITS),
+	CRUSH_REP8(4 + D_BITS),
+	CRUSH_REP32(5 + E_BITS),
+	CRUSH_REP512(5 + F_BITS)
+};
+
+// Fails to compile if the table does not cover MIN_MATCH to MAX_MATCH
+typedef char crush_len_cost_table_check[sizeof(crush_len_cost_table) == MAX_MATCH - MIN_MATCH + 1 ? 1 : -1];
+
+// Number of bits used to encode the length of a match.
+static unsigned long
+crush_len_cost(unsigned long len)
+{
+	assert(len >= MIN_MATCH && len <= MAX_MATCH);
+
+	return crush_len_cost_table[len - MIN_MATCH];
+}
+
+// Number of bits used to encode a match with offset pos, excluding the
+// length.
+//
+// This is the match flag, the offset slot and the offset bits. The parsers
+// call this once per match candidate, and add crush_len_cost for each
+// length they consider.
+//
+static unsigned long
+crush_offs_cost(unsigned long pos)
+{
+	if (pos >= (2UL << (W_BITS - NUM_SLOTS))) {
+		return 1 + SLOT_BITS + crush_log2(pos);
+	}
+
+	return 1 + SLOT_BITS + W_BITS - (NUM_SLOTS - 1);
+}
+
 static unsigned long
 crush_match_cost(unsigned long pos, unsigned long len)
 {
-	unsigned long cost = 1;
+	return crush_offs_cost(pos) + crush_len_cost(len);
+}
+
+// Extra cost in bits of each token.
+//
+// Decompression time depends more on the number of tokens than on their size
+// in bits, since each literal or match is one pass through the decode loop.
+// So the parsers add this to the cost of both literals and matches, counting
+// every token token_weight bits more, which gives a parse with fewer tokens
+// that decodes faster, at some cost in ratio.
+//
+static unsigned long
+crush_token_cost(const int token_weight)
+{
+	return (unsigned long) token_weight;
+}
+
+// Output a literal.
+static void
+crush_put_literal(struct lsb_bitwriter *lbw, unsigned char c)
+{
+	lbw_putbits(lbw, (uint32_t) c << 1, 9);
+}
+
+// Output n literals starting at in.
+//
+// The bitwriter flushes whole bytes, so it has room for at least 25 bits,
+// and runs are written two literals at a time with one flush.
+static void
+crush_put_literals(struct lsb_bitwriter *lbw, const unsigned char *in,
+                   unsigned long n)
+{
+	for (; n >= 2; n -= 2, in += 2) {
+		lbw_putbits(lbw, ((uint32_t) in[0] << 1) | ((uint32_t) in[1] << 10), 18);
+	}
+
+	if (n > 0) {
+		crush_put_literal(lbw, *in);
+	}
+}
+
+// Output a match of length len at offset offs + 1.
+static void
+crush_put_match(struct lsb_bitwriter *lbw, unsigned long offs, unsigned long len)
+{
+	assert(len >= MIN_MATCH && len <= MAX_MATCH);
+	assert(offs < W_SIZE);
 
 	const unsigned long l = len - MIN_MATCH;
 
+	// The match flag and length take at most 15 bits, and the slot and
+	// offset at most 24, so each is written with one put
 	if (l < A) {
-		cost += 1 + A_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | (1UL << 1) | (l << 2)), 2 + A_BITS);
 	}
 	else if (l < B) {
-		cost += 2 + B_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | (1UL << 2) | ((l - A) << 3)), 3 + B_BITS);
 	}
 	else if (l < C) {
-		cost += 3 + C_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | (1UL << 3) | ((l - B) << 4)), 4 + C_BITS);
 	}
 	else if (l < D) {
-		cost += 4 + D_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | (1UL << 4) | ((l - C) << 5)), 5 + D_BITS);
 	}
 	else if (l < E) {
-		cost += 5 + E_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | (1UL << 5) | ((l - D) << 6)), 6 + E_BITS);
 	}
 	else {
-		cost += 5 + F_BITS;
+		lbw_putbits(lbw, (uint32_t) (1 | ((l - E) << 6)), 6 + F_BITS);
 	}
 
-	cost += SLOT_BITS;
+	if (offs >= (2UL << (W_BITS - NUM_SLOTS))) {
+		unsigned long mlog = crush_log2(offs);
 
-	if (pos >= (2UL << (W_BITS - NUM_SLOTS))) {
-		cost += crush_log2(pos);
+		lbw_putbits(lbw, (uint32_t) ((mlog - (W_BITS - NUM_SLOTS))
+		                           | ((offs - (1UL << mlog)) << SLOT_BITS)),
+		            SLOT_BITS + (int) mlog);
 	}
 	else {
-		cost += W_BITS - (NUM_SLOTS - 1);
+		lbw_putbits(lbw, (uint32_t) (offs << SLOT_BITS),
+		            SLOT_BITS + W_BITS - (NUM_SLOTS - 1));
 	}
+}
 
-	return cost;
+// Step of the lowest cost path at a position in the optimal parsers.
+//
+// cost is the cost in bits of the path, and token the last token on it.
+// The token has the match offset in the upper bits and the length in the
+// lower TOKEN_LEN_BITS, with length 1 for a literal. Keeping them together
+// in 8 bytes means each update touches one cache line instead of three.
+//
+struct crush_step {
+	uint32_t cost;
+	uint32_t token;
+};
+
+#define TOKEN_LEN_BITS 10
+
+#if MAX_MATCH >= (1UL << TOKEN_LEN_BITS) || W_BITS + TOKEN_LEN_BITS > 32
+#  error "match offset and length do not fit in a token"
+#endif
+
+static uint32_t
+crush_token(unsigned long offs, unsigned long len)
+{
+	return (uint32_t) ((offs << TOKEN_LEN_BITS) | len);
+}
+
+static unsigned long
+crush_token_len(uint32_t token)
+{
+	return token & ((1UL << TOKEN_LEN_BITS) - 1);
+}
+
+// Output token with the literal at in if it is one.
+static void
+crush_put_token(struct lsb_bitwriter *lbw, uint32_t token,
+                const unsigned char *in)
+{
+	const unsigned long len = crush_token_len(token);
+
+	if (len == 1) {
+		crush_put_literal(lbw, *in);
+	}
+	else {
+		crush_put_match(lbw, token >> TOKEN_LEN_BITS, len);
+	}
+}
+
+// Skip acceleration for the greedy and lazy parsers.
+//
+// After SKIP_SHIFT positions in a row without a match, they step two bytes
+// at a time, then three, and so on up to SKIP_MAX_STEP, which gets through
+// incompressible data quickly. The skipped positions are output as literals
+// and not added to the lookup.
+#define SKIP_SHIFT 5
+#define SKIP_MAX_STEP 32
+
+static unsigned long
+crush_skip_step(unsigned long misses)
+{
+	const unsigned long step = 1 + (misses >> SKIP_SHIFT);
+
+	return step < SKIP_MAX_STEP ? step : SKIP_MAX_STEP;
 }
 
 unsigned long
@@ -203,45 +612,555 @@ crush_max_packed_size(unsigned long src_size)
 
 // Include compression algorithms used by crush_pack_level
 #include "crush_btparse.h"
+#include "crush_greedy.h"
+#include "crush_lazy.h"
 #include "crush_leparse.h"
+#include "crush_ssparse.h"
+
+int
+crush_params_level(struct crush_params *params, int level)
+{
+	static const struct crush_params level_params[] = {
+		{ CRUSH_PARSER_GREEDY, CRUSH_HASH_BITS, 1, MAX_MATCH, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LAZY, CRUSH_HASH_BITS, 1, 16, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LAZY, CRUSH_HASH_BITS, 4, 32, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LAZY, CRUSH_HASH_BITS, 16, 64, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LEPARSE, CRUSH_HASH_BITS, 1, 16, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LEPARSE, CRUSH_HASH_BITS, 8, 32, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_LEPARSE, CRUSH_HASH_BITS, 64, 64, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_BTPARSE, CRUSH_HASH_BITS, 16, 96, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_BTPARSE, CRUSH_HASH_BITS, 32, 224, W_SIZE, 1, 0, 0, 0 },
+		{ CRUSH_PARSER_BTPARSE, CRUSH_HASH_BITS, ULONG_MAX, ULONG_MAX, W_SIZE, 1, 0, 0, 0 }
+	};
+
+	if (level < 1 || level > 10) {
+		return -1;
+	}
+
+	*params = level_params[level - 1];
+
+	return 0;
+}
+
+static int
+crush_params_valid(const struct crush_params *params)
+{
+	if (params->hash_bits < 10 || params->hash_bits > 24
+	 || params->window == 0 || params->window > W_SIZE
+	 || params->num_threads < 1 || params->num_threads > CRUSH_MAX_THREADS
+	 || params->token_weight < 0 || params->token_weight > CRUSH_MAX_TOKEN_WEIGHT
+	 || params->windowed < 0 || params->windowed > 1) {
+		return 0;
+	}
+
+	switch (params->parser) {
+	case CRUSH_PARSER_LAZY:
+		// Buckets of max_depth entries, with at least two buckets
+		return params->max_depth > 0
+		    && (params->max_depth & (params->max_depth - 1)) == 0
+		    && params->max_depth < (1UL << params->hash_bits);
+	case CRUSH_PARSER_GREEDY:
+	case CRUSH_PARSER_LEPARSE:
+	case CRUSH_PARSER_BTPARSE:
+	case CRUSH_PARSER_SSPARSE:
+		return 1;
+	default:
+		return 0;
+	}
+}
 
 size_t
-crush_workmem_size_level(size_t src_size, int level)
+crush_workmem_size_params(size_t src_size, const struct crush_params *params)
 {
-	switch (level) {
-	case 5:
-	case 6:
-	case 7:
-		return crush_leparse_workmem_size(src_size);
-	case 8:
-	case 9:
-	case 10:
-		return crush_btparse_workmem_size(src_size);
+	const int hash_bits = params->hash_bits;
+
+	if (!crush_params_valid(params)) {
+		return (size_t) -1;
+	}
+
+	switch (params->parser) {
+	case CRUSH_PARSER_GREEDY:
+		return crush_greedy_workmem_size(src_size, hash_bits);
+	case CRUSH_PARSER_LAZY:
+		return crush_lazy_workmem_size(src_size, hash_bits);
+	case CRUSH_PARSER_LEPARSE:
+		return crush_leparse_workmem_size(src_size, hash_bits);
+	case CRUSH_PARSER_BTPARSE:
+		if (params->windowed || src_size > BTPARSE_WINDOW_MIN_SIZE) {
+			size_t win_size = params->num_threads > 1 && src_size > BTPARSE_WINDOW_MIN_SIZE
+			                ? crush_btparse_mt_workmem_size(src_size, hash_bits, params->num_threads)
+			                : crush_btparse_win_workmem_size(src_size, hash_bits);
+			size_t bt_size = crush_btparse_workmem_size(BTPARSE_WINDOW_MIN_SIZE, hash_bits);
+
+			if (params->windowed) {
+				return win_size;
+			}
+
+			// The windowed parse uses less workmem than the largest
+			// input below BTPARSE_WINDOW_MIN_SIZE, so make the size
+			// increasing in src_size for callers that size workmem
+			// for a maximum input
+			return win_size > bt_size ? win_size : bt_size;
+		}
+
+		return crush_btparse_workmem_size(src_size, hash_bits);
+	case CRUSH_PARSER_SSPARSE:
+		return crush_ssparse_workmem_size(src_size, hash_bits);
 	default:
 		return (size_t) -1;
 	}
 }
 
+size_t
+crush_workmem_size_level(size_t src_size, int level)
+{
+	struct crush_params params;
+
+	if (crush_params_level(&params, level)) {
+		return (size_t) -1;
+	}
+
+	return crush_workmem_size_params(src_size, &params);
+}
+
+// Probing for incompressible input.
+//
+// The slower parsers spend most of their time building match finder
+// structures, even on input like compressed or encrypted data where they
+// end up emitting only literals. Before running them, we make a quick
+// greedy pass to see if matches save enough bits to be worth the effort.
+//
+// Define CRUSH_NO_PROBE to always run the parser.
+//
+#if !defined(CRUSH_NO_PROBE)
+#define PROBE_HASH_BITS 12
+#define PROBE_MIN_SIZE (16 * 1024UL)
+
+// Check if the src_size bytes following hist_size bytes of history at src
+// are unlikely to compress below src_size bytes.
+//
+// This finds matches greedily with a small hash table on 4 bytes, and like
+// LZ4 steps further ahead the longer it goes without a match, so random
+// data is skipped quickly. It returns 0 as soon as the matches found save
+// src_size / 2 bits over literals. Since literals take 9 bits, the parser
+// would then have to save twice what this finds for the output to be
+// smaller than the input.
+//
+static int
+crush_probe_incompressible(const unsigned char *in, unsigned long hist_size,
+                           unsigned long src_size, const unsigned long window)
+{
+	uint32_t lookup[1UL << PROBE_HASH_BITS];
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long last_match_pos = src_end > 4 ? src_end - 4 : 0;
+	const unsigned long min_gain = src_size / 2;
+	unsigned long gain = 0;
+	unsigned long misses = 0;
+	unsigned long cur;
+
+	memset(lookup, 0, sizeof(lookup));
+
+	// Insert the history within the window, entries are positions plus 1
+	for (cur = hist_size > window ? hist_size - window : 0;
+	     cur < hist_size && cur < last_match_pos; ++cur) {
+		lookup[crush_hash4_bits(&in[cur], PROBE_HASH_BITS)] = (uint32_t) cur + 1;
+	}
+
+	cur = hist_size;
+
+	while (cur < last_match_pos) {
+		const unsigned long hash = crush_hash4_bits(&in[cur], PROBE_HASH_BITS);
+		const unsigned long entry = lookup[hash];
+		const unsigned long pos = entry - 1;
+
+		lookup[hash] = (uint32_t) cur + 1;
+
+		if (entry != 0 && cur - pos <= window) {
+			const unsigned long len_limit = src_end - cur > MAX_MATCH ? MAX_MATCH : src_end - cur;
+			const unsigned long len = crush_match_len(&in[pos], &in[cur], 0, len_limit);
+
+			if (len >= MIN_MATCH && crush_match_cost(cur - pos - 1, len) < 9 * len) {
+				gain += 9 * len - crush_match_cost(cur - pos - 1, len);
+
+				if (gain >= min_gain) {
+					return 0;
+				}
+
+				cur += len;
+				misses = 0;
+				continue;
+			}
+		}
+
+		cur += crush_skip_step(misses++);
+	}
+
+	return 1;
+}
+
+// Output the src_size bytes at src as literals.
+static unsigned long
+crush_pack_literals(const void *src, void *dst, unsigned long src_size,
+                    struct crush_stats *stats)
+{
+	struct lsb_bitwriter lbw;
+	const unsigned char *const in = (const unsigned char *) src;
+	const clock_t start = crush_stats_clock(stats);
+
+	if (src_size == 0) {
+		return 0;
+	}
+
+	lbw_init(&lbw, (unsigned char *) dst);
+
+	for (unsigned long i = 0; i < src_size; ++i) {
+		crush_put_literal(&lbw, in[i]);
+	}
+
+	crush_stats_output_time(stats, start);
+
+	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
+}
+#endif
+
+static unsigned long
+crush_pack_params_base(const void *src, unsigned long hist_size, void *dst,
+                       unsigned long src_size, void *workmem, uint32_t base,
+                       const uint32_t *dict_lookup, unsigned long dict_end,
+                       unsigned long lookup_end, int *keep,
+                       const struct crush_params *params,
+                       struct crush_stats *stats)
+{
+	const int hash_bits = params->hash_bits;
+	const unsigned long window = params->window;
+	const unsigned long max_depth = params->max_depth;
+	const unsigned long accept_len = params->accept_len;
+	const unsigned long node_budget = params->node_budget;
+	const int token_weight = params->token_weight;
+
+	// The greedy and lazy parsers skip inserting the history that is in
+	// dict_lookup, or in lookup if it is not cleared
+	unsigned long hist_start = dict_lookup != NULL ? dict_end : 0;
+
+	if (base != 0 && lookup_end > hist_start) {
+		hist_start = lookup_end;
+	}
+
+#if !defined(CRUSH_NO_PROBE)
+	// Skip the slower parsers on input that matches will not shrink. The
+	// lookups are not touched, so they must be cleared for the next call
+	if (params->parser != CRUSH_PARSER_GREEDY
+	 && params->parser != CRUSH_PARSER_LAZY
+	 && src_size >= PROBE_MIN_SIZE
+	 && crush_probe_incompressible((const unsigned char *) src, hist_size,
+	                               src_size, window)) {
+		*keep = 0;
+		return crush_pack_literals((const unsigned char *) src + hist_size,
+		                           dst, src_size, stats);
+	}
+#endif
+
+	switch (params->parser) {
+	case CRUSH_PARSER_GREEDY:
+		return crush_pack_greedy(src, hist_size, dst, src_size, workmem,
+		                         base, dict_lookup, hist_start, hash_bits,
+		                         window, stats);
+	case CRUSH_PARSER_LAZY:
+		return crush_pack_lazy(src, hist_size, dst, src_size, workmem,
+		                       base, dict_lookup, hist_start, hash_bits,
+		                       window, max_depth, accept_len, stats);
+	case CRUSH_PARSER_LEPARSE:
+		return crush_pack_leparse(src, hist_size, dst, src_size, workmem,
+		                          base, keep, hash_bits, window,
+		                          max_depth, accept_len, node_budget,
+		                          token_weight, stats);
+	case CRUSH_PARSER_BTPARSE:
+		// Use windowed btparse for large inputs to bound workmem
+		if (params->windowed || hist_size + src_size > BTPARSE_WINDOW_MIN_SIZE) {
+			if (params->num_threads > 1
+			 && hist_size + src_size > BTPARSE_WINDOW_MIN_SIZE) {
+				return crush_pack_btparse_mt(src, hist_size, dst, src_size,
+				                             workmem, base, hash_bits, window,
+				                             max_depth, accept_len, node_budget,
+				                             token_weight, params->num_threads,
+				                             stats);
+			}
+
+			return crush_pack_btparse_win(src, hist_size, dst, src_size,
+			                              workmem, base, hash_bits, window,
+			                              max_depth, accept_len, node_budget,
+			                              token_weight, stats);
+		}
+
+		return crush_pack_btparse(src, hist_size, dst, src_size, workmem,
+		                          base, hash_bits, window,
+		                          max_depth, accept_len, node_budget,
+		                          token_weight, stats);
+	case CRUSH_PARSER_SSPARSE:
+		return crush_pack_ssparse(src, hist_size, dst, src_size, workmem,
+		                          base, keep, hash_bits, window,
+		                          max_depth, accept_len, node_budget,
+		                          token_weight, stats);
+	default:
+		return CRUSH_ERROR;
+	}
+}
+
+static unsigned long
+crush_pack_params_tag(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem,
+                      const struct crush_params *params, uint32_t *base,
+                      const uint32_t *dict_lookup, unsigned long dict_end,
+                      unsigned long lookup_end, struct crush_stats *stats)
+{
+	const unsigned long src_end = hist_size + src_size;
+	uint32_t cur_base = *base;
+	int keep = 1;
+
+	if (!crush_params_valid(params)) {
+		return CRUSH_ERROR;
+	}
+
+	// Clear lookup if the tags for this input would wrap around
+	if (cur_base > UINT32_MAX - 1 - src_end) {
+		cur_base = 0;
+	}
+
+	unsigned long res = crush_pack_params_base(src, hist_size, dst, src_size,
+	                                           workmem, cur_base, dict_lookup,
+	                                           dict_end, lookup_end, &keep,
+	                                           params, stats);
+
+	// Inputs shorter than 4 bytes may return before initializing the
+	// lookup, so only reuse it if it was initialized before the call
+	if (res == CRUSH_ERROR || !keep || (cur_base == 0 && src_size < 4)) {
+		*base = 0;
+	}
+	else {
+		*base = (cur_base ? cur_base : 1) + (uint32_t) src_end;
+	}
+
+	return res;
+}
+
 unsigned long
-crush_pack_level(const void *src, void *dst, unsigned long src_size,
-                 void *workmem, int level)
+crush_pack_level_tag(const void *src, unsigned long hist_size, void *dst,
+                     unsigned long src_size, void *workmem, int level,
+                     uint32_t *base)
+{
+	return crush_pack_level_dict(src, hist_size, dst, src_size, workmem,
+	                             level, base, NULL, 0);
+}
+
+size_t
+crush_dict_lookup_size(int level)
 {
-	switch (level) {
-	case 5:
-		return crush_pack_leparse(src, dst, src_size, workmem, 1, 16);
-	case 6:
-		return crush_pack_leparse(src, dst, src_size, workmem, 8, 32);
-	case 7:
-		return crush_pack_leparse(src, dst, src_size, workmem, 64, 64);
-	case 8:
-		return crush_pack_btparse(src, dst, src_size, workmem, 16, 96);
-	case 9:
-		return crush_pack_btparse(src, dst, src_size, workmem, 32, 224);
-	case 10:
-		return crush_pack_btparse(src, dst, src_size, workmem, ULONG_MAX, ULONG_MAX);
+	struct crush_params params;
+
+	if (crush_params_level(&params, level)) {
+		return 0;
+	}
+
+	switch (params.parser) {
+	case CRUSH_PARSER_GREEDY:
+		return crush_greedy_workmem_size(0, params.hash_bits);
+	case CRUSH_PARSER_LAZY:
+		return crush_lazy_workmem_size(0, params.hash_bits);
 	default:
+		return 0;
+	}
+}
+
+unsigned long
+crush_dict_lookup_init(uint32_t *dict_lookup, const void *dict,
+                       unsigned long dict_size, int level)
+{
+	const unsigned char *const in = (const unsigned char *) dict;
+	// Positions whose hash does not depend on the input after dict, the
+	// greedy parser hashes four bytes and the lazy parser three
+	unsigned long dict_end;
+	struct crush_params params;
+
+	if (crush_params_level(&params, level)) {
+		return 0;
+	}
+
+	switch (params.parser) {
+	case CRUSH_PARSER_GREEDY:
+		dict_end = dict_size > 3 ? dict_size - 3 : 0;
+		crush_lookup_init(dict_lookup, 1UL << params.hash_bits, 0);
+		crush_greedy_insert_range(dict_lookup, in, 0, dict_end, 1,
+		                          params.hash_bits);
+		return dict_end;
+	case CRUSH_PARSER_LAZY:
+		dict_end = dict_size > 2 ? dict_size - 2 : 0;
+		crush_lookup_init(dict_lookup, 1UL << params.hash_bits, 0);
+		crush_lazy_insert_range(dict_lookup, in, 0, dict_end, 1,
+		                        params.hash_bits - crush_log2(params.max_depth),
+		                        params.max_depth);
+		return dict_end;
+	default:
+		return 0;
+	}
+}
+
+unsigned long
+crush_pack_level_dict(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem, int level,
+                      uint32_t *base, const uint32_t *dict_lookup,
+                      unsigned long dict_end)
+{
+	struct crush_params params;
+
+	if (crush_params_level(&params, level) || dict_end > hist_size) {
 		return CRUSH_ERROR;
 	}
+
+	return crush_pack_params_tag(src, hist_size, dst, src_size, workmem,
+	                             &params, base, dict_lookup, dict_end, 0,
+	                             NULL);
+}
+
+unsigned long
+crush_pack_level_stream(const void *src, unsigned long hist_size, void *dst,
+                        unsigned long src_size, void *workmem, int level,
+                        uint32_t *base, unsigned long keep)
+{
+	const unsigned long src_end = hist_size + src_size;
+	struct crush_params params;
+
+	if (crush_params_level(&params, level) || keep > src_end) {
+		return CRUSH_ERROR;
+	}
+
+	// Positions up to the last three of the previous call are in lookup
+	unsigned long res = crush_pack_params_tag(src, hist_size, dst, src_size,
+	                                          workmem, &params, base, NULL, 0,
+	                                          hist_size > 3 ? hist_size - 3 : 0,
+	                                          NULL);
+
+	// The entries of this call are below *base - src_end. Moving them down
+	// by src_end - keep means lowering the base by keep, then entries that
+	// were moved out are below it
+	if ((params.parser == CRUSH_PARSER_GREEDY || params.parser == CRUSH_PARSER_LAZY)
+	 && *base != 0) {
+		*base -= (uint32_t) keep;
+	}
+
+	return res;
+}
+
+unsigned long
+crush_pack_params(const void *src, void *dst, unsigned long src_size,
+                  void *workmem, const struct crush_params *params)
+{
+	return crush_pack_params_ex(src, dst, src_size, workmem, params, NULL);
+}
+
+// Get num bits at *bit_pos in packed data, for counting tokens.
+static unsigned long
+crush_stats_getbits(const unsigned char *packed, unsigned long *bit_pos, int num)
+{
+	unsigned long bits = 0;
+
+	for (int i = 0; i < num; ++i, ++*bit_pos) {
+		bits |= (unsigned long) ((packed[*bit_pos >> 3] >> (*bit_pos & 7)) & 1) << i;
+	}
+
+	return bits;
+}
+
+// Count the tokens in packed data that decompresses to src_size bytes.
+static void
+crush_stats_tokens(struct crush_stats *stats, const unsigned char *packed,
+                   unsigned long src_size)
+{
+	static const int len_bits[6] = { A_BITS, B_BITS, C_BITS, D_BITS, E_BITS, F_BITS };
+	static const unsigned long len_base[6] = { 0, A, B, C, D, E };
+	unsigned long bit_pos = 0;
+	unsigned long dst = 0;
+
+	while (dst < src_size) {
+		// Literal
+		if (crush_stats_getbits(packed, &bit_pos, 1) == 0) {
+			bit_pos += 8;
+			stats->num_literals++;
+			++dst;
+			continue;
+		}
+
+		// Match length, with a unary prefix of up to 5 bits giving
+		// the bucket
+		int bucket = 0;
+
+		while (bucket < 5 && crush_stats_getbits(packed, &bit_pos, 1) == 0) {
+			++bucket;
+		}
+
+		const unsigned long len = len_base[bucket] + MIN_MATCH
+		                        + crush_stats_getbits(packed, &bit_pos, len_bits[bucket]);
+
+		// Match offset
+		const unsigned long slot = crush_stats_getbits(packed, &bit_pos, SLOT_BITS);
+
+		bit_pos += slot > 0 ? slot + (W_BITS - NUM_SLOTS) : W_BITS - (NUM_SLOTS - 1);
+
+		stats->num_matches++;
+		stats->len_buckets[bucket]++;
+		stats->offs_slots[slot]++;
+		dst += len;
+	}
+}
+
+unsigned long
+crush_pack_params_ex(const void *src, void *dst, unsigned long src_size,
+                     void *workmem, const struct crush_params *params,
+                     struct crush_stats *stats)
+{
+	uint32_t base = 0;
+
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(*stats));
+	}
+
+	unsigned long res = crush_pack_params_tag(src, 0, dst, src_size, workmem,
+	                                          params, &base, NULL, 0, 0, stats);
+
+	if (stats != NULL && res != CRUSH_ERROR) {
+		crush_stats_tokens(stats, (const unsigned char *) dst, src_size);
+	}
+
+	return res;
+}
+
+unsigned long
+crush_pack_level_ex(const void *src, void *dst, unsigned long src_size,
+                    void *workmem, int level, struct crush_stats *stats)
+{
+	struct crush_params params;
+
+	if (crush_params_level(&params, level)) {
+		return CRUSH_ERROR;
+	}
+
+	return crush_pack_params_ex(src, dst, src_size, workmem, &params, stats);
+}
+
+unsigned long
+crush_pack_level_hist(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem, int level)
+{
+	uint32_t base = 0;
+
+	return crush_pack_level_tag(src, hist_size, dst, src_size, workmem,
+	                            level, &base);
+}
+
+unsigned long
+crush_pack_level(const void *src, void *dst, unsigned long src_size,
+                 void *workmem, int level)
+{
+	return crush_pack_level_hist(src, 0, dst, src_size, workmem, level);
 }
 
 // clang -g -O1 -fsanitize=fuzzer,address -DCRUSH_FUZZING crush.c crush_depack.c
@@ -83,6 +83,9 @@ crush_max_packed_size(unsigned long src_size);
 /**
  * Get required size of `workmem` buffer.
  *
+ * The size is also sufficient for compressing any smaller input with the
+ * same level.
+ *
  * @see crush_pack_level
  *
  * @param src_size number of bytes to compress
@@ -95,9 +98,13 @@ crush_workmem_size_level(size_t src_size, int level);
 /**
  * Compress `src_size` bytes of data from `src` to `dst`.
  *
- * Compression levels between 5 and 9 offer a trade-off between
+ * Compression levels between 1 and 9 offer a trade-off between
  * time/space and ratio. Level 10 is optimal but very slow.
  *
+ * Levels 1 to 4 use greedy and lazy parsing, and only need a fixed size
+ * `workmem`. Levels 5 and up use dynamic programming parsers, which need
+ * `workmem` proportional to `src_size`.
+ *
  * @param src pointer to data
  * @param dst pointer to where to place compressed data
  * @param src_size number of bytes to compress
@@ -109,9 +116,210 @@ CRUSH_API unsigned long
 crush_pack_level(const void *src, void *dst, unsigned long src_size,
                  void *workmem, int level);
 
+/**
+ * Parser choices for `crush_params`.
+ */
+#define CRUSH_PARSER_GREEDY 1  /**< Greedy parsing, used by level 1 */
+#define CRUSH_PARSER_LAZY 2    /**< Lazy parsing, used by levels 2 to 4 */
+#define CRUSH_PARSER_LEPARSE 3 /**< Backwards parse, used by levels 5 to 7 */
+#define CRUSH_PARSER_BTPARSE 4 /**< Binary tree parse, used by levels 8 to 10 */
+#define CRUSH_PARSER_SSPARSE 5 /**< Backwards parse, searching all positions */
+
+/**
+ * Maximum value of `num_threads` in `crush_params`.
+ */
+#define CRUSH_MAX_THREADS 64
+
+/**
+ * Maximum value of `token_weight` in `crush_params`.
+ */
+#define CRUSH_MAX_TOKEN_WEIGHT 16
+
+/**
+ * Compression parameters.
+ *
+ * Use `crush_params_level` to get the parameters of a compression level,
+ * and adjust from there. The compressed format is the same for any
+ * parameters.
+ *
+ * `num_threads`, `node_budget`, `token_weight` and `windowed` only apply to
+ * some of the parsers, named below, and are ignored by the rest. The
+ * compression levels leave them at their defaults of 1, 0, 0 and 0.
+ *
+ * `hash_bits` must be between 10 and 24. The greedy, lazy and btparse
+ * parsers use a lookup table of 2^`hash_bits` entries. The leparse parser
+ * uses it for inputs up to half that size, and a table that scales with the
+ * input above that.
+ *
+ * `max_depth` is the number of match candidates checked at each position,
+ * it is not used by the greedy parser. For the lazy parser it must be a
+ * power of two less than 2^`hash_bits`.
+ *
+ * `accept_len` is the match length at which the search stops, it is not
+ * used by the greedy parser.
+ *
+ * `window` limits the match distance, and must be between 1 and 2 MiB.
+ *
+ * `num_threads` must be between 1 and `CRUSH_MAX_THREADS`. The btparse
+ * parser splits inputs over 4 MiB into ranges of whole 1 MiB segments, and
+ * parses up to `num_threads` of them at the same time, each using its own
+ * part of `workmem`. Inputs of 4 MiB or less are always parsed on one
+ * thread. Each range builds its trees from the 2 MiB before it, so the total
+ * work is larger than on one thread.
+ *
+ * `node_budget` is 0 to search to `max_depth` at every position. Otherwise
+ * the leparse, btparse and ssparse parsers adapt the depth as they go,
+ * aiming for `node_budget` candidates checked per position on average, with
+ * `max_depth` as the largest depth. The depth is lowered where searching
+ * deeper rarely finds a better match, and raised where it does, so the speed
+ * varies less between kinds of data than with a fixed depth. The depth only
+ * depends on the input, and with `num_threads` above 1 each range adapts on
+ * its own.
+ *
+ * `token_weight` is 0 to parse for the smallest output, or between 1 and
+ * `CRUSH_MAX_TOKEN_WEIGHT`. The leparse, btparse and ssparse parsers then
+ * count each literal and match as `token_weight` bits more than it takes,
+ * so they choose parses with fewer tokens over slightly smaller ones, which
+ * decode faster.
+ *
+ * `windowed` is 0 or 1. The btparse parser keeps tree nodes for the 2 MiB
+ * window only, and parses in 1 MiB segments, for inputs over 4 MiB, or for
+ * any input if `windowed` is 1. Then the workmem size does not grow with
+ * the input, which helps when sizing `workmem` for a maximum input over
+ * 4 MiB that may be followed by smaller ones. Matches crossing a segment
+ * boundary are lost.
+ */
+struct crush_params {
+	int parser;                /**< One of the `CRUSH_PARSER_*` values */
+	int hash_bits;             /**< Number of bits of hash for lookup */
+	unsigned long max_depth;   /**< Maximum match candidates checked */
+	unsigned long accept_len;  /**< Match length to stop search at */
+	unsigned long window;      /**< Maximum match distance */
+	int num_threads;           /**< Number of threads to parse with */
+	unsigned long node_budget; /**< Candidates per position to adapt to */
+	int token_weight;          /**< Extra cost in bits of each token */
+	int windowed;              /**< Use the windowed parse for any input */
+};
+
+/**
+ * Get parameters used by compression level `level`.
+ *
+ * @param params pointer to where to store parameters
+ * @param level compression level
+ * @return 0 on success, non-zero if `level` is invalid
+ */
+CRUSH_API int
+crush_params_level(struct crush_params *params, int level);
+
+/**
+ * Get required size of `workmem` buffer for `crush_pack_params`.
+ *
+ * The size is also sufficient for compressing any smaller input with the
+ * same parameters.
+ *
+ * @see crush_pack_params
+ *
+ * @param src_size number of bytes to compress
+ * @param params pointer to compression parameters
+ * @return required size in bytes of `workmem` buffer, `(size_t) -1` if
+ *         `params` are invalid
+ */
+CRUSH_API size_t
+crush_workmem_size_params(size_t src_size, const struct crush_params *params);
+
+/**
+ * Compress `src_size` bytes of data from `src` to `dst` using `params`.
+ *
+ * Like `crush_pack_level`, but with the parser and match search
+ * configurable per call. The compressed data is decompressed with
+ * `crush_depack`.
+ *
+ * @param src pointer to data
+ * @param dst pointer to where to place compressed data
+ * @param src_size number of bytes to compress
+ * @param workmem pointer to memory for temporary use
+ * @param params pointer to compression parameters
+ * @return size of compressed data, `CRUSH_ERROR` if `params` are invalid
+ */
+CRUSH_API unsigned long
+crush_pack_params(const void *src, void *dst, unsigned long src_size,
+                  void *workmem, const struct crush_params *params);
+
+/**
+ * Statistics filled in by `crush_pack_params_ex` and `crush_pack_level_ex`.
+ *
+ * The token counts are for the compressed data. `len_buckets` counts
+ * matches by the A to F length encoding, and `offs_slots` by the offset slot,
+ * where slot 0 holds offsets up to 64, and slot n > 0 offsets from
+ * 2^(n + 5) + 1 to 2^(n + 6).
+ *
+ * A search is the lookup of match candidates at one position, and
+ * `num_nodes` is the number of candidates (hash chain entries or tree nodes)
+ * checked in total. `num_depth_limited` counts searches that checked the
+ * full `max_depth` candidates, and so may have missed a better match.
+ *
+ * The times are processor time in seconds. `find_time` is spent finding
+ * matches and choosing the parse, and `output_time` following the parse to
+ * write the compressed data. The greedy and lazy parsers write as they go,
+ * so all their time is in `find_time`. With `num_threads` above 1, the
+ * parallel ranges are counted in `find_time` and include the time of all
+ * threads.
+ */
+struct crush_stats {
+	unsigned long num_literals;          /**< Number of literals */
+	unsigned long num_matches;           /**< Number of matches */
+	unsigned long len_buckets[6];        /**< Matches per length bucket */
+	unsigned long offs_slots[16];        /**< Matches per offset slot */
+	unsigned long long num_searches;     /**< Number of match searches */
+	unsigned long long num_nodes;        /**< Match candidates checked */
+	unsigned long long num_depth_limited; /**< Searches ending at max_depth */
+	double find_time;                    /**< Time finding matches */
+	double output_time;                  /**< Time writing output */
+};
+
+/**
+ * Compress like `crush_pack_params`, and fill in `stats`.
+ *
+ * Keeping statistics makes compression slightly slower. If `stats` is
+ * `NULL`, this is the same as `crush_pack_params`.
+ *
+ * @param src pointer to data
+ * @param dst pointer to where to place compressed data
+ * @param src_size number of bytes to compress
+ * @param workmem pointer to memory for temporary use
+ * @param params pointer to compression parameters
+ * @param stats pointer to where to store statistics, or `NULL`
+ * @return size of compressed data, `CRUSH_ERROR` if `params` are invalid
+ */
+CRUSH_API unsigned long
+crush_pack_params_ex(const void *src, void *dst, unsigned long src_size,
+                     void *workmem, const struct crush_params *params,
+                     struct crush_stats *stats);
+
+/**
+ * Compress like `crush_pack_level`, and fill in `stats`.
+ *
+ * @see crush_pack_params_ex
+ *
+ * @param src pointer to data
+ * @param dst pointer to where to place compressed data
+ * @param src_size number of bytes to compress
+ * @param workmem pointer to memory for temporary use
+ * @param level compression level
+ * @param stats pointer to where to store statistics, or `NULL`
+ * @return size of compressed data, `CRUSH_ERROR` if `level` is invalid
+ */
+CRUSH_API unsigned long
+crush_pack_level_ex(const void *src, void *dst, unsigned long src_size,
+                    void *workmem, int level, struct crush_stats *stats);
+
 /**
  * Decompress `depacked_size` bytes of data from `src` to `dst`.
  *
+ * The compressed data is trusted, a corrupt stream may read past the end of
+ * it, or write past the end of `dst`. Use `crush_depack_safe` for data from
+ * untrusted sources.
+ *
  * @param src pointer to compressed data
  * @param dst pointer to where to place decompressed data
  * @param depacked_size size of decompressed data
@@ -120,6 +328,66 @@ crush_pack_level(const void *src, void *dst, unsigned long src_size,
 CRUSH_API unsigned long
 crush_depack(const void *src, void *dst, unsigned long depacked_size);
 
+/**
+ * Decompress `src_size` bytes of compressed data from `src` to `dst`.
+ *
+ * Unlike `crush_depack`, this checks every read and write against the
+ * buffer sizes, so it is suitable for data from untrusted sources. It
+ * decompresses until fewer bits than the shortest token remain, so
+ * `src_size` must be the size returned by `crush_pack`.
+ *
+ * @param src pointer to compressed data
+ * @param src_size size of compressed data
+ * @param dst pointer to where to place decompressed data
+ * @param dst_capacity size of `dst` buffer
+ * @return size of decompressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_depack_safe(const void *src, unsigned long src_size, void *dst,
+                  unsigned long dst_capacity);
+
+/**
+ * Decompress `depacked_size` bytes of data from `src` to `dst`, with
+ * `hist_size` bytes of history in front of `dst`.
+ *
+ * This decompresses blocks from `crush_stream_update`, where matches may
+ * refer back into previous blocks. The `hist_size` bytes before `dst` must
+ * contain the data preceding the block.
+ *
+ * @see crush_stream_update
+ *
+ * @param src pointer to compressed data
+ * @param dst pointer to where to place decompressed data
+ * @param depacked_size size of decompressed data
+ * @param hist_size number of bytes of history before `dst`
+ * @return size of decompressed data
+ */
+CRUSH_API unsigned long
+crush_depack_hist(const void *src, void *dst, unsigned long depacked_size,
+                  unsigned long hist_size);
+
+/**
+ * Decompress `depacked_size` bytes of data from `src` to `dst`, using
+ * `dict_size` bytes of dictionary at `dict`.
+ *
+ * This decompresses data from `crush_ctx_pack` with a context initialized
+ * by `crush_ctx_init_dict`. The dictionary must contain the same bytes as
+ * were passed to `crush_dict_init`, and is used as if it was in front of
+ * `dst`, but does not have to be.
+ *
+ * @see crush_ctx_init_dict
+ *
+ * @param src pointer to compressed data
+ * @param dst pointer to where to place decompressed data
+ * @param depacked_size size of decompressed data
+ * @param dict pointer to dictionary
+ * @param dict_size size of dictionary
+ * @return size of decompressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_depack_dict(const void *src, void *dst, unsigned long depacked_size,
+                  const void *dict, unsigned long dict_size);
+
 /**
  * Decompress `depacked_size` bytes of data from `src_file` to `dst`.
  *
@@ -131,6 +399,740 @@ crush_depack(const void *src, void *dst, unsigned long depacked_size);
 CRUSH_API unsigned long
 crush_depack_file(FILE *src_file, void *dst, unsigned long depacked_size);
 
+/**
+ * Memory allocator.
+ *
+ * `alloc` returns a pointer to `size` bytes of memory, or `NULL` on
+ * failure. `free` releases memory from `alloc`, and is passed the same
+ * `size`. It is not called with `NULL`. Both are passed `opaque`.
+ *
+ * @see crush_ctx_init_alloc
+ */
+struct crush_allocator {
+	void *(*alloc)(void *opaque, size_t size);          /**< Allocate memory */
+	void (*free)(void *opaque, void *ptr, size_t size); /**< Free memory */
+	void *opaque;                                       /**< User data */
+};
+
+/**
+ * Flag for `crush_allocator_huge` to use explicit huge pages.
+ */
+#define CRUSH_HUGE_EXPLICIT 1
+
+/**
+ * Initialize allocator for memory aligned to 2 MiB, using huge pages.
+ *
+ * Sizes are rounded up to a multiple of 2 MiB, and on Linux the memory is
+ * marked for transparent huge pages. With `CRUSH_HUGE_EXPLICIT`, it first
+ * tries explicit huge pages, which need to be reserved, and on Windows the
+ * "Lock pages in memory" privilege. If that fails, it falls back to the
+ * default.
+ *
+ * This reduces TLB misses when the workmem of levels 8 and up is large,
+ * but wastes memory for small sizes. The allocator can also be used
+ * directly to allocate `workmem` for `crush_pack_level`.
+ *
+ * @param allocator pointer to allocator
+ * @param flags zero or `CRUSH_HUGE_EXPLICIT`
+ */
+CRUSH_API void
+crush_allocator_huge(struct crush_allocator *allocator, int flags);
+
+/**
+ * Compression context.
+ *
+ * Owns the `workmem` for compressing a series of independent inputs with
+ * the same level, and reuses the match finder tables between them. For
+ * small inputs this avoids clearing the tables on each call, which can
+ * take longer than compressing the input itself.
+ *
+ * The members are private, use the `crush_ctx_*` functions.
+ *
+ * @see crush_ctx_init
+ */
+struct crush_ctx {
+	void *workmem;                    /**< Memory for compressing an input */
+	unsigned char *buf;               /**< Dictionary followed by input */
+	const struct crush_dict *dict;    /**< Dictionary, NULL if none */
+	struct crush_allocator allocator; /**< Allocator for memory */
+	size_t workmem_size;              /**< Size of `workmem` */
+	unsigned long max_size;           /**< Maximum size of input */
+	unsigned long base;               /**< Tag base for reusing tables */
+	int level;                        /**< Compression level */
+};
+
+/**
+ * Initialize compression context.
+ *
+ * @see crush_ctx_pack
+ *
+ * @param ctx pointer to context
+ * @param level compression level
+ * @param max_size maximum number of bytes to compress per call
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_ctx_init(struct crush_ctx *ctx, int level, unsigned long max_size);
+
+/**
+ * Initialize compression context using allocator.
+ *
+ * Like `crush_ctx_init`, but the memory of the context is allocated with
+ * `allocator`, which is copied into the context. If `allocator` is `NULL`,
+ * `malloc` and `free` are used.
+ *
+ * @see crush_allocator_huge
+ *
+ * @param ctx pointer to context
+ * @param level compression level
+ * @param max_size maximum number of bytes to compress per call
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_ctx_init_alloc(struct crush_ctx *ctx, int level, unsigned long max_size,
+                     const struct crush_allocator *allocator);
+
+/**
+ * Compress `src_size` bytes of data from `src` to `dst` using context.
+ *
+ * The output is the same as from `crush_pack_level`, and is decompressed
+ * with `crush_depack`, unless the context was initialized with
+ * `crush_ctx_init_dict`.
+ *
+ * @param ctx pointer to context
+ * @param src pointer to data
+ * @param dst pointer to where to place compressed data
+ * @param src_size number of bytes to compress, at most `max_size`
+ * @return size of compressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_ctx_pack(struct crush_ctx *ctx, const void *src, void *dst,
+               unsigned long src_size);
+
+/**
+ * Free memory used by context.
+ *
+ * @param ctx pointer to context
+ */
+CRUSH_API void
+crush_ctx_end(struct crush_ctx *ctx);
+
+/**
+ * Prepared dictionary.
+ *
+ * Holds a copy of the dictionary data, and for levels 1 to 4 the match
+ * finder table with the dictionary inserted. It is only read while
+ * compressing, so one dictionary can be shared by contexts on several
+ * threads.
+ *
+ * The members are private, use the `crush_dict_*` functions.
+ *
+ * @see crush_dict_init
+ */
+struct crush_dict {
+	struct crush_allocator allocator; /**< Allocator for memory */
+	unsigned char *data;              /**< Copy of dictionary */
+	void *lookup;                     /**< Prepared table, NULL if none */
+	unsigned long size;               /**< Size of dictionary */
+	unsigned long lookup_end;         /**< Number of positions in `lookup` */
+	int level;                        /**< Compression level */
+};
+
+/**
+ * Prepare dictionary for compressing with compression level `level`.
+ *
+ * Small inputs with content similar to the dictionary, like records of a
+ * common format, compress better since matches may refer into it. Only
+ * the last 2 MiB of `data` can be reached by matches, so if `size` is
+ * larger, only those are used.
+ *
+ * @see crush_ctx_init_dict
+ *
+ * @param dict pointer to dictionary
+ * @param data pointer to dictionary data
+ * @param size size of dictionary data
+ * @param level compression level
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_dict_init(struct crush_dict *dict, const void *data,
+                unsigned long size, int level);
+
+/**
+ * Prepare dictionary using allocator.
+ *
+ * Like `crush_dict_init`, but memory is allocated using `allocator`, which
+ * is copied into the dictionary. If `allocator` is `NULL`, `malloc` and
+ * `free` are used.
+ *
+ * @see crush_dict_init
+ *
+ * @param dict pointer to dictionary
+ * @param data pointer to dictionary data
+ * @param size size of dictionary data
+ * @param level compression level
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_dict_init_alloc(struct crush_dict *dict, const void *data,
+                      unsigned long size, int level,
+                      const struct crush_allocator *allocator);
+
+/**
+ * Free memory used by dictionary.
+ *
+ * @param dict pointer to dictionary
+ */
+CRUSH_API void
+crush_dict_end(struct crush_dict *dict);
+
+/**
+ * Initialize compression context using dictionary.
+ *
+ * Like `crush_ctx_init` with the level of `dict`, but `crush_ctx_pack`
+ * compresses each input following the dictionary, and the output must be
+ * decompressed with `crush_depack_dict`.
+ *
+ * For levels 1 to 4, the compression uses the prepared table of `dict`,
+ * so the time per call does not depend on the size of the dictionary.
+ * Higher levels insert the dictionary again on each call. The
+ * dictionary must stay valid until the context is freed.
+ *
+ * @see crush_ctx_pack
+ *
+ * @param ctx pointer to context
+ * @param dict pointer to dictionary
+ * @param max_size maximum number of bytes to compress per call
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_ctx_init_dict(struct crush_ctx *ctx, const struct crush_dict *dict,
+                    unsigned long max_size);
+
+/**
+ * Initialize compression context using dictionary and allocator.
+ *
+ * @see crush_ctx_init_dict
+ * @see crush_ctx_init_alloc
+ *
+ * @param ctx pointer to context
+ * @param dict pointer to dictionary
+ * @param max_size maximum number of bytes to compress per call
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_ctx_init_dict_alloc(struct crush_ctx *ctx, const struct crush_dict *dict,
+                          unsigned long max_size,
+                          const struct crush_allocator *allocator);
+
+/**
+ * Get required size of `dst` buffer for a batch of `n` inputs.
+ *
+ * @see crush_pack_batch
+ *
+ * @param sizes sizes of the inputs
+ * @param n number of inputs
+ * @return sum of the maximum compressed sizes, `CRUSH_ERROR` on overflow
+ */
+CRUSH_API unsigned long
+crush_batch_bound(const unsigned long *sizes, size_t n);
+
+/**
+ * Compress a batch of `n` independent inputs using context.
+ *
+ * Input `i` of `sizes[i]` bytes at `srcs[i]` is compressed with
+ * `crush_ctx_pack`, and the outputs are placed one after the other in
+ * `dst`. The output of input `i` starts at `offsets[i]`, and `offsets[n]`
+ * is the total size, so `offsets` must have room for `n + 1` entries.
+ *
+ * @see crush_batch_bound
+ *
+ * @param ctx pointer to context
+ * @param srcs pointers to inputs
+ * @param sizes sizes of inputs, each at most `max_size` of `ctx`
+ * @param n number of inputs
+ * @param dst pointer to where to place compressed data
+ * @param offsets pointer to where to store offsets of compressed data
+ * @return total size of compressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_ctx_pack_batch(struct crush_ctx *ctx, const void *const *srcs,
+                     const unsigned long *sizes, size_t n, void *dst,
+                     unsigned long *offsets);
+
+/**
+ * Compress a batch of `n` independent inputs with compression level `level`.
+ *
+ * Like `crush_ctx_pack_batch`, but the inputs are split into up to
+ * `num_threads` runs of about the same total size, which are compressed at
+ * the same time, each with its own context. Each thread gets at least 64 KiB
+ * of input. The output does not depend on `num_threads`, and each input
+ * can be decompressed with `crush_depack`. To compress many batches,
+ * `crush_batch_pack` reuses the contexts.
+ *
+ * While compressing, the output of each run is placed after the bound of
+ * the inputs before it, so `dst` must have room for
+ * `crush_batch_bound(sizes, n)` bytes.
+ *
+ * @see crush_batch_bound
+ *
+ * @param srcs pointers to inputs
+ * @param sizes sizes of inputs
+ * @param n number of inputs
+ * @param dst pointer to where to place compressed data
+ * @param offsets pointer to where to store `n + 1` offsets
+ * @param level compression level
+ * @param num_threads maximum number of threads, 1 to `CRUSH_MAX_THREADS`
+ * @return total size of compressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_pack_batch(const void *const *srcs, const unsigned long *sizes,
+                 size_t n, void *dst, unsigned long *offsets, int level,
+                 int num_threads);
+
+/**
+ * Batch compression state.
+ *
+ * Holds a context for each thread, so compressing many batches with
+ * `crush_batch_pack` does not allocate memory for each one.
+ *
+ * The members are private, use the `crush_batch_*` functions.
+ *
+ * @see crush_batch_init
+ */
+struct crush_batch {
+	struct crush_ctx *ctxs;           /**< Context for each thread */
+	struct crush_allocator allocator; /**< Allocator for memory */
+	unsigned long max_size;           /**< Maximum size of input */
+	int num_threads;                  /**< Number of contexts */
+	int level;                        /**< Compression level */
+};
+
+/**
+ * Initialize batch compression.
+ *
+ * Sets up `num_threads` contexts for compressing inputs of up to
+ * `max_size` bytes each with compression level `level`.
+ *
+ * @see crush_batch_pack
+ *
+ * @param cb pointer to batch state
+ * @param level compression level
+ * @param max_size maximum size of each input
+ * @param num_threads maximum number of threads, 1 to `CRUSH_MAX_THREADS`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_batch_init(struct crush_batch *cb, int level, unsigned long max_size,
+                 int num_threads);
+
+/**
+ * Initialize batch compression using allocator.
+ *
+ * Like `crush_batch_init`, but the contexts are allocated with `allocator`,
+ * which is copied into the batch state. If `allocator` is `NULL`, `malloc`
+ * and `free` are used.
+ *
+ * @param cb pointer to batch state
+ * @param level compression level
+ * @param max_size maximum size of each input
+ * @param num_threads maximum number of threads, 1 to `CRUSH_MAX_THREADS`
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_batch_init_alloc(struct crush_batch *cb, int level,
+                       unsigned long max_size, int num_threads,
+                       const struct crush_allocator *allocator);
+
+/**
+ * Compress a batch of `n` independent inputs using batch state.
+ *
+ * Like `crush_pack_batch`, with the level and number of threads of `cb`,
+ * but each run is compressed with one of the contexts of `cb`. The threads
+ * are started for each call.
+ *
+ * @see crush_batch_bound
+ *
+ * @param cb pointer to batch state
+ * @param srcs pointers to inputs
+ * @param sizes sizes of inputs, each at most `max_size` of `cb`
+ * @param n number of inputs
+ * @param dst pointer to where to place compressed data
+ * @param offsets pointer to where to store `n + 1` offsets
+ * @return total size of compressed data, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_batch_pack(struct crush_batch *cb, const void *const *srcs,
+                 const unsigned long *sizes, size_t n, void *dst,
+                 unsigned long *offsets);
+
+/**
+ * Free memory used by batch state.
+ *
+ * @param cb pointer to batch state
+ */
+CRUSH_API void
+crush_batch_end(struct crush_batch *cb);
+
+/**
+ * Flag for `crush_stream_init` to let matches refer into previous blocks.
+ *
+ * The blocks can then only be decompressed in order, with
+ * `crush_depack_hist` or `crush_decoder_update`, and nothing in the output
+ * marks them as such, so they must not be given to `bcrush -d` or
+ * `crush_depack`.
+ */
+#define CRUSH_STREAM_LINKED 1
+
+/**
+ * Streaming compression state.
+ *
+ * The members are private, use the `crush_stream_*` functions.
+ *
+ * @see crush_stream_init
+ */
+struct crush_stream {
+	unsigned char *buf;               /**< History followed by pending input */
+	void *workmem;                    /**< Memory for compressing a block */
+	struct crush_allocator allocator; /**< Allocator for memory */
+	size_t workmem_size;              /**< Size of `workmem` */
+	unsigned long block_size;         /**< Maximum size of input per block */
+	unsigned long hist_max;           /**< Maximum size of history */
+	unsigned long hist_size;          /**< Size of history at start of `buf` */
+	unsigned long pending;            /**< Size of pending input after history */
+	unsigned long base;               /**< Tag base for reusing tables */
+	int level;                        /**< Compression level */
+};
+
+/**
+ * Initialize streaming compression.
+ *
+ * Input is collected into blocks of `block_size` bytes, which are
+ * compressed with compression level `level`. By default each block is
+ * compressed independently, and the output of the stream is in the same
+ * format as a bcrush file. If `flags` contains `CRUSH_STREAM_LINKED`, the
+ * last 2 MiB of previous input is kept as history, and matches may refer
+ * back into it across block boundaries.
+ *
+ * With history, `workmem` depends on `block_size` plus the size of the
+ * history. Levels 1 to 4 keep their lookup between blocks, so time depends
+ * on the block size only. The higher levels build their lookups from the
+ * history for each block, so a `block_size` much smaller than the history
+ * makes them slow.
+ *
+ * @see crush_stream_update
+ *
+ * @param cs pointer to stream state
+ * @param level compression level
+ * @param block_size maximum size of input per block
+ * @param flags zero or `CRUSH_STREAM_LINKED`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_stream_init(struct crush_stream *cs, int level,
+                  unsigned long block_size, int flags);
+
+/**
+ * Initialize streaming compression using allocator.
+ *
+ * Like `crush_stream_init`, but the memory of the stream is allocated with
+ * `allocator`, which is copied into the stream. If `allocator` is `NULL`,
+ * `malloc` and `free` are used.
+ *
+ * @see crush_allocator_huge
+ *
+ * @param cs pointer to stream state
+ * @param level compression level
+ * @param block_size maximum size of input per block
+ * @param flags zero or `CRUSH_STREAM_LINKED`
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_stream_init_alloc(struct crush_stream *cs, int level,
+                        unsigned long block_size, int flags,
+                        const struct crush_allocator *allocator);
+
+/**
+ * Get required size of `dst` buffer for stream functions.
+ *
+ * @param cs pointer to stream state
+ * @return maximum size of a compressed block including its header
+ */
+CRUSH_API unsigned long
+crush_stream_bound(const struct crush_stream *cs);
+
+/**
+ * Add up to `src_size` bytes of input from `src` to stream.
+ *
+ * If this completes a block, the block is compressed and written to `dst`
+ * with its 4 byte header, and the size is stored in `dst_size`. Otherwise
+ * `dst_size` is set to 0.
+ *
+ * Call repeatedly until all input has been consumed.
+ *
+ * @param cs pointer to stream state
+ * @param src pointer to input
+ * @param src_size number of bytes of input
+ * @param dst pointer to where to place compressed block
+ * @param dst_size pointer to where to store size of compressed block
+ * @return number of bytes of input consumed
+ */
+CRUSH_API unsigned long
+crush_stream_update(struct crush_stream *cs, const void *src,
+                    unsigned long src_size, void *dst,
+                    unsigned long *dst_size);
+
+/**
+ * Compress any pending input to `dst` as a block.
+ *
+ * This allows sending data before a full block has been collected, at the
+ * cost of some ratio.
+ *
+ * @param cs pointer to stream state
+ * @param dst pointer to where to place compressed block
+ * @return size of compressed block including header, 0 if none
+ */
+CRUSH_API unsigned long
+crush_stream_flush(struct crush_stream *cs, void *dst);
+
+/**
+ * Free memory used by stream.
+ *
+ * Any pending input is discarded, so call `crush_stream_flush` first.
+ *
+ * @param cs pointer to stream state
+ */
+CRUSH_API void
+crush_stream_end(struct crush_stream *cs);
+
+/**
+ * Incremental decompression state.
+ *
+ * The members are private, use the `crush_decoder_*` functions.
+ *
+ * @see crush_decoder_init
+ */
+struct crush_decoder {
+	unsigned char *buf;               /**< History followed by decoded data */
+	struct crush_allocator allocator; /**< Allocator for memory */
+	unsigned long long tag;           /**< Bits read ahead of next token */
+	int msb;                          /**< Number of bits in `tag` */
+	unsigned long pos;                /**< End of decoded data in `buf` */
+	unsigned long out_pos;            /**< Start of data not yet returned */
+	unsigned long block_left;         /**< Bytes left to decode in block */
+	unsigned long header;             /**< Block header read so far */
+	int header_size;                  /**< Number of header bytes read */
+	int status;                       /**< Zero or error */
+};
+
+/**
+ * Initialize incremental decompression.
+ *
+ * Decompresses blocks with 4 byte headers, as written by bcrush and
+ * `crush_stream_update`, from input that arrives in chunks of any size. The
+ * last 2 MiB of output is kept as history, so blocks from a stream that
+ * keeps history are decompressed as well as independent ones. The memory
+ * used is about 4 MiB, whatever the block size.
+ *
+ * @see crush_decoder_update
+ *
+ * @param cd pointer to decoder state
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_decoder_init(struct crush_decoder *cd);
+
+/**
+ * Initialize incremental decompression using allocator.
+ *
+ * Like `crush_decoder_init`, but the memory of the decoder is allocated with
+ * `allocator`, which is copied into the decoder. If `allocator` is `NULL`,
+ * `malloc` and `free` are used.
+ *
+ * @param cd pointer to decoder state
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_decoder_init_alloc(struct crush_decoder *cd,
+                         const struct crush_allocator *allocator);
+
+/**
+ * Decompress from up to `src_size` bytes of input at `src` to `dst`.
+ *
+ * Decodes all complete tokens in the input, and keeps the bits of a token
+ * that has not fully arrived for the next call. Up to `dst_capacity` bytes
+ * of decompressed data are written to `dst`, and the size is stored in
+ * `dst_size`. Any more is kept for the next call, which may pass no input.
+ *
+ * More input is needed when all input was consumed and `dst_size` is less
+ * than `dst_capacity`. Every read and write is checked, so a corrupt stream
+ * gives an error rather than reading out of bounds, and the decoder then
+ * stays in the error state.
+ *
+ * @see crush_decoder_done
+ *
+ * @param cd pointer to decoder state
+ * @param src pointer to input
+ * @param src_size number of bytes of input
+ * @param dst pointer to where to place decompressed data
+ * @param dst_capacity size of `dst` buffer
+ * @param dst_size pointer to where to store size of decompressed data
+ * @return number of bytes of input consumed, `CRUSH_ERROR` on error
+ */
+CRUSH_API unsigned long
+crush_decoder_update(struct crush_decoder *cd, const void *src,
+                     unsigned long src_size, void *dst,
+                     unsigned long dst_capacity, unsigned long *dst_size);
+
+/**
+ * Check if decoder is at the end of the data.
+ *
+ * Use this when the input ends, to tell a complete stream from one that
+ * was cut off inside a block.
+ *
+ * @param cd pointer to decoder state
+ * @return non-zero if all data returned ended at a block boundary, zero
+ *         otherwise
+ */
+CRUSH_API int
+crush_decoder_done(const struct crush_decoder *cd);
+
+/**
+ * Free memory used by decoder.
+ *
+ * @param cd pointer to decoder state
+ */
+CRUSH_API void
+crush_decoder_end(struct crush_decoder *cd);
+
+/**
+ * Suffix of the name of a block index file.
+ *
+ * A bcrush file compressed with `--index` is accompanied by an index file,
+ * named like it with this suffix appended, containing:
+ *
+ *     CRUSH_INDEX_MAGIC             (4 bytes)
+ *     number of blocks              (4 bytes)
+ *     packed size, depacked size    (4 + 4 bytes for each block)
+ *
+ * All values are little-endian. The packed size does not include the
+ * 4 byte block header. The compressed file itself is unchanged, so it can be
+ * decompressed without the index.
+ */
+#define CRUSH_INDEX_SUFFIX ".idx"
+
+/**
+ * First 4 bytes of a block index file, "bcix" in little-endian.
+ */
+#define CRUSH_INDEX_MAGIC 0x78696362UL
+
+struct crush_reader_block;
+
+/**
+ * Random access reader for a bcrush file with a block index.
+ *
+ * Decompressed blocks are kept in a cache of limited size, and the least
+ * recently used blocks are dropped when it is full. Unless the library is
+ * built with `CRUSH_NO_THREADS`, a reader can be used by several threads at
+ * the same time.
+ *
+ * The members are private, use the `crush_reader_*` functions.
+ *
+ * @see crush_reader_open
+ */
+struct crush_reader {
+	struct crush_allocator allocator;    /**< Allocator for memory */
+	FILE *file;                          /**< Compressed file */
+	struct crush_reader_block *blocks;   /**< Blocks from index */
+	struct crush_reader_block *lru_head; /**< Most recently used cached block */
+	struct crush_reader_block *lru_tail; /**< Least recently used cached block */
+	void *lock;                          /**< Mutex for file and cache */
+	unsigned long num_blocks;            /**< Number of blocks */
+	unsigned long long size;             /**< Size of decompressed data */
+	size_t cache_size;                   /**< Size of cached blocks */
+	size_t cache_max;                    /**< Maximum size of cached blocks */
+};
+
+/**
+ * Open bcrush file `filename` for random access.
+ *
+ * The file must have a block index file, see `CRUSH_INDEX_SUFFIX`. Up to
+ * `cache_max` bytes of decompressed blocks are cached. With the default
+ * 64 MiB blocks of bcrush, this should be a multiple of 64 MiB for the
+ * cache to be of use, and 0 disables it.
+ *
+ * @see crush_reader_read
+ *
+ * @param cr pointer to reader
+ * @param filename name of file to open
+ * @param cache_max maximum size of cached blocks in bytes
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_reader_open(struct crush_reader *cr, const char *filename,
+                  size_t cache_max);
+
+/**
+ * Open bcrush file `filename` for random access using allocator.
+ *
+ * Like `crush_reader_open`, but the index, the cache and the buffers for
+ * decompressing are allocated using `allocator`, which is copied into the
+ * reader. If `allocator` is `NULL`, `malloc` and `free` are used.
+ *
+ * @see crush_reader_open
+ *
+ * @param cr pointer to reader
+ * @param filename name of file to open
+ * @param cache_max maximum size of cached blocks in bytes
+ * @param allocator pointer to allocator, or `NULL`
+ * @return 0 on success, non-zero on error
+ */
+CRUSH_API int
+crush_reader_open_alloc(struct crush_reader *cr, const char *filename,
+                        size_t cache_max,
+                        const struct crush_allocator *allocator);
+
+/**
+ * Get size of decompressed data of reader.
+ *
+ * @param cr pointer to reader
+ * @return size of decompressed data
+ */
+CRUSH_API unsigned long long
+crush_reader_size(const struct crush_reader *cr);
+
+/**
+ * Read `size` bytes of decompressed data at `offset` to `buf`.
+ *
+ * Only the blocks containing the bytes are decompressed, unless they are in
+ * the cache. The blocks are decompressed with `crush_depack_safe`, so a
+ * corrupt file gives an error rather than reading out of bounds.
+ *
+ * @param cr pointer to reader
+ * @param buf pointer to where to place data
+ * @param size number of bytes to read
+ * @param offset offset in decompressed data
+ * @return number of bytes read, less than `size` at the end of the data,
+ *         `(size_t) -1` on error
+ */
+CRUSH_API size_t
+crush_reader_read(struct crush_reader *cr, void *buf, size_t size,
+                  unsigned long long offset);
+
+/**
+ * Close reader and free memory used by it.
+ *
+ * @param cr pointer to reader
+ */
+CRUSH_API void
+crush_reader_close(struct crush_reader *cr);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,902 @@
+/*
+ * bcrush - Example of CRUSH compression with BriefLZ algorithms
+ *
+ * C++17 header file
+ *
+ * Copyright (c) 2018-2020 Joergen Ibsen
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *   1. The origin of this software must not be misrepresented; you must
+ *      not claim that you wrote the original software. If you use this
+ *      software in a product, an acknowledgment in the product
+ *      documentation would be appreciated but is not required.
+ *
+ *   2. Altered source versions must be plainly marked as such, and must
+ *      not be misrepresented as being the original software.
+ *
+ *   3. This notice may not be removed or altered from any source
+ *      distribution.
+ */
+
+#ifndef CRUSH_HPP_INCLUDED
+#define CRUSH_HPP_INCLUDED
+
+#include "crush.h"
+
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Header-only C++ interface to the library.
+ *
+ * The classes own the memory of the C structs, are move-only, and free it
+ * in their destructor. Constructors throw `std::bad_alloc` if memory cannot
+ * be allocated, and `std::invalid_argument` for invalid arguments. The
+ * compression and decompression functions return `CRUSH_ERROR` on error,
+ * like the C functions.
+ *
+ * Functions taking pointer and size also have overloads taking contiguous
+ * ranges, like `std::vector`, `std::array`, `std::string_view` and
+ * `std::span`, of trivially copyable elements. The sizes of the ranges are
+ * in bytes.
+ */
+
+namespace crush {
+
+/**
+ * Lowest compression level.
+ */
+inline constexpr int min_level = 1;
+
+/**
+ * Highest compression level.
+ */
+inline constexpr int max_level = 10;
+
+/**
+ * Return value on error.
+ */
+inline constexpr unsigned long error = CRUSH_ERROR;
+
+namespace detail {
+
+template<typename T>
+using range_value_t = std::remove_pointer_t<decltype(std::data(std::declval<T &>()))>;
+
+template<typename T, typename = void>
+struct is_byte_range : std::false_type {};
+
+template<typename T>
+struct is_byte_range<T, std::void_t<decltype(std::data(std::declval<T &>())),
+                                    decltype(std::size(std::declval<T &>()))>>
+	: std::is_trivially_copyable<range_value_t<T>> {};
+
+template<typename T>
+inline constexpr bool is_byte_range_v = is_byte_range<T>::value;
+
+template<typename T>
+using enable_if_range_t = std::enable_if_t<is_byte_range_v<T>, int>;
+
+template<typename T>
+using enable_if_mutable_range_t =
+	std::enable_if_t<is_byte_range_v<T> && !std::is_const_v<range_value_t<T>>, int>;
+
+template<typename T>
+std::size_t
+byte_size(T &range)
+{
+	return std::size(range) * sizeof(range_value_t<T>);
+}
+
+/* Sizes passed to the C functions are unsigned long, which is 32 bits on
+ * Windows. */
+inline bool
+fits_ulong(std::size_t size)
+{
+	return static_cast<unsigned long long>(size) <= ULONG_MAX;
+}
+
+inline void *
+default_alloc(void *, std::size_t size)
+{
+	return std::malloc(size);
+}
+
+inline void
+default_free(void *, void *ptr, std::size_t)
+{
+	std::free(ptr);
+}
+
+inline crush_allocator
+allocator_or_default(const crush_allocator *allocator)
+{
+	if (allocator != nullptr) {
+		return *allocator;
+	}
+
+	return crush_allocator { default_alloc, default_free, nullptr };
+}
+
+} /* namespace detail */
+
+/**
+ * Get bound on compressed data size.
+ *
+ * @param src_size number of bytes to compress
+ * @return maximum size of compressed data
+ */
+inline unsigned long
+max_packed_size(unsigned long src_size) noexcept
+{
+	return crush_max_packed_size(src_size);
+}
+
+/**
+ * Get required size of `workmem` for compression level `Level`.
+ *
+ * @tparam Level compression level
+ * @param src_size number of bytes to compress
+ * @return required size in bytes of `workmem`
+ */
+template<int Level>
+std::size_t
+workmem_size(std::size_t src_size) noexcept
+{
+	static_assert(Level >= min_level && Level <= max_level,
+	              "invalid compression level");
+
+	return crush_workmem_size_level(src_size, Level);
+}
+
+/**
+ * Get parameters used by compression level `level`.
+ *
+ * @param level compression level
+ * @return parameters of `level`
+ * @throw std::invalid_argument if `level` is invalid
+ */
+inline crush_params
+params_level(int level)
+{
+	crush_params params;
+
+	if (crush_params_level(&params, level) != 0) {
+		throw std::invalid_argument("crush: invalid compression level");
+	}
+
+	return params;
+}
+
+/**
+ * Memory for temporary use while compressing.
+ *
+ * Owns a buffer sized for inputs up to a given size, which can be passed to
+ * `pack` for any smaller input with the same level or parameters. It can be
+ * reused between calls, but not by several threads at the same time.
+ */
+class workmem {
+public:
+	/**
+	 * Create empty `workmem`, only usable as the target of a move.
+	 */
+	workmem() noexcept = default;
+
+	/**
+	 * Allocate `workmem` for compressing up to `src_size` bytes with
+	 * compression level `level`.
+	 *
+	 * @param src_size maximum number of bytes to compress per call
+	 * @param level compression level
+	 * @param allocator pointer to allocator, or `nullptr` for `malloc`
+	 */
+	workmem(std::size_t src_size, int level,
+	        const crush_allocator *allocator = nullptr)
+		: allocator_(detail::allocator_or_default(allocator))
+	{
+		if (level < min_level || level > max_level) {
+			throw std::invalid_argument("crush: invalid compression level");
+		}
+
+		allocate(crush_workmem_size_level(src_size, level));
+	}
+
+	/**
+	 * Allocate `workmem` for compressing up to `src_size` bytes with
+	 * `params`.
+	 *
+	 * @param src_size maximum number of bytes to compress per call
+	 * @param params compression parameters
+	 * @param allocator pointer to allocator, or `nullptr` for `malloc`
+	 */
+	workmem(std::size_t src_size, const crush_params &params,
+	        const crush_allocator *allocator = nullptr)
+		: allocator_(detail::allocator_or_default(allocator))
+	{
+		const std::size_t size = crush_workmem_size_params(src_size, &params);
+
+		if (size == static_cast<std::size_t>(-1)) {
+			throw std::invalid_argument("crush: invalid compression parameters");
+		}
+
+		allocate(size);
+	}
+
+	workmem(const workmem &) = delete;
+	workmem &operator=(const workmem &) = delete;
+
+	workmem(workmem &&other) noexcept
+		: ptr_(std::exchange(other.ptr_, nullptr)),
+		  size_(std::exchange(other.size_, 0)),
+		  allocator_(other.allocator_)
+	{}
+
+	workmem &
+	operator=(workmem &&other) noexcept
+	{
+		if (this != &other) {
+			release();
+			ptr_ = std::exchange(other.ptr_, nullptr);
+			size_ = std::exchange(other.size_, 0);
+			allocator_ = other.allocator_;
+		}
+
+		return *this;
+	}
+
+	~workmem() { release(); }
+
+	/** Pointer to memory, `nullptr` if empty */
+	void *data() const noexcept { return ptr_; }
+
+	/** Size of memory in bytes */
+	std::size_t size() const noexcept { return size_; }
+
+private:
+	void
+	allocate(std::size_t size)
+	{
+		/* Allocate at least one byte, so an empty size is not mistaken
+		 * for failure. */
+		ptr_ = allocator_.alloc(allocator_.opaque, size > 0 ? size : 1);
+
+		if (ptr_ == nullptr) {
+			throw std::bad_alloc();
+		}
+
+		size_ = size;
+	}
+
+	void
+	release() noexcept
+	{
+		if (ptr_ != nullptr) {
+			allocator_.free(allocator_.opaque, ptr_, size_ > 0 ? size_ : 1);
+			ptr_ = nullptr;
+			size_ = 0;
+		}
+	}
+
+	void *ptr_ = nullptr;
+	std::size_t size_ = 0;
+	crush_allocator allocator_ = detail::allocator_or_default(nullptr);
+};
+
+/**
+ * Compress `src_size` bytes of data from `src` to `dst` with compression
+ * level `Level`.
+ *
+ * The level is checked at compile time, and the size of `wm` against the
+ * requirement of `Level`, so a `workmem` allocated for a smaller input or
+ * a lower level gives an error rather than writing past it.
+ *
+ * @tparam Level compression level
+ * @param src pointer to data
+ * @param src_size number of bytes to compress
+ * @param dst pointer to where to place compressed data, with room for
+ *        `max_packed_size(src_size)` bytes
+ * @param wm memory for temporary use
+ * @return size of compressed data, `crush::error` on error
+ */
+template<int Level>
+unsigned long
+pack(const void *src, std::size_t src_size, void *dst, workmem &wm) noexcept
+{
+	static_assert(Level >= min_level && Level <= max_level,
+	              "invalid compression level");
+
+	if (!detail::fits_ulong(src_size)
+	 || wm.size() < crush_workmem_size_level(src_size, Level)) {
+		return error;
+	}
+
+	return crush_pack_level(src, dst, static_cast<unsigned long>(src_size),
+	                        wm.data(), Level);
+}
+
+/**
+ * Compress range `src` to `dst` with compression level `Level`.
+ *
+ * @see pack
+ */
+template<int Level, typename Src, typename Dst,
+         detail::enable_if_range_t<Src> = 0,
+         detail::enable_if_mutable_range_t<Dst> = 0>
+unsigned long
+pack(const Src &src, Dst &&dst, workmem &wm) noexcept
+{
+	const std::size_t src_size = detail::byte_size(src);
+
+	if (!detail::fits_ulong(src_size)
+	 || detail::byte_size(dst) < max_packed_size(static_cast<unsigned long>(src_size))) {
+		return error;
+	}
+
+	return pack<Level>(std::data(src), src_size, std::data(dst), wm);
+}
+
+/**
+ * Compress `src_size` bytes of data from `src` to `dst` using `params`.
+ *
+ * @param src pointer to data
+ * @param src_size number of bytes to compress
+ * @param dst pointer to where to place compressed data, with room for
+ *        `max_packed_size(src_size)` bytes
+ * @param wm memory for temporary use
+ * @param params compression parameters
+ * @param stats pointer to where to store statistics, or `nullptr`
+ * @return size of compressed data, `crush::error` on error
+ */
+inline unsigned long
+pack(const void *src, std::size_t src_size, void *dst, workmem &wm,
+     const crush_params &params, crush_stats *stats = nullptr) noexcept
+{
+	const std::size_t size = crush_workmem_size_params(src_size, &params);
+
+	if (!detail::fits_ulong(src_size)
+	 || size == static_cast<std::size_t>(-1) || wm.size() < size) {
+		return error;
+	}
+
+	return crush_pack_params_ex(src, dst, static_cast<unsigned long>(src_size),
+	                            wm.data(), &params, stats);
+}
+
+/**
+ * Compress range `src` to `dst` using `params`.
+ *
+ * @see pack
+ */
+template<typename Src, typename Dst,
+         detail::enable_if_range_t<Src> = 0,
+         detail::enable_if_mutable_range_t<Dst> = 0>
+unsigned long
+pack(const Src &src, Dst &&dst, workmem &wm, const crush_params &params,
+     crush_stats *stats = nullptr) noexcept
+{
+	const std::size_t src_size = detail::byte_size(src);
+
+	if (!detail::fits_ulong(src_size)
+	 || detail::byte_size(dst) < max_packed_size(static_cast<unsigned long>(src_size))) {
+		return error;
+	}
+
+	return pack(std::data(src), src_size, std::data(dst), wm, params, stats);
+}
+
+/**
+ * Decompress `depacked_size` bytes of data from `src` to `dst`.
+ *
+ * The compressed data is trusted, see `crush_depack`.
+ *
+ * @param src pointer to compressed data
+ * @param dst pointer to where to place decompressed data
+ * @param depacked_size size of decompressed data
+ * @return size of decompressed data
+ */
+inline unsigned long
+depack(const void *src, void *dst, unsigned long depacked_size) noexcept
+{
+	return crush_depack(src, dst, depacked_size);
+}
+
+/**
+ * Decompress range `src` to range `dst`, checking every read and write.
+ *
+ * The size of `src` must be the size of the compressed data, and `dst`
+ * must have room for the decompressed data, see `crush_depack_safe`.
+ *
+ * @param src compressed data
+ * @param dst where to place decompressed data
+ * @return size of decompressed data, `crush::error` on error
+ */
+template<typename Src, typename Dst,
+         detail::enable_if_range_t<Src> = 0,
+         detail::enable_if_mutable_range_t<Dst> = 0>
+unsigned long
+depack(const Src &src, Dst &&dst) noexcept
+{
+	const std::size_t src_size = detail::byte_size(src);
+	std::size_t dst_size = detail::byte_size(dst);
+
+	if (!detail::fits_ulong(src_size)) {
+		return error;
+	}
+
+	/* A larger buffer can still hold any output, so only the size passed
+	 * to the C function is limited. */
+	if (!detail::fits_ulong(dst_size)) {
+		dst_size = ULONG_MAX - 1;
+	}
+
+	return crush_depack_safe(std::data(src), static_cast<unsigned long>(src_size),
+	                         std::data(dst), static_cast<unsigned long>(dst_size));
+}
+
+/**
+ * Prepared dictionary.
+ *
+ * The C struct is kept at a fixed address, so contexts using it stay valid
+ * when the dictionary is moved. It must outlive those contexts.
+ *
+ * @see crush_dict_init
+ */
+class dictionary {
+public:
+	/**
+	 * Prepare `size` bytes of dictionary at `data` for compressing with
+	 * compression level `level`.
+	 *
+	 * @param allocator pointer to allocator, or `nullptr` for `malloc`
+	 */
+	dictionary(const void *data, unsigned long size, int level,
+	           const crush_allocator *allocator = nullptr)
+		: dict_(new crush_dict())
+	{
+		if (level < min_level || level > max_level) {
+			throw std::invalid_argument("crush: invalid compression level");
+		}
+
+		if (crush_dict_init_alloc(dict_.get(), data, size, level, allocator) != 0) {
+			throw std::bad_alloc();
+		}
+	}
+
+	/**
+	 * Prepare range `data` as dictionary for compressing with compression
+	 * level `level`.
+	 *
+	 * @param allocator pointer to allocator, or `nullptr` for `malloc`
+	 */
+	template<typename Data, detail::enable_if_range_t<Data> = 0>
+	dictionary(const Data &data, int level,
+	           const crush_allocator *allocator = nullptr)
+		: dictionary(std::data(data), checked_size(data), level, allocator)
+	{}
+
+	dictionary(const dictionary &) = delete;
+	dictionary &operator=(const dictionary &) = delete;
+	dictionary(dictionary &&) noexcept = default;
+	dictionary &operator=(dictionary &&other) noexcept
+	{
+		if (this != &other) {
+			release();
+			dict_ = std::move(other.dict_);
+		}
+
+		return *this;
+	}
+
+	~dictionary() { release(); }
+
+	/** Pointer to C struct */
+	const crush_dict *get() const noexcept { return dict_.get(); }
+
+	/** Dictionary data, which `depack_dict` must be passed */
+	const void *data() const noexcept { return dict_->data; }
+
+	/** Size of dictionary data */
+	unsigned long size() const noexcept { return dict_->size; }
+
+private:
+	template<typename Data>
+	static unsigned long
+	checked_size(const Data &data)
+	{
+		const std::size_t size = detail::byte_size(data);
+
+		if (!detail::fits_ulong(size)) {
+			throw std::invalid_argument("crush: dictionary too large");
+		}
+
+		return static_cast<unsigned long>(size);
+	}
+
+	void
+	release() noexcept
+	{
+		if (dict_ != nullptr) {
+			crush_dict_end(dict_.get());
+		}
+	}
+
+	std::unique_ptr<crush_dict> dict_;
+};
+
+/**
+ * Decompress data from a context using `dict` to `dst`.
+ *
+ * @see crush_depack_dict
+ *
+ * @param src pointer to compressed data
+ * @param dst pointer to where to place decompressed data
+ * @param depacked_size size of decompressed data
+ * @param dict dictionary the data was compressed with
+ * @return size of decompressed data, `crush::error` on error
+ */
+inline unsigned long
+depack(const void *src, void *dst, unsigned long depacked_size,
+       const dictionary &dict) noexcept
+{
+	return crush_depack_dict(src, dst, depacked_size, dict.data(), dict.size());
+}
+
+/**
+ * Compression context.
+ *
+ * @see crush_ctx_init
+ */
+class context {
+public:
+	/**
+	 * Create context for compressing up to `max_size` bytes per call with
+	 * compression level `level`.
+	 */
+	context(int level, unsigned long max_size,
+	        const crush_allocator *allocator = nullptr)
+	{
+		if (level < min_level || level > max_level) {
+			throw std::invalid_argument("crush: invalid compression level");
+		}
+
+		if (crush_ctx_init_alloc(&ctx_, level, max_size, allocator) != 0) {
+			throw std::bad_alloc();
+		}
+	}
+
+	/**
+	 * Create context for compressing up to `max_size` bytes per call
+	 * following `dict`.
+	 */
+	context(const dictionary &dict, unsigned long max_size,
+	        const crush_allocator *allocator = nullptr)
+	{
+		if (crush_ctx_init_dict_alloc(&ctx_, dict.get(), max_size, allocator) != 0) {
+			throw std::bad_alloc();
+		}
+	}
+
+	context(const context &) = delete;
+	context &operator=(const context &) = delete;
+
+	context(context &&other) noexcept
+		: ctx_(std::exchange(other.ctx_, crush_ctx()))
+	{}
+
+	context &
+	operator=(context &&other) noexcept
+	{
+		if (this != &other) {
+			crush_ctx_end(&ctx_);
+			ctx_ = std::exchange(other.ctx_, crush_ctx());
+		}
+
+		return *this;
+	}
+
+	~context() { crush_ctx_end(&ctx_); }
+
+	/**
+	 * Compress `src_size` bytes of data from `src` to `dst`.
+	 *
+	 * @return size of compressed data, `crush::error` on error
+	 */
+	unsigned long
+	pack(const void *src, std::size_t src_size, void *dst) noexcept
+	{
+		if (src_size > ctx_.max_size) {
+			return error;
+		}
+
+		return crush_ctx_pack(&ctx_, src, dst, static_cast<unsigned long>(src_size));
+	}
+
+	/**
+	 * Compress range `src` to range `dst`.
+	 *
+	 * @return size of compressed data, `crush::error` on error
+	 */
+	template<typename Src, typename Dst,
+	         detail::enable_if_range_t<Src> = 0,
+	         detail::enable_if_mutable_range_t<Dst> = 0>
+	unsigned long
+	pack(const Src &src, Dst &&dst) noexcept
+	{
+		const std::size_t src_size = detail::byte_size(src);
+
+		if (src_size > ctx_.max_size
+		 || detail::byte_size(dst) < max_packed_size(static_cast<unsigned long>(src_size))) {
+			return error;
+		}
+
+		return pack(std::data(src), src_size, std::data(dst));
+	}
+
+	/** Maximum number of bytes to compress per call */
+	unsigned long max_size() const noexcept { return ctx_.max_size; }
+
+	/** Pointer to C struct, for the batch functions */
+	crush_ctx *get() noexcept { return &ctx_; }
+
+private:
+	crush_ctx ctx_ {};
+};
+
+/**
+ * Streaming compression state.
+ *
+ * @see crush_stream_init
+ */
+class stream {
+public:
+	/**
+	 * Create stream compressing blocks of `block_size` bytes with
+	 * compression level `level`.
+	 */
+	stream(int level, unsigned long block_size, int flags = 0,
+	       const crush_allocator *allocator = nullptr)
+	{
+		if (level < min_level || level > max_level) {
+			throw std::invalid_argument("crush: invalid compression level");
+		}
+
+		if (crush_stream_init_alloc(&cs_, level, block_size, flags, allocator) != 0) {
+			throw std::bad_alloc();
+		}
+	}
+
+	stream(const stream &) = delete;
+	stream &operator=(const stream &) = delete;
+
+	stream(stream &&other) noexcept
+		: cs_(std::exchange(other.cs_, crush_stream()))
+	{}
+
+	stream &
+	operator=(stream &&other) noexcept
+	{
+		if (this != &other) {
+			crush_stream_end(&cs_);
+			cs_ = std::exchange(other.cs_, crush_stream());
+		}
+
+		return *this;
+	}
+
+	/** Pending input is discarded, call `flush` first */
+	~stream() { crush_stream_end(&cs_); }
+
+	/** Required size of `dst` for `update` and `flush` */
+	unsigned long bound() const noexcept { return crush_stream_bound(&cs_); }
+
+	/**
+	 * Add up to `src_size` bytes of input from `src`.
+	 *
+	 * @see crush_stream_update
+	 *
+	 * @param src pointer to input
+	 * @param src_size number of bytes of input
+	 * @param dst pointer to where to place compressed block, with room
+	 *        for `bound()` bytes
+	 * @param dst_size where to store size of compressed block, 0 if none
+	 * @return number of bytes of input consumed
+	 */
+	unsigned long
+	update(const void *src, unsigned long src_size, void *dst,
+	       unsigned long &dst_size) noexcept
+	{
+		return crush_stream_update(&cs_, src, src_size, dst, &dst_size);
+	}
+
+	/**
+	 * Compress any pending input to `dst`, with room for `bound()` bytes.
+	 *
+	 * @return size of compressed block including header, 0 if none
+	 */
+	unsigned long flush(void *dst) noexcept { return crush_stream_flush(&cs_, dst); }
+
+private:
+	crush_stream cs_ {};
+};
+
+/**
+ * Incremental decompression state.
+ *
+ * @see crush_decoder_init
+ */
+class decoder {
+public:
+	/**
+	 * Create decoder for blocks with headers, as written by `stream`.
+	 */
+	explicit decoder(const crush_allocator *allocator = nullptr)
+	{
+		if (crush_decoder_init_alloc(&cd_, allocator) != 0) {
+			throw std::bad_alloc();
+		}
+	}
+
+	decoder(const decoder &) = delete;
+	decoder &operator=(const decoder &) = delete;
+
+	decoder(decoder &&other) noexcept
+		: cd_(std::exchange(other.cd_, crush_decoder()))
+	{}
+
+	decoder &
+	operator=(decoder &&other) noexcept
+	{
+		if (this != &other) {
+			crush_decoder_end(&cd_);
+			cd_ = std::exchange(other.cd_, crush_decoder());
+		}
+
+		return *this;
+	}
+
+	~decoder() { crush_decoder_end(&cd_); }
+
+	/**
+	 * Decompress from up to `src_size` bytes of input at `src` to `dst`.
+	 *
+	 * @see crush_decoder_update
+	 *
+	 * @param src pointer to input
+	 * @param src_size number of bytes of input
+	 * @param dst pointer to where to place decompressed data
+	 * @param dst_capacity size of `dst` buffer
+	 * @param dst_size where to store size of decompressed data
+	 * @return number of bytes of input consumed, `crush::error` on error
+	 */
+	unsigned long
+	update(const void *src, unsigned long src_size, void *dst,
+	       unsigned long dst_capacity, unsigned long &dst_size) noexcept
+	{
+		return crush_decoder_update(&cd_, src, src_size, dst, dst_capacity,
+		                            &dst_size);
+	}
+
+	/**
+	 * Decompress from range `src` to range `dst`.
+	 *
+	 * @return number of bytes of input consumed, `crush::error` on error
+	 */
+	template<typename Src, typename Dst,
+	         detail::enable_if_range_t<Src> = 0,
+	         detail::enable_if_mutable_range_t<Dst> = 0>
+	unsigned long
+	update(const Src &src, Dst &&dst, unsigned long &dst_size) noexcept
+	{
+		const std::size_t src_size = detail::byte_size(src);
+		std::size_t dst_capacity = detail::byte_size(dst);
+
+		dst_size = 0;
+
+		if (!detail::fits_ulong(src_size)) {
+			return error;
+		}
+
+		if (!detail::fits_ulong(dst_capacity)) {
+			dst_capacity = ULONG_MAX;
+		}
+
+		return update(std::data(src), static_cast<unsigned long>(src_size),
+		              std::data(dst), static_cast<unsigned long>(dst_capacity),
+		              dst_size);
+	}
+
+	/** True if the data returned ended at a block boundary or the index */
+	bool done() const noexcept { return crush_decoder_done(&cd_) != 0; }
+
+private:
+	crush_decoder cd_ {};
+};
+
+/**
+ * Random access reader for bcrush files with a block index.
+ *
+ * @see crush_reader_open
+ */
+class reader {
+public:
+	/**
+	 * Open bcrush file `filename`, caching up to `cache_max` bytes of
+	 * decompressed blocks.
+	 *
+	 * @throw std::runtime_error if the file cannot be opened or has no
+	 *        valid index
+	 */
+	explicit reader(const char *filename, std::size_t cache_max = 0)
+	{
+		if (crush_reader_open(&cr_, filename, cache_max) != 0) {
+			throw std::runtime_error("crush: unable to open indexed file");
+		}
+	}
+
+	reader(const reader &) = delete;
+	reader &operator=(const reader &) = delete;
+
+	reader(reader &&other) noexcept
+		: cr_(std::exchange(other.cr_, crush_reader()))
+	{}
+
+	reader &
+	operator=(reader &&other) noexcept
+	{
+		if (this != &other) {
+			crush_reader_close(&cr_);
+			cr_ = std::exchange(other.cr_, crush_reader());
+		}
+
+		return *this;
+	}
+
+	~reader() { crush_reader_close(&cr_); }
+
+	/** Size of decompressed data */
+	unsigned long long size() const noexcept { return crush_reader_size(&cr_); }
+
+	/**
+	 * Read `size` bytes of decompressed data at `offset` to `buf`.
+	 *
+	 * @return number of bytes read, `(size_t) -1` on error
+	 */
+	std::size_t
+	read(void *buf, std::size_t size, unsigned long long offset) noexcept
+	{
+		return crush_reader_read(&cr_, buf, size, offset);
+	}
+
+	/**
+	 * Read decompressed data at `offset` to fill range `buf`.
+	 *
+	 * @return number of bytes read, `(size_t) -1` on error
+	 */
+	template<typename Buf, detail::enable_if_mutable_range_t<Buf> = 0>
+	std::size_t
+	read(Buf &&buf, unsigned long long offset) noexcept
+	{
+		return read(std::data(buf), detail::byte_size(buf), offset);
+	}
+
+private:
+	crush_reader cr_ {};
+};
+
+} /* namespace crush */
+
+#endif /* CRUSH_HPP_INCLUDED */
@@ -0,0 +1,221 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Memory allocators
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#if !defined(_WIN32)
+// MAP_ANONYMOUS and madvise are not part of C99 or POSIX.1-2001
+#  define _DEFAULT_SOURCE
+#  define _DARWIN_C_SOURCE
+#endif
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#    define MAP_ANONYMOUS MAP_ANON
+#  endif
+#endif
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024UL)
+
+static void *
+crush_default_alloc(void *opaque, size_t size)
+{
+	(void) opaque;
+
+	return malloc(size);
+}
+
+static void
+crush_default_free(void *opaque, void *ptr, size_t size)
+{
+	(void) opaque;
+	(void) size;
+
+	free(ptr);
+}
+
+void
+crush_allocator_init(struct crush_allocator *dst,
+                     const struct crush_allocator *src)
+{
+	if (src != NULL) {
+		*dst = *src;
+	}
+	else {
+		dst->alloc = crush_default_alloc;
+		dst->free = crush_default_free;
+		dst->opaque = NULL;
+	}
+}
+
+// Huge page allocation.
+//
+// The match finders of the slower levels randomly access arrays of several
+// bytes per input byte, so with 4 KiB pages most accesses miss the TLB.
+// Allocating in 2 MiB units aligned to 2 MiB lets the kernel back them with
+// huge pages.
+//
+// All huge allocations are whole mappings, so they are freed the same way
+// whichever kind of pages they got.
+//
+#if defined(_WIN32)
+static void *
+crush_huge_alloc(void *opaque, size_t size)
+{
+	(void) opaque;
+
+	// Windows has no transparent huge pages, so this gets normal pages,
+	// aligned to the 64 KiB allocation granularity
+	return VirtualAlloc(NULL, size > 0 ? size : 1, MEM_RESERVE | MEM_COMMIT,
+	                    PAGE_READWRITE);
+}
+
+static void *
+crush_huge_alloc_explicit(void *opaque, size_t size)
+{
+	SIZE_T large_size = GetLargePageMinimum();
+
+	// Large pages need the "Lock pages in memory" privilege
+	if (large_size > 0 && size <= SIZE_MAX - large_size) {
+		SIZE_T map_size = (size + large_size - 1) & ~(large_size - 1);
+		void *p = VirtualAlloc(NULL, map_size > 0 ? map_size : large_size,
+		                       MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+		                       PAGE_READWRITE);
+
+		if (p != NULL) {
+			return p;
+		}
+	}
+
+	return crush_huge_alloc(opaque, size);
+}
+
+static void
+crush_huge_free(void *opaque, void *ptr, size_t size)
+{
+	(void) opaque;
+	(void) size;
+
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+#else
+// Round size up to a whole number of huge pages, 0 on overflow.
+static size_t
+crush_huge_size(size_t size)
+{
+	if (size > SIZE_MAX - HUGE_PAGE_SIZE) {
+		return 0;
+	}
+
+	return size > 0 ? (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1)
+	                : HUGE_PAGE_SIZE;
+}
+
+static void *
+crush_huge_alloc(void *opaque, size_t size)
+{
+	const size_t huge_size = crush_huge_size(size);
+	unsigned char *p;
+	size_t head;
+
+	(void) opaque;
+
+	if (huge_size == 0 || huge_size > SIZE_MAX - HUGE_PAGE_SIZE) {
+		return NULL;
+	}
+
+	// Map one extra huge page, and unmap the ends to align the start
+	p = (unsigned char *) mmap(NULL, huge_size + HUGE_PAGE_SIZE,
+	                           PROT_READ | PROT_WRITE,
+	                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == (unsigned char *) MAP_FAILED) {
+		return NULL;
+	}
+
+	head = (HUGE_PAGE_SIZE - ((uintptr_t) p & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+
+	if (head > 0) {
+		munmap(p, head);
+	}
+
+	munmap(p + head + huge_size, HUGE_PAGE_SIZE - head);
+
+	p += head;
+
+#if defined(MADV_HUGEPAGE)
+	// Transparent huge pages may be enabled only for advised ranges
+	madvise(p, huge_size, MADV_HUGEPAGE);
+#endif
+
+	return p;
+}
+
+static void *
+crush_huge_alloc_explicit(void *opaque, size_t size)
+{
+#if defined(MAP_HUGETLB)
+	const size_t huge_size = crush_huge_size(size);
+
+	// This fails unless huge pages have been reserved
+	if (huge_size > 0) {
+		void *p = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+		               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+		if (p != MAP_FAILED) {
+			return p;
+		}
+	}
+#endif
+
+	return crush_huge_alloc(opaque, size);
+}
+
+static void
+crush_huge_free(void *opaque, void *ptr, size_t size)
+{
+	(void) opaque;
+
+	munmap(ptr, crush_huge_size(size));
+}
+#endif
+
+void
+crush_allocator_huge(struct crush_allocator *allocator, int flags)
+{
+	allocator->alloc = (flags & CRUSH_HUGE_EXPLICIT)
+	                 ? crush_huge_alloc_explicit : crush_huge_alloc;
+	allocator->free = crush_huge_free;
+	allocator->opaque = NULL;
+}
@@ -0,0 +1,360 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Batch compression
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#include <string.h>
+
+#if !defined(CRUSH_NO_THREADS)
+#  include "crush_thread.h"
+#endif
+
+// Smallest number of input bytes to give each thread.
+//
+// Below this, starting a thread, and for crush_pack_batch allocating its
+// workmem, takes longer than compressing the inputs.
+//
+#define BATCH_MIN_JOB_SIZE (64 * 1024UL)
+
+// Inputs first to last - 1 of a batch, compressed by one thread.
+//
+// out is where the first input goes, and the offsets of the inputs are
+// stored relative to it. If ctx is NULL, the job creates its own context.
+struct crush_batch_job {
+	const void *const *srcs;
+	const unsigned long *sizes;
+	size_t first;
+	size_t last;
+	unsigned char *out;
+	unsigned long *offsets;
+	unsigned long out_size;
+	struct crush_ctx *ctx;
+	int level;
+	int started;
+#if !defined(CRUSH_NO_THREADS)
+	struct crush_thread thread;
+#endif
+};
+
+static void
+crush_batch_job_run(void *arg)
+{
+	struct crush_batch_job *job = (struct crush_batch_job *) arg;
+	struct crush_ctx local_ctx;
+	struct crush_ctx *ctx = job->ctx;
+	unsigned long out_size = 0;
+
+	if (ctx == NULL) {
+		unsigned long max_size = 0;
+
+		for (size_t i = job->first; i < job->last; ++i) {
+			if (job->sizes[i] > max_size) {
+				max_size = job->sizes[i];
+			}
+		}
+
+		ctx = &local_ctx;
+
+		if (crush_ctx_init(ctx, job->level, max_size)) {
+			crush_ctx_end(ctx);
+			job->out_size = CRUSH_ERROR;
+			return;
+		}
+	}
+
+	for (size_t i = job->first; i < job->last; ++i) {
+		unsigned long res = crush_ctx_pack(ctx, job->srcs[i], job->out + out_size,
+		                                   job->sizes[i]);
+
+		if (res == CRUSH_ERROR) {
+			out_size = CRUSH_ERROR;
+			break;
+		}
+
+		job->offsets[i] = out_size;
+		out_size += res;
+	}
+
+	if (ctx == &local_ctx) {
+		crush_ctx_end(ctx);
+	}
+
+	job->out_size = out_size;
+}
+
+unsigned long
+crush_batch_bound(const unsigned long *sizes, size_t n)
+{
+	unsigned long bound = 0;
+
+	for (size_t i = 0; i < n; ++i) {
+		const unsigned long max_packed = crush_max_packed_size(sizes[i]);
+
+		if (max_packed < sizes[i] || bound > CRUSH_ERROR - 1 - max_packed) {
+			return CRUSH_ERROR;
+		}
+
+		bound += max_packed;
+	}
+
+	return bound;
+}
+
+unsigned long
+crush_ctx_pack_batch(struct crush_ctx *ctx, const void *const *srcs,
+                     const unsigned long *sizes, size_t n, void *dst,
+                     unsigned long *offsets)
+{
+	struct crush_batch_job job;
+
+	job.srcs = srcs;
+	job.sizes = sizes;
+	job.first = 0;
+	job.last = n;
+	job.out = (unsigned char *) dst;
+	job.offsets = offsets;
+	job.ctx = ctx;
+	job.level = ctx->level;
+
+	crush_batch_job_run(&job);
+
+	if (job.out_size != CRUSH_ERROR) {
+		offsets[n] = job.out_size;
+	}
+
+	return job.out_size;
+}
+
+// Compress batch on up to num_threads threads, with ctxs[j] for run j, or
+// a new context for each run if ctxs is NULL.
+static unsigned long
+crush_batch_run(const void *const *srcs, const unsigned long *sizes,
+                size_t n, void *dst, unsigned long *offsets, int level,
+                int num_threads, struct crush_ctx *ctxs)
+{
+	struct crush_batch_job jobs[CRUSH_MAX_THREADS];
+	unsigned char *const out = (unsigned char *) dst;
+	unsigned long total_size = 0;
+	unsigned long num_jobs;
+
+	if (num_threads < 1 || num_threads > CRUSH_MAX_THREADS
+	 || crush_batch_bound(sizes, n) == CRUSH_ERROR) {
+		return CRUSH_ERROR;
+	}
+
+	if (n == 0) {
+		offsets[0] = 0;
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		total_size += sizes[i];
+	}
+
+	// Give each thread at least BATCH_MIN_JOB_SIZE bytes and one input
+	num_jobs = (unsigned long) num_threads;
+
+	if (num_jobs > total_size / BATCH_MIN_JOB_SIZE) {
+		num_jobs = total_size / BATCH_MIN_JOB_SIZE;
+	}
+
+	if (num_jobs > n) {
+		num_jobs = (unsigned long) n;
+	}
+
+	if (num_jobs < 1) {
+		num_jobs = 1;
+	}
+
+	// Split into contiguous runs of about the same number of bytes, each
+	// writing after the bound of the inputs before it
+	size_t next = 0;
+	unsigned long done_size = 0;
+	unsigned long out_pos = 0;
+
+	for (unsigned long j = 0; j < num_jobs; ++j) {
+		struct crush_batch_job *job = &jobs[j];
+		const unsigned long job_end = j + 1 < num_jobs
+		                            ? total_size / num_jobs * (j + 1)
+		                            : total_size;
+
+		job->srcs = srcs;
+		job->sizes = sizes;
+		job->first = next;
+		job->out = out + out_pos;
+		job->offsets = offsets;
+		job->ctx = ctxs != NULL ? &ctxs[j] : NULL;
+		job->level = level;
+
+		// Take at least one input, leaving one for each later job
+		do {
+			done_size += sizes[next];
+			out_pos += crush_max_packed_size(sizes[next]);
+			++next;
+		} while (done_size < job_end && n - next > num_jobs - j - 1);
+
+		// The last job takes the rest
+		job->last = j + 1 < num_jobs ? next : n;
+	}
+
+	for (unsigned long j = 1; j < num_jobs; ++j) {
+#if defined(CRUSH_NO_THREADS)
+		jobs[j].started = 0;
+#else
+		jobs[j].started = crush_thread_create(&jobs[j].thread, crush_batch_job_run,
+		                                      &jobs[j]) == 0;
+#endif
+	}
+
+	crush_batch_job_run(&jobs[0]);
+
+	for (unsigned long j = 1; j < num_jobs; ++j) {
+		if (jobs[j].started) {
+#if !defined(CRUSH_NO_THREADS)
+			crush_thread_join(&jobs[j].thread);
+#endif
+		}
+		else {
+			crush_batch_job_run(&jobs[j]);
+		}
+	}
+
+	// Move the output of each job down after the previous one
+	unsigned long packed_size = 0;
+
+	for (unsigned long j = 0; j < num_jobs; ++j) {
+		struct crush_batch_job *job = &jobs[j];
+
+		if (job->out_size == CRUSH_ERROR) {
+			return CRUSH_ERROR;
+		}
+
+		if (job->out != out + packed_size) {
+			memmove(out + packed_size, job->out, job->out_size);
+		}
+
+		for (size_t i = job->first; i < job->last; ++i) {
+			offsets[i] += packed_size;
+		}
+
+		packed_size += job->out_size;
+	}
+
+	offsets[n] = packed_size;
+
+	return packed_size;
+}
+
+unsigned long
+crush_pack_batch(const void *const *srcs, const unsigned long *sizes,
+                 size_t n, void *dst, unsigned long *offsets, int level,
+                 int num_threads)
+{
+	return crush_batch_run(srcs, sizes, n, dst, offsets, level, num_threads,
+	                       NULL);
+}
+
+int
+crush_batch_init(struct crush_batch *cb, int level, unsigned long max_size,
+                 int num_threads)
+{
+	return crush_batch_init_alloc(cb, level, max_size, num_threads, NULL);
+}
+
+int
+crush_batch_init_alloc(struct crush_batch *cb, int level,
+                       unsigned long max_size, int num_threads,
+                       const struct crush_allocator *allocator)
+{
+	crush_allocator_init(&cb->allocator, allocator);
+
+	cb->ctxs = NULL;
+	cb->max_size = max_size;
+	cb->num_threads = 0;
+	cb->level = level;
+
+	if (num_threads < 1 || num_threads > CRUSH_MAX_THREADS) {
+		return -1;
+	}
+
+	cb->ctxs = (struct crush_ctx *) cb->allocator.alloc(cb->allocator.opaque,
+	                                                   (size_t) num_threads * sizeof(*cb->ctxs));
+
+	if (cb->ctxs == NULL) {
+		return -1;
+	}
+
+	// A zeroed context has nothing to free, so end works after an error
+	memset(cb->ctxs, 0, (size_t) num_threads * sizeof(*cb->ctxs));
+	cb->num_threads = num_threads;
+
+	for (int i = 0; i < num_threads; ++i) {
+		if (crush_ctx_init_alloc(&cb->ctxs[i], level, max_size, &cb->allocator)) {
+			crush_batch_end(cb);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+unsigned long
+crush_batch_pack(struct crush_batch *cb, const void *const *srcs,
+                 const unsigned long *sizes, size_t n, void *dst,
+                 unsigned long *offsets)
+{
+	if (cb->ctxs == NULL) {
+		return CRUSH_ERROR;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (sizes[i] > cb->max_size) {
+			return CRUSH_ERROR;
+		}
+	}
+
+	return crush_batch_run(srcs, sizes, n, dst, offsets, cb->level,
+	                       cb->num_threads, cb->ctxs);
+}
+
+void
+crush_batch_end(struct crush_batch *cb)
+{
+	if (cb->ctxs != NULL) {
+		for (int i = 0; i < cb->num_threads; ++i) {
+			crush_ctx_end(&cb->ctxs[i]);
+		}
+
+		cb->allocator.free(cb->allocator.opaque, cb->ctxs,
+		                   (size_t) cb->num_threads * sizeof(*cb->ctxs));
+	}
+
+	cb->ctxs = NULL;
+	cb->num_threads = 0;
+}
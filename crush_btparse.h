@@ -29,9 +29,10 @@
 #define CRUSH_BTPARSE_H_INCLUDED
 
 static size_t
-crush_btparse_workmem_size(size_t src_size)
+crush_btparse_workmem_size(size_t src_size, int hash_bits)
 {
-	return (5 * src_size + 3 + LOOKUP_SIZE) * sizeof(uint32_t);
+	return (src_size + 1) * sizeof(struct crush_step)
+	     + (2 * src_size + (1UL << hash_bits)) * sizeof(uint32_t);
 }
 
 // Forwards dynamic programming parse using binary trees, checking all
@@ -44,19 +45,35 @@ crush_btparse_workmem_size(size_t src_size)
 // in practice, and has the advantage that we get the matches in order from
 // closest and back.
 //
-// A drawback is the memory requirement of 5 * src_size words, since we cannot
-// overlap the arrays in a forwards parse.
+// A drawback is the memory requirement of 4 * src_size words, a step and two
+// tree nodes per position, since we cannot overlap the arrays in a forwards
+// parse.
 //
 // This match search method is found in LZMA by Igor Pavlov, libdeflate
 // by Eric Biggers, and other libraries.
 //
+// src points to hist_size bytes of history followed by the src_size bytes to
+// compress. The history is inserted into the trees, so workmem is sized for
+// hist_size + src_size bytes. base is the lookup tag base, see
+// crush_lookup_init. The lookup has 2^hash_bits entries, and matches are at
+// most window bytes back. The search depth is given by max_depth and
+// node_budget, see crush_depth, and token_weight adds crush_token_cost to
+// the cost of each token. If stats is not NULL, the searches and time are
+// added to it.
+//
 static unsigned long
-crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *workmem,
-                   const unsigned long max_depth, const unsigned long accept_len)
+crush_pack_btparse(const void *src, unsigned long hist_size, void *dst,
+                   unsigned long src_size, void *workmem, uint32_t base,
+                   const int hash_bits, const unsigned long window,
+                   const unsigned long max_depth, const unsigned long accept_len,
+                   const unsigned long node_budget, const int token_weight,
+                   struct crush_stats *stats)
 {
 	struct lsb_bitwriter lbw;
 	const unsigned char *const in = (const unsigned char *) src;
-	const unsigned long last_match_pos = src_size > 3 ? src_size - 3 : 0;
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long last_match_pos = src_end > 3 ? src_end - 3 : 0;
+	clock_t start = crush_stats_clock(stats);
 
 	// Check for empty input
 	if (src_size == 0) {
@@ -66,45 +83,50 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 	lbw_init(&lbw, (unsigned char *) dst);
 
 	if (src_size < 4) {
-		for (unsigned long i = 0; i < src_size; ++i) {
-			lbw_putbits(&lbw, (uint32_t) in[i] << 1, 9);
+		for (unsigned long i = hist_size; i < src_end; ++i) {
+			crush_put_literal(&lbw, in[i]);
 		}
 
 		return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
 	}
 
-	uint32_t *const cost = (uint32_t *) workmem;
-	uint32_t *const mpos = cost + src_size + 1;
-	uint32_t *const mlen = mpos + src_size + 1;
-	uint32_t *const nodes = mlen + src_size + 1;
-	uint32_t *const lookup = nodes + 2 * src_size;
+	// The lookup is first, so it is in the same place in workmem for
+	// any src_size
+	uint32_t *const lookup = (uint32_t *) workmem;
+	struct crush_step *const step = (struct crush_step *) (lookup + (1UL << hash_bits));
+	uint32_t *const nodes = (uint32_t *) (step + src_end + 1);
 
 	// Initialize lookup
-	for (unsigned long i = 0; i < LOOKUP_SIZE; ++i) {
-		lookup[i] = NO_MATCH_POS;
-	}
+	base = crush_lookup_init(lookup, 1UL << hash_bits, base);
 
 	// Initialize to all literals with infinite cost
-	for (unsigned long i = 0; i <= src_size; ++i) {
-		cost[i] = UINT32_MAX;
-		mlen[i] = 1;
+	for (unsigned long i = 0; i <= src_end; ++i) {
+		step[i].cost = UINT32_MAX;
+		step[i].token = crush_token(0, 1);
 	}
 
-	cost[0] = 0;
+	step[0].cost = 0;
 
 	// Next position where we are going to check matches
 	//
 	// This is used to skip matching while still updating the trees when
-	// we find a match that is accept_len or longer.
+	// we find a match that is accept_len or longer, and when inserting
+	// the history.
 	//
-	unsigned long next_match_cur = 0;
+	unsigned long next_match_cur = hist_size;
+
+	const unsigned long lit_cost = 9 + crush_token_cost(token_weight);
+
+	struct crush_depth depth;
+
+	crush_depth_init(&depth, max_depth, node_budget);
 
 	// Phase 1: Find lowest cost path arriving at each position
 	for (unsigned long cur = 0; cur <= last_match_pos; ++cur) {
 		// Check literal
-		if (cost[cur + 1] > cost[cur] + 9) {
-			cost[cur + 1] = cost[cur] + 9;
-			mlen[cur + 1] = 1;
+		if (step[cur + 1].cost > step[cur].cost + lit_cost) {
+			step[cur + 1].cost = step[cur].cost + lit_cost;
+			step[cur + 1].token = crush_token(0, 1);
 		}
 
 		if (cur > next_match_cur) {
@@ -119,9 +141,9 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 		// hash. We are going to re-root the tree so cur becomes the
 		// new root.
 		//
-		const unsigned long hash = crush_hash3_bits(&in[cur], CRUSH_HASH_BITS);
-		unsigned long pos = lookup[hash];
-		lookup[hash] = cur;
+		const unsigned long hash = crush_hash3_bits(&in[cur], hash_bits);
+		unsigned long pos = crush_lookup_pos(lookup[hash], base);
+		lookup[hash] = cur + base;
 
 		uint32_t *lt_node = &nodes[2 * cur];
 		uint32_t *gt_node = &nodes[2 * cur + 1];
@@ -132,11 +154,13 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 
 		// If we are checking matches, allow lengths up to MAX_MATCH,
 		// otherwise compare only up to accept_len
-		const unsigned long len_left = src_size - cur > MAX_MATCH ? MAX_MATCH : src_size - cur;
+		const unsigned long len_left = src_end - cur > MAX_MATCH ? MAX_MATCH : src_end - cur;
 		const unsigned long len_limit = cur == next_match_cur ? len_left
 		                              : accept_len < len_left ? accept_len
 		                              : len_left;
-		unsigned long num_chain = max_depth;
+		unsigned long num_chain = depth.depth;
+		unsigned long num_nodes = 0;
+		unsigned long best_node = 0;
 
 		// Check matches
 		for (;;) {
@@ -146,13 +170,15 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 			// subtree we have not searched yet and do not know
 			// where belongs.
 			//
-			if (pos == NO_MATCH_POS || cur - pos > W_SIZE || num_chain-- == 0) {
+			if (pos == NO_MATCH_POS || cur - pos > window || num_chain-- == 0) {
 				*lt_node = NO_MATCH_POS;
 				*gt_node = NO_MATCH_POS;
 
 				break;
 			}
 
+			++num_nodes;
+
 			// The string at pos is lexicographically greater than
 			// a string that matched in the first lt_len positions,
 			// and less than a string that matched in the first
@@ -161,9 +187,7 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 			unsigned long len = lt_len < gt_len ? lt_len : gt_len;
 
 			// Find match len
-			while (len < len_limit && in[pos + len] == in[cur + len]) {
-				++len;
-			}
+			len = crush_match_len(&in[pos], &in[cur], len, len_limit);
 
 			// Extend current match if possible
 			//
@@ -174,21 +198,26 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 			// only consider the extension.
 			//
 			if (cur == next_match_cur && len > max_len) {
+				const unsigned long offs = cur - pos - 1;
+				const unsigned long offs_cost = crush_offs_cost(offs)
+				                              + crush_token_cost(token_weight);
+				const unsigned long cost_here = step[cur].cost;
+
 				for (unsigned long i = max_len + 1; i <= len; ++i) {
-					unsigned long match_cost = crush_match_cost(cur - pos - 1, i);
+					unsigned long match_cost = offs_cost + crush_len_cost(i);
 
-					assert(match_cost < UINT32_MAX - cost[cur]);
+					assert(match_cost < UINT32_MAX - cost_here);
 
-					unsigned long cost_there = cost[cur] + match_cost;
+					unsigned long cost_there = cost_here + match_cost;
 
-					if (cost_there < cost[cur + i]) {
-						cost[cur + i] = cost_there;
-						mpos[cur + i] = cur - pos - 1;
-						mlen[cur + i] = i;
+					if (cost_there < step[cur + i].cost) {
+						step[cur + i].cost = cost_there;
+						step[cur + i].token = crush_token(offs, i);
 					}
 				}
 
 				max_len = len;
+				best_node = num_nodes;
 
 				if (len >= accept_len) {
 					next_match_cur = cur + len;
@@ -239,77 +268,565 @@ crush_pack_btparse(const void *src, void *dst, unsigned long src_size, void *wor
 				gt_len = len;
 			}
 		}
+
+		crush_stats_search(stats, num_nodes, depth.depth);
+		crush_depth_search(&depth, num_nodes, best_node);
 	}
 
-	for (unsigned long cur = last_match_pos + 1; cur < src_size; ++cur) {
+	for (unsigned long cur = last_match_pos + 1; cur < src_end; ++cur) {
 		// Check literal
-		if (cost[cur + 1] > cost[cur] + 9) {
-			cost[cur + 1] = cost[cur] + 9;
-			mlen[cur + 1] = 1;
+		if (step[cur + 1].cost > step[cur].cost + lit_cost) {
+			step[cur + 1].cost = step[cur].cost + lit_cost;
+			step[cur + 1].token = crush_token(0, 1);
 		}
 	}
 
+	start = crush_stats_find_time(stats, start);
+
 	// Phase 2: Follow lowest cost path backwards gathering tokens
-	unsigned long next_token = src_size;
+	unsigned long next_token = src_end;
+
+	for (unsigned long cur = src_end; cur > hist_size; --next_token) {
+		const uint32_t token = step[cur].token;
 
-	for (unsigned long cur = src_size; cur > 0; cur -= mlen[cur], --next_token) {
-		mlen[next_token] = mlen[cur];
-		mpos[next_token] = mpos[cur];
+		step[next_token].token = token;
+		cur -= crush_token_len(token);
 	}
 
 	// Phase 3: Output tokens
-	unsigned long cur = 0;
-	for (unsigned long i = next_token + 1; i <= src_size; cur += mlen[i++]) {
-		if (mlen[i] == 1) {
-			lbw_putbits(&lbw, (uint32_t) in[cur] << 1, 9);
+	unsigned long cur = hist_size;
+	for (unsigned long i = next_token + 1; i <= src_end; ++i) {
+		crush_put_token(&lbw, step[i].token, &in[cur]);
+		cur += crush_token_len(step[i].token);
+	}
+
+	crush_stats_output_time(stats, start);
+
+	// Return compressed size
+	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
+}
+
+// Number of positions in each segment of the windowed parse.
+#define BTPARSE_SEGMENT_SIZE (1UL << 20)
+
+// Number of steps in the windowed parse.
+#define BTPARSE_SEGMENT_ARRAY (BTPARSE_SEGMENT_SIZE + MAX_MATCH + 1)
+
+// Input size above which crush_pack_level uses the windowed parse.
+//
+// Below this the windowed parse does not save memory.
+#define BTPARSE_WINDOW_MIN_SIZE (2 * W_SIZE)
+
+static size_t
+crush_btparse_win_workmem_size(size_t src_size, int hash_bits)
+{
+	(void) src_size;
+
+	return BTPARSE_SEGMENT_ARRAY * sizeof(struct crush_step)
+	     + (2 * W_SIZE + (1UL << hash_bits)) * sizeof(uint32_t);
+}
+
+// Insert cur into the binary tree for its hash, keeping nodes in a ring
+// buffer of W_SIZE entries.
+//
+// If find_matches is set, the matches found that are longer than any
+// closer match are stored in match_len and match_offs, and the number of
+// them is returned. Otherwise compare only up to accept_len, and return 0.
+// The search is added to depth.
+//
+// Nodes for positions W_SIZE or more before cur have been reused, so the
+// search stops at them. This gives up matches at exactly distance W_SIZE,
+// so max_dist must be less than W_SIZE.
+//
+static unsigned long
+crush_btparse_win_insert(const unsigned char *in, unsigned long cur,
+                         unsigned long src_end, uint32_t *nodes,
+                         uint32_t *lookup, uint32_t base, const int hash_bits,
+                         const unsigned long max_dist,
+                         struct crush_depth *depth,
+                         const unsigned long accept_len, int find_matches,
+                         uint32_t *match_len, uint32_t *match_offs,
+                         struct crush_stats *stats)
+{
+	const unsigned long hash = crush_hash3_bits(&in[cur], hash_bits);
+	unsigned long pos = crush_lookup_pos(lookup[hash], base);
+	lookup[hash] = cur + base;
+
+	uint32_t *lt_node = &nodes[2 * (cur & W_MASK)];
+	uint32_t *gt_node = &nodes[2 * (cur & W_MASK) + 1];
+	unsigned long lt_len = 0;
+	unsigned long gt_len = 0;
+	unsigned long max_len = MIN_MATCH - 1;
+	unsigned long num_matches = 0;
+
+	assert(pos == NO_MATCH_POS || pos < cur);
+
+	const unsigned long len_left = src_end - cur > MAX_MATCH ? MAX_MATCH : src_end - cur;
+	const unsigned long len_limit = find_matches ? len_left
+	                              : accept_len < len_left ? accept_len
+	                              : len_left;
+	unsigned long num_chain = depth->depth;
+	unsigned long num_nodes = 0;
+	unsigned long best_node = 0;
+
+	for (;;) {
+		if (pos == NO_MATCH_POS || cur - pos > max_dist || num_chain-- == 0) {
+			*lt_node = NO_MATCH_POS;
+			*gt_node = NO_MATCH_POS;
+
+			break;
+		}
+
+		++num_nodes;
+
+		unsigned long len = lt_len < gt_len ? lt_len : gt_len;
+
+		len = crush_match_len(&in[pos], &in[cur], len, len_limit);
+
+		if (find_matches && len > max_len) {
+			match_len[num_matches] = len;
+			match_offs[num_matches] = cur - pos - 1;
+			++num_matches;
+
+			max_len = len;
+			best_node = num_nodes;
+		}
+
+		const unsigned long node = 2 * (pos & W_MASK);
+
+		if (len >= accept_len || len == len_limit) {
+			*lt_node = nodes[node];
+			*gt_node = nodes[node + 1];
+
+			break;
+		}
+
+		if (in[pos + len] < in[cur + len]) {
+			*lt_node = pos;
+			lt_node = &nodes[node + 1];
+			assert(*lt_node == NO_MATCH_POS || *lt_node < pos);
+			pos = *lt_node;
+			lt_len = len;
 		}
 		else {
-			const unsigned long offs = mpos[i];
+			*gt_node = pos;
+			gt_node = &nodes[node];
+			assert(*gt_node == NO_MATCH_POS || *gt_node < pos);
+			pos = *gt_node;
+			gt_len = len;
+		}
+	}
 
-			lbw_putbits(&lbw, 1, 1);
+	crush_stats_search(stats, num_nodes, depth->depth);
+	crush_depth_search(depth, num_nodes, best_node);
 
-			const unsigned long l = mlen[i] - MIN_MATCH;
+	return num_matches;
+}
 
-			if (l < A) {
-				lbw_putbits(&lbw, 1UL, 1);
-				lbw_putbits(&lbw, l, A_BITS);
-			}
-			else if (l < B) {
-				lbw_putbits(&lbw, 1UL << 1, 2);
-				lbw_putbits(&lbw, l - A, B_BITS);
-			}
-			else if (l < C) {
-				lbw_putbits(&lbw, 1UL << 2, 3);
-				lbw_putbits(&lbw, l - B, C_BITS);
-			}
-			else if (l < D) {
-				lbw_putbits(&lbw, 1UL << 3, 4);
-				lbw_putbits(&lbw, l - C, D_BITS);
+// Parse the positions from range_start up to range_end of a windowed
+// parse to lbw.
+//
+// The lookup is initialized with base, and the positions from tree_start
+// up to range_start are inserted into the trees first. range_start must be
+// the start of a segment. The search depth starts over for each range, and
+// token_weight is as for crush_pack_btparse. If stats is not NULL, the
+// searches and time are added to it.
+//
+static void
+crush_btparse_win_range(const unsigned char *in, unsigned long tree_start,
+                        unsigned long range_start, unsigned long range_end,
+                        unsigned long src_end, struct lsb_bitwriter *lbw,
+                        void *workmem, uint32_t base, const int hash_bits,
+                        const unsigned long window,
+                        const unsigned long max_depth,
+                        const unsigned long accept_len,
+                        const unsigned long node_budget,
+                        const int token_weight, struct crush_stats *stats)
+{
+	const unsigned long last_match_pos = src_end > 3 ? src_end - 3 : 0;
+	clock_t start = crush_stats_clock(stats);
+	uint32_t match_len[MAX_MATCH];
+	uint32_t match_offs[MAX_MATCH];
+
+	// Same lookup placement as crush_pack_btparse
+	uint32_t *const lookup = (uint32_t *) workmem;
+	struct crush_step *const step = (struct crush_step *) (lookup + (1UL << hash_bits));
+	uint32_t *const nodes = (uint32_t *) (step + BTPARSE_SEGMENT_ARRAY);
+
+	// Initialize lookup
+	base = crush_lookup_init(lookup, 1UL << hash_bits, base);
+
+	// Nodes are reused after W_SIZE positions
+	const unsigned long max_dist = window < W_SIZE ? window : W_SIZE - 1;
+
+	const unsigned long lit_cost = 9 + crush_token_cost(token_weight);
+
+	struct crush_depth depth;
+
+	crush_depth_init(&depth, max_depth, node_budget);
+
+	// Insert positions before range into trees
+	for (unsigned long cur = tree_start; cur < range_start && cur <= last_match_pos; ++cur) {
+		crush_btparse_win_insert(in, cur, src_end, nodes, lookup, base,
+		                         hash_bits, max_dist, &depth, accept_len,
+		                         0, NULL, NULL, stats);
+	}
+
+	unsigned long next_match_cur = range_start;
+
+	for (unsigned long seg_start = range_start; seg_start < range_end; ) {
+		const unsigned long seg_len = range_end - seg_start > BTPARSE_SEGMENT_SIZE
+		                            ? BTPARSE_SEGMENT_SIZE : range_end - seg_start;
+		const unsigned long seg_end = seg_start + seg_len;
+
+		// Initialize to all literals with infinite cost, including
+		// the lookahead that matches may extend into
+		for (unsigned long i = 0; i < BTPARSE_SEGMENT_ARRAY; ++i) {
+			step[i].cost = UINT32_MAX;
+			step[i].token = crush_token(0, 1);
+		}
+
+		step[0].cost = 0;
+
+		// A long match skipped from the previous segment is not in
+		// this segment's parse, so check matches again from the start
+		if (next_match_cur > seg_start) {
+			next_match_cur = seg_start;
+		}
+
+		// Phase 1: Find lowest cost path arriving at each position
+		for (unsigned long cur = seg_start; cur < seg_end; ++cur) {
+			const unsigned long r = cur - seg_start;
+
+			// Check literal
+			if (step[r + 1].cost > step[r].cost + lit_cost) {
+				step[r + 1].cost = step[r].cost + lit_cost;
+				step[r + 1].token = crush_token(0, 1);
 			}
-			else if (l < E) {
-				lbw_putbits(&lbw, 1UL << 4, 5);
-				lbw_putbits(&lbw, l - D, E_BITS);
+
+			if (cur > last_match_pos) {
+				continue;
 			}
-			else {
-				lbw_putbits(&lbw, 0, 5);
-				lbw_putbits(&lbw, l - E, F_BITS);
+
+			if (cur > next_match_cur) {
+				next_match_cur = cur;
 			}
 
-			if (offs >= (2UL << (W_BITS - NUM_SLOTS))) {
-				unsigned long mlog = crush_log2(offs);
+			const unsigned long num_matches =
+				crush_btparse_win_insert(in, cur, src_end, nodes, lookup, base,
+				                         hash_bits, max_dist, &depth, accept_len,
+				                         cur == next_match_cur,
+				                         match_len, match_offs, stats);
+
+			unsigned long max_len = MIN_MATCH - 1;
+			const unsigned long cost_here = step[r].cost;
+
+			for (unsigned long j = 0; j < num_matches; ++j) {
+				const unsigned long offs_cost = crush_offs_cost(match_offs[j])
+				                              + crush_token_cost(token_weight);
+
+				for (unsigned long i = max_len + 1; i <= match_len[j]; ++i) {
+					unsigned long match_cost = offs_cost + crush_len_cost(i);
 
-				lbw_putbits(&lbw, mlog - (W_BITS - NUM_SLOTS), SLOT_BITS);
-				lbw_putbits(&lbw, offs - (1UL << mlog), mlog);
+					assert(match_cost < UINT32_MAX - cost_here);
+
+					unsigned long cost_there = cost_here + match_cost;
+
+					if (cost_there < step[r + i].cost) {
+						step[r + i].cost = cost_there;
+						step[r + i].token = crush_token(match_offs[j], i);
+					}
+				}
+
+				max_len = match_len[j];
 			}
-			else {
-				lbw_putbits(&lbw, 0, SLOT_BITS);
-				lbw_putbits(&lbw, offs, W_BITS - (NUM_SLOTS - 1));
+
+			if (max_len >= accept_len) {
+				next_match_cur = cur + max_len;
 			}
 		}
+
+		start = crush_stats_find_time(stats, start);
+
+		// Phase 2: Follow lowest cost path backwards from end of
+		// segment gathering tokens
+		unsigned long next_token = seg_len;
+
+		for (unsigned long r = seg_len; r > 0; --next_token) {
+			const uint32_t token = step[r].token;
+
+			step[next_token].token = token;
+			r -= crush_token_len(token);
+		}
+
+		// Phase 3: Output tokens
+		unsigned long cur = seg_start;
+		for (unsigned long i = next_token + 1; i <= seg_len; ++i) {
+			crush_put_token(lbw, step[i].token, &in[cur]);
+			cur += crush_token_len(step[i].token);
+		}
+
+		start = crush_stats_output_time(stats, start);
+
+		seg_start = seg_end;
+	}
+}
+
+// Windowed variant of crush_pack_btparse with memory use independent of
+// src_size.
+//
+// The tree nodes are kept in a ring buffer covering the window, and the
+// parse is done in segments of BTPARSE_SEGMENT_SIZE positions. Each segment
+// is parsed to the lowest cost path reaching its end and output before
+// the next is started, so a match crossing the end of a segment is not
+// found. Matches may still extend into the lookahead past the end.
+//
+static unsigned long
+crush_pack_btparse_win(const void *src, unsigned long hist_size, void *dst,
+                       unsigned long src_size, void *workmem, uint32_t base,
+                       const int hash_bits, const unsigned long window,
+                       const unsigned long max_depth,
+                       const unsigned long accept_len,
+                       const unsigned long node_budget,
+                       const int token_weight, struct crush_stats *stats)
+{
+	struct lsb_bitwriter lbw;
+	const unsigned char *const in = (const unsigned char *) src;
+	const unsigned long src_end = hist_size + src_size;
+
+	// Check for empty input
+	if (src_size == 0) {
+		return 0;
 	}
 
+	lbw_init(&lbw, (unsigned char *) dst);
+
+	if (src_size < 4) {
+		for (unsigned long i = hist_size; i < src_end; ++i) {
+			crush_put_literal(&lbw, in[i]);
+		}
+
+		return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
+	}
+
+	crush_btparse_win_range(in, 0, hist_size, src_end, src_end, &lbw,
+	                        workmem, base, hash_bits, window,
+	                        max_depth, accept_len, node_budget, token_weight,
+	                        stats);
+
 	// Return compressed size
 	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
 }
 
+// Number of ranges the threaded windowed parse splits src_size bytes into.
+static unsigned long
+crush_btparse_mt_num_ranges(size_t src_size, int num_threads)
+{
+	const size_t num_segs = (src_size + BTPARSE_SEGMENT_SIZE - 1) / BTPARSE_SEGMENT_SIZE;
+
+	return num_segs < (size_t) num_threads ? (unsigned long) num_segs
+	                                       : (unsigned long) num_threads;
+}
+
+// Size of the output buffer for each range after the first.
+static size_t
+crush_btparse_mt_out_size(size_t src_size, unsigned long num_ranges)
+{
+	const size_t num_segs = (src_size + BTPARSE_SEGMENT_SIZE - 1) / BTPARSE_SEGMENT_SIZE;
+	const size_t range_segs = (num_segs + num_ranges - 1) / num_ranges;
+
+	return crush_max_packed_size(range_segs * BTPARSE_SEGMENT_SIZE);
+}
+
+static size_t
+crush_btparse_mt_workmem_size(size_t src_size, int hash_bits, int num_threads)
+{
+	const unsigned long num_ranges = crush_btparse_mt_num_ranges(src_size, num_threads);
+
+	if (num_ranges < 2) {
+		return crush_btparse_win_workmem_size(src_size, hash_bits);
+	}
+
+	return num_ranges * crush_btparse_win_workmem_size(src_size, hash_bits)
+	     + (num_ranges - 1) * crush_btparse_mt_out_size(src_size, num_ranges);
+}
+
+// State for parsing one range of the threaded windowed parse.
+struct crush_btparse_job {
+	struct lsb_bitwriter lbw;
+	unsigned char *out;
+	const unsigned char *in;
+	unsigned long range_start;
+	unsigned long range_end;
+	unsigned long src_end;
+	void *workmem;
+	uint32_t base;
+	int hash_bits;
+	unsigned long window;
+	unsigned long max_depth;
+	unsigned long accept_len;
+	unsigned long node_budget;
+	int token_weight;
+	struct crush_stats *stats;
+	int started;
+#if !defined(CRUSH_NO_THREADS)
+	struct crush_thread thread;
+#endif
+};
+
+static void
+crush_btparse_job_run(void *arg)
+{
+	struct crush_btparse_job *job = (struct crush_btparse_job *) arg;
+	const unsigned long max_dist = job->window < W_SIZE ? job->window : W_SIZE - 1;
+
+	// Only the positions within the window of the range can be matched
+	const unsigned long tree_start = job->range_start > max_dist
+	                               ? job->range_start - max_dist : 0;
+
+	crush_btparse_win_range(job->in, tree_start, job->range_start,
+	                        job->range_end, job->src_end, &job->lbw,
+	                        job->workmem, job->base, job->hash_bits,
+	                        job->window, job->max_depth, job->accept_len,
+	                        job->node_budget, job->token_weight, job->stats);
+}
+
+// Threaded variant of crush_pack_btparse_win.
+//
+// The segments are split into up to num_threads contiguous ranges, which
+// are parsed at the same time, each with its own trees built from the
+// window before the range. The first range is output directly to dst, and
+// the rest to buffers in workmem which are appended in order afterwards.
+//
+// The trees only hold positions within the window, so the matches found
+// do not depend on where the insertion started, and the output is the same
+// as that of crush_pack_btparse_win when all positions are searched. With
+// a node_budget, each range adapts the depth from its own start, so the
+// output depends on num_threads.
+//
+// If stats is not NULL, each range counts its searches separately, and they
+// are added to stats when it is done. The time of the ranges is measured
+// around all of them, and counted as find_time.
+//
+static unsigned long
+crush_pack_btparse_mt(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem, uint32_t base,
+                      const int hash_bits, const unsigned long window,
+                      const unsigned long max_depth,
+                      const unsigned long accept_len,
+                      const unsigned long node_budget,
+                      const int token_weight, int num_threads,
+                      struct crush_stats *stats)
+{
+	struct crush_btparse_job jobs[CRUSH_MAX_THREADS];
+	struct crush_stats job_stats[CRUSH_MAX_THREADS];
+	const unsigned char *const in = (const unsigned char *) src;
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long num_ranges = crush_btparse_mt_num_ranges(src_size, num_threads);
+
+	if (src_size < 4 || num_ranges < 2) {
+		return crush_pack_btparse_win(src, hist_size, dst, src_size,
+		                              workmem, base, hash_bits, window,
+		                              max_depth, accept_len, node_budget,
+		                              token_weight, stats);
+	}
+
+	clock_t start = crush_stats_clock(stats);
+
+	const size_t num_segs = (src_size + BTPARSE_SEGMENT_SIZE - 1) / BTPARSE_SEGMENT_SIZE;
+	const size_t win_size = crush_btparse_win_workmem_size(src_size, hash_bits);
+	const size_t out_size = crush_btparse_mt_out_size(src_size, num_ranges);
+	unsigned char *next_out = (unsigned char *) workmem + num_ranges * win_size;
+
+	for (unsigned long i = 0; i < num_ranges; ++i) {
+		struct crush_btparse_job *job = &jobs[i];
+
+		job->in = in;
+		job->range_start = hist_size + (unsigned long) (i * num_segs / num_ranges) * BTPARSE_SEGMENT_SIZE;
+		job->range_end = i + 1 < num_ranges
+		               ? hist_size + (unsigned long) ((i + 1) * num_segs / num_ranges) * BTPARSE_SEGMENT_SIZE
+		               : src_end;
+		job->src_end = src_end;
+		job->workmem = (unsigned char *) workmem + i * win_size;
+		job->hash_bits = hash_bits;
+		job->window = window;
+		job->max_depth = max_depth;
+		job->accept_len = accept_len;
+		job->node_budget = node_budget;
+		job->token_weight = token_weight;
+		job->stats = NULL;
+
+		if (stats != NULL) {
+			memset(&job_stats[i], 0, sizeof(job_stats[i]));
+			job->stats = &job_stats[i];
+		}
+
+		// Only the first lookup is kept between calls
+		if (i == 0) {
+			job->base = base;
+			job->out = (unsigned char *) dst;
+		}
+		else {
+			job->base = 0;
+			job->out = next_out;
+			next_out += out_size;
+		}
+
+		lbw_init(&job->lbw, job->out);
+	}
+
+	// Parse the first range on this thread, and the rest on new threads.
+	// A range that no thread could be created for is parsed here after.
+	for (unsigned long i = 1; i < num_ranges; ++i) {
+#if defined(CRUSH_NO_THREADS)
+		jobs[i].started = 0;
+#else
+		jobs[i].started = crush_thread_create(&jobs[i].thread, crush_btparse_job_run,
+		                                      &jobs[i]) == 0;
+#endif
+	}
+
+	crush_btparse_job_run(&jobs[0]);
+
+	struct lsb_bitwriter *lbw = &jobs[0].lbw;
+
+	// Wait for all ranges before appending, so the appending is not
+	// counted in find_time
+	for (unsigned long i = 1; i < num_ranges; ++i) {
+		struct crush_btparse_job *job = &jobs[i];
+
+		if (job->started) {
+#if !defined(CRUSH_NO_THREADS)
+			crush_thread_join(&job->thread);
+#endif
+		}
+		else {
+			crush_btparse_job_run(job);
+		}
+	}
+
+	for (unsigned long i = 0; i < num_ranges && stats != NULL; ++i) {
+		stats->num_searches += job_stats[i].num_searches;
+		stats->num_nodes += job_stats[i].num_nodes;
+		stats->num_depth_limited += job_stats[i].num_depth_limited;
+	}
+
+	start = crush_stats_find_time(stats, start);
+
+	for (unsigned long i = 1; i < num_ranges; ++i) {
+		struct crush_btparse_job *job = &jobs[i];
+
+		// Append output of range, which is not byte aligned in general
+		const unsigned long num_bits = 8 * (unsigned long) (job->lbw.next_out - job->out)
+		                             + (unsigned long) job->lbw.msb;
+
+		lbw_finalize(&job->lbw);
+		lbw_putbuf(lbw, job->out, num_bits);
+	}
+
+	crush_stats_output_time(stats, start);
+
+	return (unsigned long) (lbw_finalize(lbw) - (unsigned char *) dst);
+}
+
 #endif /* CRUSH_BTPARSE_H_INCLUDED */
@@ -0,0 +1,258 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Compression context
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+crush_ctx_init(struct crush_ctx *ctx, int level, unsigned long max_size)
+{
+	return crush_ctx_init_alloc(ctx, level, max_size, NULL);
+}
+
+int
+crush_ctx_init_alloc(struct crush_ctx *ctx, int level, unsigned long max_size,
+                     const struct crush_allocator *allocator)
+{
+	size_t workmem_size;
+
+	crush_allocator_init(&ctx->allocator, allocator);
+
+	ctx->workmem = NULL;
+	ctx->buf = NULL;
+	ctx->dict = NULL;
+	ctx->workmem_size = 0;
+	ctx->max_size = max_size;
+	ctx->base = 0;
+	ctx->level = level;
+
+	// Tags for lookup entries are 32 bits
+	if (max_size > 0xFFFFFFFFUL - 1) {
+		return -1;
+	}
+
+	workmem_size = crush_workmem_size_level(max_size, level);
+
+	if (workmem_size == (size_t) -1) {
+		return -1;
+	}
+
+	ctx->workmem_size = workmem_size > 0 ? workmem_size : 1;
+	ctx->workmem = ctx->allocator.alloc(ctx->allocator.opaque, ctx->workmem_size);
+
+	return ctx->workmem != NULL ? 0 : -1;
+}
+
+unsigned long
+crush_ctx_pack(struct crush_ctx *ctx, const void *src, void *dst,
+               unsigned long src_size)
+{
+	uint32_t base = (uint32_t) ctx->base;
+	unsigned long res;
+
+	if (ctx->workmem == NULL || src_size > ctx->max_size) {
+		return CRUSH_ERROR;
+	}
+
+	if (ctx->dict != NULL) {
+		const struct crush_dict *dict = ctx->dict;
+
+		// The dictionary was copied to the start of buf by init
+		if (src_size > 0) {
+			memcpy(ctx->buf + dict->size, src, src_size);
+		}
+
+		res = crush_pack_level_dict(ctx->buf, dict->size, dst, src_size,
+		                            ctx->workmem, ctx->level, &base,
+		                            (const uint32_t *) dict->lookup,
+		                            dict->lookup_end);
+	}
+	else {
+		res = crush_pack_level_tag(src, 0, dst, src_size, ctx->workmem,
+		                           ctx->level, &base);
+	}
+
+	ctx->base = base;
+
+	return res;
+}
+
+void
+crush_ctx_end(struct crush_ctx *ctx)
+{
+	if (ctx->workmem != NULL) {
+		ctx->allocator.free(ctx->allocator.opaque, ctx->workmem,
+		                    ctx->workmem_size);
+	}
+
+	if (ctx->buf != NULL) {
+		const unsigned long dict_size = ctx->dict != NULL ? ctx->dict->size : 0;
+
+		ctx->allocator.free(ctx->allocator.opaque, ctx->buf,
+		                    dict_size + ctx->max_size > 0 ? dict_size + ctx->max_size : 1);
+	}
+
+	ctx->workmem = NULL;
+	ctx->buf = NULL;
+	ctx->dict = NULL;
+	ctx->base = 0;
+}
+
+int
+crush_dict_init(struct crush_dict *dict, const void *data,
+                unsigned long size, int level)
+{
+	return crush_dict_init_alloc(dict, data, size, level, NULL);
+}
+
+int
+crush_dict_init_alloc(struct crush_dict *dict, const void *data,
+                      unsigned long size, int level,
+                      const struct crush_allocator *allocator)
+{
+	size_t lookup_size;
+
+	crush_allocator_init(&dict->allocator, allocator);
+
+	dict->data = NULL;
+	dict->lookup = NULL;
+	dict->lookup_end = 0;
+	dict->level = level;
+
+	if (crush_workmem_size_level(0, level) == (size_t) -1) {
+		return -1;
+	}
+
+	// Matches cannot reach further back than the window
+	if (size > W_SIZE) {
+		data = (const unsigned char *) data + (size - W_SIZE);
+		size = W_SIZE;
+	}
+
+	dict->size = size;
+	dict->data = (unsigned char *) dict->allocator.alloc(dict->allocator.opaque,
+	                                                     size > 0 ? size : 1);
+
+	if (dict->data == NULL) {
+		return -1;
+	}
+
+	if (size > 0) {
+		memcpy(dict->data, data, size);
+	}
+
+	lookup_size = crush_dict_lookup_size(level);
+
+	if (lookup_size > 0) {
+		dict->lookup = dict->allocator.alloc(dict->allocator.opaque,
+		                                     lookup_size);
+
+		if (dict->lookup == NULL) {
+			crush_dict_end(dict);
+			return -1;
+		}
+
+		dict->lookup_end = crush_dict_lookup_init((uint32_t *) dict->lookup,
+		                                          dict->data, size, level);
+	}
+
+	return 0;
+}
+
+void
+crush_dict_end(struct crush_dict *dict)
+{
+	if (dict->data != NULL) {
+		dict->allocator.free(dict->allocator.opaque, dict->data,
+		                     dict->size > 0 ? dict->size : 1);
+	}
+
+	if (dict->lookup != NULL) {
+		dict->allocator.free(dict->allocator.opaque, dict->lookup,
+		                     crush_dict_lookup_size(dict->level));
+	}
+
+	dict->data = NULL;
+	dict->lookup = NULL;
+	dict->size = 0;
+	dict->lookup_end = 0;
+}
+
+int
+crush_ctx_init_dict(struct crush_ctx *ctx, const struct crush_dict *dict,
+                    unsigned long max_size)
+{
+	return crush_ctx_init_dict_alloc(ctx, dict, max_size, NULL);
+}
+
+int
+crush_ctx_init_dict_alloc(struct crush_ctx *ctx, const struct crush_dict *dict,
+                          unsigned long max_size,
+                          const struct crush_allocator *allocator)
+{
+	size_t workmem_size;
+
+	crush_allocator_init(&ctx->allocator, allocator);
+
+	ctx->workmem = NULL;
+	ctx->buf = NULL;
+	ctx->dict = dict;
+	ctx->workmem_size = 0;
+	ctx->max_size = max_size;
+	ctx->base = 0;
+	ctx->level = dict->level;
+
+	// Tags for lookup entries are 32 bits
+	if (dict->data == NULL || max_size > 0xFFFFFFFFUL - 1 - dict->size) {
+		return -1;
+	}
+
+	workmem_size = crush_workmem_size_level(dict->size + max_size, dict->level);
+
+	if (workmem_size == (size_t) -1) {
+		return -1;
+	}
+
+	ctx->workmem_size = workmem_size > 0 ? workmem_size : 1;
+	ctx->workmem = ctx->allocator.alloc(ctx->allocator.opaque, ctx->workmem_size);
+	ctx->buf = (unsigned char *) ctx->allocator.alloc(ctx->allocator.opaque,
+	                                                  dict->size + max_size > 0 ? dict->size + max_size : 1);
+
+	if (ctx->workmem == NULL || ctx->buf == NULL) {
+		crush_ctx_end(ctx);
+		return -1;
+	}
+
+	if (dict->size > 0) {
+		memcpy(ctx->buf, dict->data, dict->size);
+	}
+
+	return 0;
+}
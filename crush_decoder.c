@@ -0,0 +1,366 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Incremental decompression
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#include <string.h>
+
+// Size of buffer for history and decoded data.
+//
+// Matches reach back at most W_SIZE bytes, so once the decoded data has been
+// returned, everything before the last W_SIZE bytes can be dropped. With
+// twice that, sliding the buffer copies about one byte per byte decoded.
+#define BUF_SIZE (2 * W_SIZE)
+
+// Room left in buf at which to slide it.
+#define SLIDE_ROOM (W_SIZE / 16)
+
+#define STATUS_ERROR (-1)
+#define STATUS_OK 0
+
+static const unsigned char len_bits[6] = {
+	A_BITS, B_BITS, C_BITS, D_BITS, E_BITS, F_BITS
+};
+
+static const unsigned short len_base[6] = {
+	0, A, B, C, D, E
+};
+
+// Decode one token from the bits in tag.
+//
+// Returns 0 if tag does not hold all of the token, otherwise removes it from
+// tag, and stores the length in len and the offset in offs, or 0 in len and
+// the byte in offs for a literal. The longest token is 39 bits.
+static int
+cd_token(uint64_t *tag, int *msb, unsigned long *len, unsigned long *offs)
+{
+	uint64_t t = *tag;
+	int m = *msb;
+	unsigned long mlog;
+	int num;
+	int i;
+
+	if (m < 9) {
+		return 0;
+	}
+
+	if ((t & 1) == 0) {
+		*len = 0;
+		*offs = (unsigned long) (t >> 1) & 0xFF;
+		*tag = t >> 9;
+		*msb = m - 9;
+		return 1;
+	}
+
+	t >>= 1;
+	m -= 1;
+
+	/* Decode unary length prefix */
+	for (i = 0; i < 5; ++i) {
+		if (m < 1) {
+			return 0;
+		}
+
+		m -= 1;
+
+		if ((t & 1) != 0) {
+			t >>= 1;
+			break;
+		}
+
+		t >>= 1;
+	}
+
+	if (m < len_bits[i] + SLOT_BITS) {
+		return 0;
+	}
+
+	*len = ((unsigned long) t & ((1UL << len_bits[i]) - 1)) + len_base[i];
+	t >>= len_bits[i];
+	m -= len_bits[i];
+
+	/* Decode match offset */
+	mlog = ((unsigned long) t & (NUM_SLOTS - 1)) + (W_BITS - NUM_SLOTS);
+	t >>= SLOT_BITS;
+	m -= SLOT_BITS;
+
+	num = (int) (mlog > (W_BITS - NUM_SLOTS) ? mlog : W_BITS - (NUM_SLOTS - 1));
+
+	if (m < num) {
+		return 0;
+	}
+
+	*offs = ((unsigned long) t & ((1UL << num) - 1)) + 1;
+
+	if (mlog > (W_BITS - NUM_SLOTS)) {
+		*offs += 1UL << mlog;
+	}
+
+	*len += MIN_MATCH;
+	*tag = t >> num;
+	*msb = m - num;
+
+	return 1;
+}
+
+// Decode tokens of the current block into buf from the bits in tag and the
+// input at *src, until the block ends, the input runs out, or buf is full.
+//
+// Returns 0, or -1 on corrupt data.
+static int
+cd_decode(struct crush_decoder *cd, const unsigned char **src,
+          const unsigned char *src_end)
+{
+	const unsigned char *p = *src;
+	uint64_t tag = cd->tag;
+	int msb = cd->msb;
+	unsigned long pos = cd->pos;
+	unsigned long block_end = pos + cd->block_left;
+
+	if (block_end > BUF_SIZE) {
+		block_end = BUF_SIZE;
+	}
+
+	/* Decode fast while there is plenty of input and room */
+	for (;;) {
+		struct crush_bitreader lbr;
+		unsigned long res;
+
+		if (src_end - p < 64) {
+			break;
+		}
+
+		lbr.src = p;
+		lbr.tag = tag;
+		lbr.msb = msb;
+
+		res = crush_depack_fast(&lbr, src_end, cd->buf, pos, block_end);
+
+		if (res == CRUSH_ERROR) {
+			return -1;
+		}
+
+		p = lbr.src;
+		msb = lbr.msb;
+
+		// Clear bits the refill left above msb, since the refill below
+		// and the header read expect them to be zero
+		tag = lbr.tag & ((UINT64_C(1) << msb) - 1);
+
+		if (res == pos) {
+			break;
+		}
+
+		pos = res;
+	}
+
+	/* Decode one token at a time while all of it has arrived */
+	while (pos < block_end && BUF_SIZE - pos >= MAX_MATCH) {
+		unsigned long len;
+		unsigned long offs;
+
+		while (msb <= 56 && p < src_end) {
+			tag |= (uint64_t) *p++ << msb;
+			msb += 8;
+		}
+
+		if (!cd_token(&tag, &msb, &len, &offs)) {
+			break;
+		}
+
+		if (len == 0) {
+			cd->buf[pos++] = (unsigned char) offs;
+		}
+		else {
+			unsigned char *out = cd->buf + pos;
+			const unsigned char *from = out - offs;
+
+			if (offs > pos || len > cd->block_left - (pos - cd->pos)) {
+				return -1;
+			}
+
+			pos += len;
+
+			while (len-- != 0) {
+				*out++ = *from++;
+			}
+		}
+	}
+
+	cd->block_left -= pos - cd->pos;
+	cd->pos = pos;
+	cd->tag = tag;
+	cd->msb = msb;
+	*src = p;
+
+	return 0;
+}
+
+int
+crush_decoder_init(struct crush_decoder *cd)
+{
+	return crush_decoder_init_alloc(cd, NULL);
+}
+
+int
+crush_decoder_init_alloc(struct crush_decoder *cd,
+                         const struct crush_allocator *allocator)
+{
+	crush_allocator_init(&cd->allocator, allocator);
+
+	cd->tag = 0;
+	cd->msb = 0;
+	cd->pos = 0;
+	cd->out_pos = 0;
+	cd->block_left = 0;
+	cd->header = 0;
+	cd->header_size = 0;
+	cd->status = STATUS_OK;
+
+	cd->buf = (unsigned char *) cd->allocator.alloc(cd->allocator.opaque,
+	                                                BUF_SIZE);
+
+	if (cd->buf == NULL) {
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned long
+crush_decoder_update(struct crush_decoder *cd, const void *src,
+                     unsigned long src_size, void *dst,
+                     unsigned long dst_capacity, unsigned long *dst_size)
+{
+	const unsigned char *p = (const unsigned char *) src;
+	const unsigned char *src_end = p + src_size;
+	unsigned char *out = (unsigned char *) dst;
+	unsigned long produced = 0;
+
+	*dst_size = 0;
+
+	if (cd->status == STATUS_ERROR) {
+		return CRUSH_ERROR;
+	}
+
+	for (;;) {
+		unsigned long pos = cd->pos;
+		const unsigned char *start = p;
+		unsigned long len = cd->pos - cd->out_pos;
+
+		/* Return decoded data */
+		if (len > dst_capacity - produced) {
+			len = dst_capacity - produced;
+		}
+
+		if (len > 0) {
+			memcpy(out + produced, cd->buf + cd->out_pos, len);
+			cd->out_pos += len;
+			produced += len;
+		}
+
+		if (produced == dst_capacity) {
+			break;
+		}
+
+		/* Read block header, first from bytes already in tag */
+		if (cd->block_left == 0) {
+			while (cd->header_size < 4 && cd->msb >= 8) {
+				cd->header |= ((unsigned long) cd->tag & 0xFF) << (8 * cd->header_size);
+				cd->tag >>= 8;
+				cd->msb -= 8;
+				cd->header_size++;
+			}
+
+			while (cd->header_size < 4 && p < src_end) {
+				cd->header |= (unsigned long) *p++ << (8 * cd->header_size);
+				cd->header_size++;
+			}
+
+			if (cd->header_size < 4) {
+				break;
+			}
+
+			cd->block_left = cd->header;
+			cd->header = 0;
+			cd->header_size = 0;
+
+			if (cd->block_left == 0) {
+				continue;
+			}
+		}
+
+		/* Slide history to the start of buf once decoded data is returned */
+		if (BUF_SIZE - cd->pos < SLIDE_ROOM && cd->out_pos == cd->pos) {
+			memmove(cd->buf, cd->buf + cd->pos - W_SIZE, W_SIZE);
+			cd->pos = W_SIZE;
+			cd->out_pos = W_SIZE;
+			pos = W_SIZE;
+		}
+
+		if (cd_decode(cd, &p, src_end) != 0) {
+			cd->status = STATUS_ERROR;
+			return CRUSH_ERROR;
+		}
+
+		// Skip padding bits to the byte boundary after a block
+		if (cd->block_left == 0) {
+			cd->tag >>= cd->msb & 7;
+			cd->msb &= ~7;
+			continue;
+		}
+
+		// Stop when the rest of a token is needed
+		if (cd->pos == pos && p == start) {
+			break;
+		}
+	}
+
+	*dst_size = produced;
+
+	return (unsigned long) (p - (const unsigned char *) src);
+}
+
+int
+crush_decoder_done(const struct crush_decoder *cd)
+{
+	return cd->status == STATUS_OK && cd->block_left == 0
+	    && cd->header_size == 0 && cd->msb == 0 && cd->out_pos == cd->pos;
+}
+
+void
+crush_decoder_end(struct crush_decoder *cd)
+{
+	if (cd->buf != NULL) {
+		cd->allocator.free(cd->allocator.opaque, cd->buf, BUF_SIZE);
+	}
+
+	cd->buf = NULL;
+	cd->pos = 0;
+	cd->out_pos = 0;
+}
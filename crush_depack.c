@@ -29,16 +29,72 @@
 #include "crush_internal.h"
 
 #include <assert.h>
-#include <stdint.h>
+#include <string.h>
 
-struct lsb_bitreader {
-	const unsigned char *src;
-	uint32_t tag;
-	int msb;
+// Length decoding table entry.
+//
+// Indexed by the 7 bits following the match flag. For lengths in A to D,
+// the unary prefix and length bits fit in 7 bits, so the entry gives the
+// final length. For E and F, it gives the prefix length, and the number of
+// length bits that follow.
+struct len_entry {
+	unsigned char num_bits;
+	unsigned char extra_bits;
+	unsigned short base;
 };
 
+#define LEN_TABLE_BITS 7
+
+static const struct len_entry len_table[1U << LEN_TABLE_BITS] = {
+	{ 5, 9, 52 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0,  8 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 12 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0,  9 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 5, 20 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0, 10 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 13 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0, 11 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 9, 52 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0,  8 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 14 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0,  9 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 5, 20 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0, 10 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 15 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0, 11 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 9, 52 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0,  8 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 16 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0,  9 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 5, 20 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0, 10 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 17 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0, 11 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 9, 52 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0,  8 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 18 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0,  9 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+	{ 5, 5, 20 }, { 3, 0,  0 }, { 4, 0,  4 }, { 3, 0,  1 },
+	{ 5, 0, 10 }, { 3, 0,  2 }, { 4, 0,  5 }, { 3, 0,  3 },
+	{ 7, 0, 19 }, { 3, 0,  0 }, { 4, 0,  6 }, { 3, 0,  1 },
+	{ 5, 0, 11 }, { 3, 0,  2 }, { 4, 0,  7 }, { 3, 0,  3 },
+};
+
+static uint64_t
+read_le64(const unsigned char *p)
+{
+	return ((uint64_t) p[0])
+	     | ((uint64_t) p[1] << 8)
+	     | ((uint64_t) p[2] << 16)
+	     | ((uint64_t) p[3] << 24)
+	     | ((uint64_t) p[4] << 32)
+	     | ((uint64_t) p[5] << 40)
+	     | ((uint64_t) p[6] << 48)
+	     | ((uint64_t) p[7] << 56);
+}
+
 static void
-lbr_init(struct lsb_bitreader *lbr, const unsigned char *src)
+lbr_init(struct crush_bitreader *lbr, const unsigned char *src)
 {
 	lbr->src = src;
 	lbr->tag = 0;
@@ -46,26 +102,58 @@ lbr_init(struct lsb_bitreader *lbr, const unsigned char *src)
 }
 
 static void
-lbr_refill(struct lsb_bitreader *lbr, int num)
+lbr_refill(struct crush_bitreader *lbr, int num)
 {
 	assert(num >= 0 && num <= 32);
 
 	// Read bytes until at least num bits available
 	while (lbr->msb < num) {
-		lbr->tag |= (uint32_t) *lbr->src++ << lbr->msb;
+		lbr->tag |= (uint64_t) *lbr->src++ << lbr->msb;
 		lbr->msb += 8;
 	}
 
-	assert(lbr->msb <= 32);
+	assert(lbr->msb <= 64);
+}
+
+// Refill to at least 56 bits without branches.
+//
+// This reads 8 bytes at src, so the caller must ensure they are available.
+// The bits above msb come from bytes that are read again by the next
+// refill, so or'ing them in twice is harmless.
+static void
+lbr_refill_fast(struct crush_bitreader *lbr)
+{
+	assert(lbr->msb >= 0 && lbr->msb < 64);
+
+	lbr->tag |= read_le64(lbr->src) << lbr->msb;
+	lbr->src += (63 - lbr->msb) >> 3;
+	lbr->msb |= 56;
 }
 
 static uint32_t
-lbr_getbits_no_refill(struct lsb_bitreader *lbr, int num)
+lbr_peekbits(const struct crush_bitreader *lbr, int num)
+{
+	assert(num >= 0 && num <= lbr->msb && num < 32);
+
+	return (uint32_t) lbr->tag & ((1UL << num) - 1);
+}
+
+static void
+lbr_skipbits(struct crush_bitreader *lbr, int num)
+{
+	assert(num >= 0 && num <= lbr->msb);
+
+	lbr->tag >>= num;
+	lbr->msb -= num;
+}
+
+static uint32_t
+lbr_getbits_no_refill(struct crush_bitreader *lbr, int num)
 {
 	assert(num >= 0 && num <= lbr->msb);
 
 	// Get bits from tag
-	uint32_t bits = lbr->tag & ((1ULL << num) - 1);
+	uint32_t bits = (uint32_t) (lbr->tag & ((1ULL << num) - 1));
 
 	// Remove bits from tag
 	lbr->tag >>= num;
@@ -75,56 +163,193 @@ lbr_getbits_no_refill(struct lsb_bitreader *lbr, int num)
 }
 
 static uint32_t
-lbr_getbits(struct lsb_bitreader *lbr, int num)
+lbr_getbits(struct crush_bitreader *lbr, int num)
 {
 	lbr_refill(lbr, num);
 	return lbr_getbits_no_refill(lbr, num);
 }
 
+// Copy len bytes from src to dst, where dst - src = offs.
+//
+// May write up to 15 bytes past dst + len. When offs is at least the chunk
+// size, each chunk reads only bytes that are already written.
+static void
+copy_match(unsigned char *dst, const unsigned char *src, unsigned long len,
+           unsigned long offs)
+{
+	unsigned char *end = dst + len;
+
+	if (offs >= 16) {
+		do {
+			memcpy(dst, src, 16);
+			dst += 16;
+			src += 16;
+		} while (dst < end);
+	}
+	else if (offs >= 8) {
+		do {
+			memcpy(dst, src, 8);
+			dst += 8;
+			src += 8;
+		} while (dst < end);
+	}
+	else {
+		do {
+			*dst++ = *src++;
+		} while (dst < end);
+	}
+}
+
 unsigned long
-crush_depack(const void *src, void *dst, unsigned long depacked_size)
+crush_depack_fast(struct crush_bitreader *state, const unsigned char *src_end,
+                  unsigned char *out, unsigned long dst_size,
+                  unsigned long dst_end)
 {
-	struct lsb_bitreader lbr;
-	unsigned char *out = (unsigned char *) dst;
-	unsigned long dst_size = 0;
+	// Work on a local copy, since stores to out may alias the state
+	struct crush_bitreader lbr_local = *state;
+	struct crush_bitreader *lbr = &lbr_local;
+	const unsigned char *src_limit;
+	unsigned long max_tokens;
+	unsigned long max_bytes;
 
-	lbr_init(&lbr, (const unsigned char *) src);
+	assert(lbr->src <= src_end && dst_size <= dst_end);
 
-	/* Main decompression loop */
-	while (dst_size < depacked_size) {
-		if (lbr_getbits(&lbr, 1)) {
+	// Limit the input read, so that even a corrupt stream of only long
+	// matches cannot write past dst_end. Each token uses at least 9 bits,
+	// and the 8 byte refill plus up to 63 bits in tag may be ahead of them.
+	max_tokens = (dst_end - dst_size) / MAX_MATCH;
+
+	if (max_tokens < 16 || src_end - lbr->src < 16) {
+		return dst_size;
+	}
+
+	max_bytes = (9 * (max_tokens - 1) - 63) / 8 - 2;
+
+	src_limit = src_end - 8;
+
+	if ((unsigned long) (src_limit - lbr->src) > max_bytes) {
+		src_limit = lbr->src + max_bytes;
+	}
+
+	/* One refill covers the longest token of 39 bits */
+	while (lbr->src <= src_limit) {
+		lbr_refill_fast(lbr);
+
+		if (lbr_peekbits(lbr, 1)) {
+			const struct len_entry *e;
 			unsigned long len;
 			unsigned long mlog;
-			unsigned long mpos;
 			unsigned long offs;
 
+			lbr_skipbits(lbr, 1);
+
 			/* Decode match length */
-			if (lbr_getbits(&lbr, 1)) {
-				len = lbr_getbits(&lbr, A_BITS);
-			}
-			else if (lbr_getbits(&lbr, 1)) {
-				len = lbr_getbits(&lbr, B_BITS) + A;
-			}
-			else if (lbr_getbits(&lbr, 1)) {
-				len = lbr_getbits(&lbr, C_BITS) + B;
-			}
-			else if (lbr_getbits(&lbr, 1)) {
-				len = lbr_getbits(&lbr, D_BITS) + C;
-			}
-			else if (lbr_getbits(&lbr, 1)) {
-				len = lbr_getbits(&lbr, E_BITS) + D;
-			}
-			else {
-				len = lbr_getbits(&lbr, F_BITS) + E;
-			}
+			e = &len_table[lbr_peekbits(lbr, LEN_TABLE_BITS)];
+			lbr_skipbits(lbr, e->num_bits);
+			len = e->base + lbr_getbits_no_refill(lbr, e->extra_bits);
 
 			/* Decode match offset */
-			mlog = lbr_getbits(&lbr, SLOT_BITS) + (W_BITS - NUM_SLOTS);
+			mlog = lbr_getbits_no_refill(lbr, SLOT_BITS) + (W_BITS - NUM_SLOTS);
 			offs = mlog > (W_BITS - NUM_SLOTS)
-			     ? lbr_getbits(&lbr, mlog) + (1 << mlog)
-			     : lbr_getbits(&lbr, W_BITS - (NUM_SLOTS - 1));
+			     ? lbr_getbits_no_refill(lbr, mlog) + (1 << mlog)
+			     : lbr_getbits_no_refill(lbr, W_BITS - (NUM_SLOTS - 1));
 
 			if (++offs > dst_size) {
+				*state = lbr_local;
+				return CRUSH_ERROR;
+			}
+
+			/* Copy match */
+			len += MIN_MATCH;
+			copy_match(out + dst_size, out + dst_size - offs, len, offs);
+			dst_size += len;
+		}
+		else {
+			/* Copy literal */
+			out[dst_size++] = (unsigned char) (lbr->tag >> 1);
+			lbr_skipbits(lbr, 9);
+		}
+	}
+
+	*state = lbr_local;
+
+	return dst_size;
+}
+
+// Decode the length and offset of a match after the match flag.
+//
+// Returns the length minus MIN_MATCH, and stores the offset in offs.
+static unsigned long
+lbr_getmatch(struct crush_bitreader *lbr, unsigned long *offs)
+{
+	unsigned long len;
+	unsigned long mlog;
+
+	/* Decode match length */
+	if (lbr_getbits(lbr, 1)) {
+		len = lbr_getbits(lbr, A_BITS);
+	}
+	else if (lbr_getbits(lbr, 1)) {
+		len = lbr_getbits(lbr, B_BITS) + A;
+	}
+	else if (lbr_getbits(lbr, 1)) {
+		len = lbr_getbits(lbr, C_BITS) + B;
+	}
+	else if (lbr_getbits(lbr, 1)) {
+		len = lbr_getbits(lbr, D_BITS) + C;
+	}
+	else if (lbr_getbits(lbr, 1)) {
+		len = lbr_getbits(lbr, E_BITS) + D;
+	}
+	else {
+		len = lbr_getbits(lbr, F_BITS) + E;
+	}
+
+	/* Decode match offset */
+	mlog = lbr_getbits(lbr, SLOT_BITS) + (W_BITS - NUM_SLOTS);
+	*offs = (mlog > (W_BITS - NUM_SLOTS)
+	      ? lbr_getbits(lbr, mlog) + (1 << mlog)
+	      : lbr_getbits(lbr, W_BITS - (NUM_SLOTS - 1))) + 1;
+
+	return len;
+}
+
+// Decompress tokens from lbr to out, from dst_size up to dst_end.
+static unsigned long
+crush_depack_tokens(struct crush_bitreader *lbr, unsigned char *out,
+                    unsigned long dst_size, const unsigned long dst_end)
+{
+	/* Decode fast while the input known to be in the stream lasts */
+	for (;;) {
+		unsigned long known_bits = MIN_PACKED_BITS(dst_end - dst_size);
+		unsigned long res;
+
+		if (known_bits < (unsigned long) lbr->msb + 64) {
+			break;
+		}
+
+		res = crush_depack_fast(lbr, lbr->src + (known_bits - lbr->msb) / 8,
+		                        out, dst_size, dst_end);
+
+		if (res == CRUSH_ERROR) {
+			return CRUSH_ERROR;
+		}
+
+		if (res == dst_size) {
+			break;
+		}
+
+		dst_size = res;
+	}
+
+	/* Tail loop, reads only the bytes it needs */
+	while (dst_size < dst_end) {
+		if (lbr_getbits(lbr, 1)) {
+			unsigned long offs;
+			unsigned long len = lbr_getmatch(lbr, &offs);
+			unsigned long mpos;
+
+			if (offs > dst_size) {
 				return CRUSH_ERROR;
 			}
 
@@ -138,12 +363,185 @@ crush_depack(const void *src, void *dst, unsigned long depacked_size)
 				out[dst_size++] = out[mpos++];
 			}
 		}
+		else {
+			/* Copy literal */
+			out[dst_size++] = lbr_getbits(lbr, 8);
+		}
+	}
+
+	return dst_size;
+}
+
+unsigned long
+crush_depack_hist(const void *src, void *dst, unsigned long depacked_size,
+                  unsigned long hist_size)
+{
+	struct crush_bitreader lbr;
+	unsigned char *out = (unsigned char *) dst - hist_size;
+	unsigned long res;
+
+	lbr_init(&lbr, (const unsigned char *) src);
+
+	res = crush_depack_tokens(&lbr, out, hist_size, hist_size + depacked_size);
+
+	/* Return decompressed size */
+	return res == CRUSH_ERROR ? CRUSH_ERROR : res - hist_size;
+}
+
+unsigned long
+crush_depack_dict(const void *src, void *dst, unsigned long depacked_size,
+                  const void *dict, unsigned long dict_size)
+{
+	struct crush_bitreader lbr;
+	const unsigned char *dict_end = (const unsigned char *) dict + dict_size;
+	unsigned char *out = (unsigned char *) dst;
+	unsigned long dst_size = 0;
+
+	lbr_init(&lbr, (const unsigned char *) src);
+
+	/* Decode carefully while matches may reach into the dictionary */
+	while (dst_size < depacked_size && dst_size < W_SIZE) {
+		if (lbr_getbits(&lbr, 1)) {
+			unsigned long offs;
+			unsigned long len = lbr_getmatch(&lbr, &offs) + MIN_MATCH;
+			unsigned long mpos;
+
+			if (offs > dst_size) {
+				unsigned long dict_len = offs - dst_size;
+
+				if (dict_len > dict_size) {
+					return CRUSH_ERROR;
+				}
+
+				if (dict_len > len) {
+					dict_len = len;
+				}
+
+				/* Copy the part of the match in the dictionary */
+				memcpy(out + dst_size, dict_end - (offs - dst_size), dict_len);
+				dst_size += dict_len;
+				len -= dict_len;
+			}
+
+			mpos = dst_size - offs;
+
+			/* Copy match */
+			while (len-- != 0) {
+				out[dst_size++] = out[mpos++];
+			}
+		}
 		else {
 			/* Copy literal */
 			out[dst_size++] = lbr_getbits(&lbr, 8);
 		}
 	}
 
+	/* Offsets are at most W_SIZE, so the rest is within dst */
+	if (dst_size < depacked_size) {
+		dst_size = crush_depack_tokens(&lbr, out, dst_size, depacked_size);
+	}
+
+	/* Return decompressed size */
+	return dst_size;
+}
+
+unsigned long
+crush_depack(const void *src, void *dst, unsigned long depacked_size)
+{
+	return crush_depack_hist(src, dst, depacked_size, 0);
+}
+
+static uint32_t
+lbr_getbits_checked(struct crush_bitreader *lbr, int num, int *truncated)
+{
+	if (num > lbr->msb) {
+		*truncated = 1;
+		return 0;
+	}
+
+	return lbr_getbits_no_refill(lbr, num);
+}
+
+unsigned long
+crush_depack_safe(const void *src, unsigned long src_size, void *dst,
+                  unsigned long dst_capacity)
+{
+	struct crush_bitreader lbr;
+	const unsigned char *src_end = (const unsigned char *) src + src_size;
+	unsigned char *out = (unsigned char *) dst;
+	unsigned long dst_size = 0;
+
+	lbr_init(&lbr, (const unsigned char *) src);
+
+	/* Decode fast while far from the end of both buffers */
+	for (;;) {
+		unsigned long res = crush_depack_fast(&lbr, src_end, out, dst_size,
+		                                      dst_capacity);
+
+		if (res == CRUSH_ERROR) {
+			return CRUSH_ERROR;
+		}
+
+		if (res == dst_size) {
+			break;
+		}
+
+		dst_size = res;
+	}
+
+	/* Checked loop until fewer bits than a literal remain */
+	while ((unsigned long) (src_end - lbr.src) * 8 + lbr.msb >= 9) {
+		int truncated = 0;
+
+		// Read up to 64 bits, enough for any token if not at the end
+		while (lbr.msb <= 56 && lbr.src < src_end) {
+			lbr.tag |= (uint64_t) *lbr.src++ << lbr.msb;
+			lbr.msb += 8;
+		}
+
+		if (lbr_getbits_checked(&lbr, 1, &truncated)) {
+			const struct len_entry *e;
+			unsigned long len;
+			unsigned long mlog;
+			unsigned long mpos;
+			unsigned long offs;
+
+			/* Decode match length */
+			e = &len_table[lbr.tag & ((1U << LEN_TABLE_BITS) - 1)];
+			lbr_getbits_checked(&lbr, e->num_bits, &truncated);
+			len = e->base + lbr_getbits_checked(&lbr, e->extra_bits, &truncated);
+
+			/* Decode match offset */
+			mlog = lbr_getbits_checked(&lbr, SLOT_BITS, &truncated)
+			     + (W_BITS - NUM_SLOTS);
+			offs = mlog > (W_BITS - NUM_SLOTS)
+			     ? lbr_getbits_checked(&lbr, mlog, &truncated) + (1 << mlog)
+			     : lbr_getbits_checked(&lbr, W_BITS - (NUM_SLOTS - 1), &truncated);
+
+			len += MIN_MATCH;
+
+			if (truncated || ++offs > dst_size
+			 || len > dst_capacity - dst_size) {
+				return CRUSH_ERROR;
+			}
+
+			mpos = dst_size - offs;
+
+			/* Copy match */
+			while (len-- != 0) {
+				out[dst_size++] = out[mpos++];
+			}
+		}
+		else {
+			if (dst_size == dst_capacity) {
+				return CRUSH_ERROR;
+			}
+
+			/* Copy literal */
+			out[dst_size++] = lbr_getbits_no_refill(&lbr, 8);
+		}
+	}
+
 	/* Return decompressed size */
 	return dst_size;
 }
@@ -29,20 +29,27 @@
 #include "crush_internal.h"
 
 #include <assert.h>
-#include <stdint.h>
+#include <string.h>
+
+// Size of buffer for compressed data.
+//
+// The buffer is only filled with bytes that are known to be part of the
+// current block, so nothing has to be pushed back into the file after it.
+#define BUF_SIZE 16384
 
 struct lsb_bitreader {
+	struct crush_bitreader mem;
+	const unsigned char *buf_end;
 	FILE *src;
-	uint32_t tag;
-	int msb;
 };
 
+// The caller sets mem.src and buf_end to the buffer.
 static void
 lbr_init(struct lsb_bitreader *lbr, FILE *src)
 {
+	lbr->mem.tag = 0;
+	lbr->mem.msb = 0;
 	lbr->src = src;
-	lbr->tag = 0;
-	lbr->msb = 0;
 }
 
 static void
@@ -50,26 +57,30 @@ lbr_refill(struct lsb_bitreader *lbr, int num)
 {
 	assert(num >= 0 && num <= 32);
 
-	// Read bytes until at least num bits available
-	while (lbr->msb < num) {
-		lbr->tag |= (uint32_t) getc(lbr->src) << lbr->msb;
-		lbr->msb += 8;
+	// Read bytes until at least num bits available, first from buffer
+	while (lbr->mem.msb < num) {
+		unsigned char c = lbr->mem.src < lbr->buf_end
+		                ? *lbr->mem.src++
+		                : (unsigned char) getc(lbr->src);
+
+		lbr->mem.tag |= (uint64_t) c << lbr->mem.msb;
+		lbr->mem.msb += 8;
 	}
 
-	assert(lbr->msb <= 32);
+	assert(lbr->mem.msb <= 64);
 }
 
 static uint32_t
 lbr_getbits_no_refill(struct lsb_bitreader *lbr, int num)
 {
-	assert(num >= 0 && num <= lbr->msb);
+	assert(num >= 0 && num <= lbr->mem.msb);
 
 	// Get bits from tag
-	uint32_t bits = lbr->tag & ((1ULL << num) - 1);
+	uint32_t bits = (uint32_t) (lbr->mem.tag & ((1ULL << num) - 1));
 
 	// Remove bits from tag
-	lbr->tag >>= num;
-	lbr->msb -= num;
+	lbr->mem.tag >>= num;
+	lbr->mem.msb -= num;
 
 	return bits;
 }
@@ -84,12 +95,60 @@ lbr_getbits(struct lsb_bitreader *lbr, int num)
 unsigned long
 crush_depack_file(FILE *src, void *dst, unsigned long depacked_size)
 {
+	unsigned char buf[BUF_SIZE];
 	struct lsb_bitreader lbr;
 	unsigned char *out = (unsigned char *) dst;
 	unsigned long dst_size = 0;
 
 	lbr_init(&lbr, src);
 
+	// The buffer starts out empty
+	lbr.mem.src = buf;
+	lbr.buf_end = buf;
+
+	/* Read ahead and decode from memory while possible */
+	for (;;) {
+		unsigned long known_bits = MIN_PACKED_BITS(depacked_size - dst_size);
+		unsigned long known;
+		size_t buf_size;
+		unsigned long res;
+
+		if (known_bits < (unsigned long) lbr.mem.msb + 128) {
+			break;
+		}
+
+		// Number of bytes after lbr.mem.src that are part of the block
+		known = (known_bits - lbr.mem.msb) / 8;
+
+		if (known > BUF_SIZE) {
+			known = BUF_SIZE;
+		}
+
+		// Move unused bytes to start of buffer, and read up to known
+		buf_size = lbr.buf_end - lbr.mem.src;
+		memmove(buf, lbr.mem.src, buf_size);
+
+		if (buf_size < known) {
+			buf_size += fread(buf + buf_size, 1, known - buf_size, src);
+		}
+
+		lbr.mem.src = buf;
+		lbr.buf_end = buf + buf_size;
+
+		res = crush_depack_fast(&lbr.mem, lbr.buf_end, out, dst_size,
+		                        depacked_size);
+
+		if (res == CRUSH_ERROR) {
+			return CRUSH_ERROR;
+		}
+
+		if (res == dst_size) {
+			break;
+		}
+
+		dst_size = res;
+	}
+
 	/* Main decompression loop */
 	while (dst_size < depacked_size) {
 		if (lbr_getbits(&lbr, 1)) {
@@ -0,0 +1,143 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Greedy parsing with a single hash probe
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#ifndef CRUSH_GREEDY_H_INCLUDED
+#define CRUSH_GREEDY_H_INCLUDED
+
+static size_t
+crush_greedy_workmem_size(size_t src_size, int hash_bits)
+{
+	(void) src_size;
+
+	return (1UL << hash_bits) * sizeof(uint32_t);
+}
+
+// Insert positions from start up to end into lookup.
+static void
+crush_greedy_insert_range(uint32_t *lookup, const unsigned char *in,
+                          unsigned long start, unsigned long end,
+                          uint32_t base, const int hash_bits)
+{
+	for (unsigned long i = start; i < end; ++i) {
+		lookup[crush_hash4_bits(&in[i], hash_bits)] = i + base;
+	}
+}
+
+// Greedy parsing with a single hash probe.
+//
+// At each position we look up the last position with the same hash of four
+// bytes, and if the bytes match and the match is cheaper than literals, we
+// take it. Only the first position of a match is added to the lookup table,
+// which makes this fast, but the ratio is not great. Literals are written in
+// runs, and crush_skip_step moves faster through data without matches.
+//
+// src points to hist_size bytes of history followed by the src_size bytes to
+// compress. base is the lookup tag base, see crush_lookup_init. The lookup
+// has 2^hash_bits entries, and matches are at most window bytes back. If
+// stats is not NULL, the searches and time are added to it.
+//
+// The first hist_start positions of the history are not inserted. If
+// dict_lookup is not NULL, it holds them with base 1, and is read where
+// lookup has no entry. Since all positions in lookup are later, this finds
+// the same matches as inserting the whole history, without writing to
+// dict_lookup. Otherwise they are already in lookup, tagged with base, see
+// crush_pack_level_stream.
+//
+static unsigned long
+crush_pack_greedy(const void *src, unsigned long hist_size, void *dst,
+                  unsigned long src_size, void *workmem, uint32_t base,
+                  const uint32_t *dict_lookup, unsigned long hist_start,
+                  const int hash_bits, const unsigned long window,
+                  struct crush_stats *stats)
+{
+	struct lsb_bitwriter lbw;
+	const unsigned char *const in = (const unsigned char *) src;
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long last_match_pos = src_end > 3 ? src_end - 3 : 0;
+	uint32_t *const lookup = (uint32_t *) workmem;
+	unsigned long cur = hist_size;
+	unsigned long lit_start = cur;
+	unsigned long misses = 0;
+	const clock_t start = crush_stats_clock(stats);
+
+	// Check for empty input
+	if (src_size == 0) {
+		return 0;
+	}
+
+	lbw_init(&lbw, (unsigned char *) dst);
+
+	// Initialize lookup
+	base = crush_lookup_init(lookup, 1UL << hash_bits, base);
+
+	// Insert history into lookup
+	crush_greedy_insert_range(lookup, in, hist_start,
+	                          hist_size < last_match_pos ? hist_size : last_match_pos,
+	                          base, hash_bits);
+
+	// Main compression loop
+	while (cur < last_match_pos) {
+		const unsigned long hash = crush_hash4_bits(&in[cur], hash_bits);
+		unsigned long pos = crush_lookup_pos(lookup[hash], base);
+
+		if (pos == NO_MATCH_POS && dict_lookup != NULL) {
+			pos = crush_lookup_pos(dict_lookup[hash], 1);
+		}
+
+		lookup[hash] = cur + base;
+
+		crush_stats_search(stats, pos != NO_MATCH_POS && cur - pos <= window, 1);
+
+		if (pos != NO_MATCH_POS && cur - pos <= window) {
+			const unsigned long len_limit = src_end - cur > MAX_MATCH ? MAX_MATCH : src_end - cur;
+			// Find match len
+			const unsigned long len = crush_match_len(&in[pos], &in[cur], 0, len_limit);
+
+			// Output match if it is shorter than literals
+			if (len >= MIN_MATCH && crush_match_cost(cur - pos - 1, len) < 9 * len) {
+				crush_put_literals(&lbw, &in[lit_start], cur - lit_start);
+				crush_put_match(&lbw, cur - pos - 1, len);
+				cur += len;
+				lit_start = cur;
+				misses = 0;
+				continue;
+			}
+		}
+
+		cur += crush_skip_step(misses++);
+	}
+
+	// Output any remaining literals
+	crush_put_literals(&lbw, &in[lit_start], src_end - lit_start);
+
+	crush_stats_find_time(stats, start);
+
+	// Return compressed size
+	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
+}
+
+#endif /* CRUSH_GREEDY_H_INCLUDED */
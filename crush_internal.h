@@ -28,11 +28,13 @@
 #ifndef CRUSH_INTERNAL_H_INCLUDED
 #define CRUSH_INTERNAL_H_INCLUDED
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define W_BITS 21 // Window size (17..23)
+#define W_BITS 21 // Window size (17..22)
 #define W_SIZE (1UL << W_BITS)
 #define W_MASK (W_SIZE - 1)
 #define SLOT_BITS 4
@@ -55,6 +57,109 @@ extern "C" {
 
 #define TOO_FAR (1UL << 16)
 
+// Compress src_size bytes of data, following hist_size bytes of history
+// at src, to dst.
+//
+// Matches may refer back into the history, so the data must be decompressed
+// with the same history in front of it. workmem must be sized for
+// hist_size + src_size bytes.
+//
+CRUSH_LOCAL unsigned long
+crush_pack_level_hist(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem, int level);
+
+// Compress like crush_pack_level_hist, reusing the lookup from a previous
+// call if possible.
+//
+// *base is the tag base for lookup entries, 0 if the lookup contents are
+// unknown, in which case it is cleared. On return, *base is updated to the
+// base to use for the next call with the same workmem and level.
+//
+CRUSH_LOCAL unsigned long
+crush_pack_level_tag(const void *src, unsigned long hist_size, void *dst,
+                     unsigned long src_size, void *workmem, int level,
+                     uint32_t *base);
+
+// Compress like crush_pack_level_tag, for a buffer where the caller moves
+// the last keep bytes of the input to the start before the next call, and
+// uses them as its history.
+//
+// The greedy and lazy parsers then keep the lookup: *base is set so that
+// the entries of the kept bytes read as their new positions, and those that
+// were moved out read as empty, and the next call only inserts the last few
+// positions of its history. The other parsers insert the whole history as
+// usual.
+//
+CRUSH_LOCAL unsigned long
+crush_pack_level_stream(const void *src, unsigned long hist_size, void *dst,
+                        unsigned long src_size, void *workmem, int level,
+                        uint32_t *base, unsigned long keep);
+
+// Size of the dictionary lookup for level, 0 if the parser for level does
+// not use one.
+CRUSH_LOCAL size_t
+crush_dict_lookup_size(int level);
+
+// Insert the positions of dict_size bytes of dictionary at dict into a
+// lookup of crush_dict_lookup_size(level) bytes, tagged with base 1.
+//
+// The hash of the last positions depends on the data following the
+// dictionary, so they are left for each call to insert. Returns the number
+// of positions inserted.
+//
+CRUSH_LOCAL unsigned long
+crush_dict_lookup_init(uint32_t *dict_lookup, const void *dict,
+                       unsigned long dict_size, int level);
+
+// Compress like crush_pack_level_tag, where the first dict_end positions of
+// the history are in dict_lookup from crush_dict_lookup_init.
+//
+// dict_lookup is only read, so it may be shared by calls on several
+// threads. If dict_lookup is NULL, the whole history is inserted.
+//
+CRUSH_LOCAL unsigned long
+crush_pack_level_dict(const void *src, unsigned long hist_size, void *dst,
+                      unsigned long src_size, void *workmem, int level,
+                      uint32_t *base, const uint32_t *dict_lookup,
+                      unsigned long dict_end);
+
+// Copy allocator from src to dst, or the default using malloc and free if
+// src is NULL.
+CRUSH_LOCAL void
+crush_allocator_init(struct crush_allocator *dst,
+                     const struct crush_allocator *src);
+
+// Bit reader for decompressing from memory.
+//
+// Bits are read LSB first from src into tag, which holds msb bits. After
+// reading n bytes from the start, 8 * n is the number of bits used plus msb.
+struct crush_bitreader {
+	const unsigned char *src;
+	uint64_t tag;
+	int msb;
+};
+
+// Smallest number of bits that can decompress to size bytes.
+//
+// Every token is at least 9 bits and gives at most MAX_MATCH bytes. So
+// while size bytes of output remain, this many bits past the bits already
+// used are known to be part of a valid stream, and may be read ahead.
+#define MIN_PACKED_BITS(size) (9 * (((size) + MAX_MATCH - 1) / MAX_MATCH))
+
+// Decompress tokens from lbr to out, starting at dst_size.
+//
+// Refills read 8 bytes at a time, and matches are copied in chunks that may
+// write up to 15 bytes past the match, so this stops while the next token
+// could read past src_end or write past out + dst_end, and leaves the rest
+// to a careful loop. lbr->src must not be past src_end.
+//
+// Returns the new dst_size, or CRUSH_ERROR if a match offset is before out.
+//
+CRUSH_LOCAL unsigned long
+crush_depack_fast(struct crush_bitreader *lbr, const unsigned char *src_end,
+                  unsigned char *out, unsigned long dst_size,
+                  unsigned long dst_end);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
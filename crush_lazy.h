@@ -0,0 +1,248 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Lazy parsing using hash buckets
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#ifndef CRUSH_LAZY_H_INCLUDED
+#define CRUSH_LAZY_H_INCLUDED
+
+static size_t
+crush_lazy_workmem_size(size_t src_size, int hash_bits)
+{
+	(void) src_size;
+
+	return (1UL << hash_bits) * sizeof(uint32_t);
+}
+
+// Number of bits saved by a match compared to literals (may be negative).
+static long
+crush_lazy_gain(unsigned long offs, unsigned long len)
+{
+	return (long) (9 * len) - (long) crush_match_cost(offs, len);
+}
+
+// Insert tagged entry at the front of its bucket, moving older entries down.
+static void
+crush_lazy_insert(uint32_t *bucket, uint32_t entry, const unsigned long max_depth)
+{
+	for (unsigned long i = max_depth; i-- > 1; ) {
+		bucket[i] = bucket[i - 1];
+	}
+
+	bucket[0] = entry;
+}
+
+// Insert positions from start up to end into their buckets.
+static void
+crush_lazy_insert_range(uint32_t *lookup, const unsigned char *in,
+                        unsigned long start, unsigned long end, uint32_t base,
+                        const int bits, const unsigned long max_depth)
+{
+	for (unsigned long i = start; i < end; ++i) {
+		crush_lazy_insert(&lookup[crush_hash3_bits(&in[i], bits) * max_depth],
+		                  i + base, max_depth);
+	}
+}
+
+// Insert cur into its bucket and find the longest match in the bucket.
+//
+// A bucket holds the last max_depth positions with the same hash, ordered
+// from the closest and back, so we prefer closer matches of equal length.
+//
+// If dict_bucket is not NULL, its entries with base 1 follow the entries
+// in bucket, which are all later positions.
+//
+static unsigned long
+crush_lazy_search(const unsigned char *in, unsigned long cur, unsigned long len_left,
+                  uint32_t *bucket, const uint32_t *dict_bucket, uint32_t base,
+                  const unsigned long window,
+                  const unsigned long max_depth, const unsigned long accept_len,
+                  unsigned long *match_offs, struct crush_stats *stats)
+{
+	unsigned long max_len = 0;
+	unsigned long num_nodes = 0;
+	const uint32_t *entries = bucket;
+	uint32_t entries_base = base;
+	unsigned long first = 0;
+
+	const unsigned long len_limit = len_left > MAX_MATCH ? MAX_MATCH : len_left;
+
+	for (unsigned long i = 0; i < max_depth; ++i) {
+		unsigned long pos = crush_lookup_pos(entries[i - first], entries_base);
+
+		// Continue in the dictionary bucket after the last entry of the input
+		if (pos == NO_MATCH_POS && entries == bucket && dict_bucket != NULL) {
+			entries = dict_bucket;
+			entries_base = 1;
+			first = i;
+			pos = crush_lookup_pos(entries[0], entries_base);
+		}
+
+		if (pos == NO_MATCH_POS || cur - pos > window) {
+			break;
+		}
+
+		++num_nodes;
+
+		// If next byte matches, so this has a chance to be a longer match
+		if (max_len < len_limit && in[pos + max_len] == in[cur + max_len]) {
+			// Find match len
+			const unsigned long len = crush_match_len(&in[pos], &in[cur], 0, len_limit);
+
+			if (len > max_len) {
+				max_len = len;
+				*match_offs = cur - pos - 1;
+
+				if (len >= accept_len || len == len_limit) {
+					break;
+				}
+			}
+		}
+	}
+
+	crush_lazy_insert(bucket, cur + base, max_depth);
+
+	crush_stats_search(stats, num_nodes, max_depth);
+
+	return max_len >= MIN_MATCH && crush_lazy_gain(*match_offs, max_len) > 0 ? max_len : 0;
+}
+
+// Lazy parsing using hash buckets.
+//
+// The lookup table is split into buckets of max_depth entries, which must be
+// a power of two. Before taking a match, we check if the next position has a
+// match that saves more bits, in which case we output a literal instead. As
+// in crush_pack_greedy, literals are written in runs and crush_skip_step
+// moves faster through data without matches.
+//
+// Like the greedy parser, this only needs the 2^hash_bits words of lookup as
+// workmem, and src points to hist_size bytes of history followed by the
+// src_size bytes to compress. base is the lookup tag base, see
+// crush_lookup_init. If stats is not NULL, the searches and time are added
+// to it.
+//
+// dict_lookup and hist_start are as for crush_pack_greedy, with the first
+// hist_start positions of the history in buckets of max_depth entries.
+//
+static unsigned long
+crush_pack_lazy(const void *src, unsigned long hist_size, void *dst,
+                unsigned long src_size, void *workmem, uint32_t base,
+                const uint32_t *dict_lookup, unsigned long hist_start,
+                const int hash_bits, const unsigned long window,
+                const unsigned long max_depth, const unsigned long accept_len,
+                struct crush_stats *stats)
+{
+	struct lsb_bitwriter lbw;
+	const unsigned char *const in = (const unsigned char *) src;
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long last_match_pos = src_end > 3 ? src_end - 3 : 0;
+	uint32_t *const lookup = (uint32_t *) workmem;
+	const int bits = hash_bits - crush_log2(max_depth);
+	unsigned long cur = hist_size;
+	unsigned long lit_start = cur;
+	unsigned long misses = 0;
+	const clock_t start = crush_stats_clock(stats);
+
+	assert(max_depth > 0 && (max_depth & (max_depth - 1)) == 0);
+	assert(max_depth < (1UL << hash_bits));
+
+	// Check for empty input
+	if (src_size == 0) {
+		return 0;
+	}
+
+	lbw_init(&lbw, (unsigned char *) dst);
+
+	// Initialize lookup
+	base = crush_lookup_init(lookup, 1UL << hash_bits, base);
+
+	// Insert history into lookup
+	crush_lazy_insert_range(lookup, in, hist_start,
+	                        hist_size < last_match_pos ? hist_size : last_match_pos,
+	                        base, bits, max_depth);
+
+	// Next position to insert into lookup
+	unsigned long next_insert = cur;
+
+	// Main compression loop
+	while (cur < last_match_pos) {
+		const unsigned long hash = crush_hash3_bits(&in[cur], bits) * max_depth;
+		unsigned long offs = 0;
+		unsigned long len = crush_lazy_search(in, cur, src_end - cur, &lookup[hash],
+		                                      dict_lookup != NULL ? &dict_lookup[hash] : NULL,
+		                                      base, window, max_depth, accept_len, &offs, stats);
+
+		next_insert = cur + 1;
+
+		if (len == 0) {
+			cur += crush_skip_step(misses++);
+			continue;
+		}
+
+		// Check if a match at the next position saves more bits
+		while (len < accept_len && cur + 1 < last_match_pos) {
+			const unsigned long next_hash = crush_hash3_bits(&in[cur + 1], bits) * max_depth;
+			unsigned long next_offs = 0;
+			unsigned long next_len = crush_lazy_search(in, cur + 1, src_end - cur - 1,
+			                                           &lookup[next_hash],
+			                                           dict_lookup != NULL ? &dict_lookup[next_hash] : NULL,
+			                                           base, window, max_depth, accept_len, &next_offs,
+			                                           stats);
+
+			next_insert = cur + 2;
+
+			if (next_len == 0
+			 || crush_lazy_gain(next_offs, next_len) <= crush_lazy_gain(offs, len)) {
+				break;
+			}
+
+			++cur;
+			len = next_len;
+			offs = next_offs;
+		}
+
+		crush_put_literals(&lbw, &in[lit_start], cur - lit_start);
+		crush_put_match(&lbw, offs, len);
+
+		cur += len;
+		lit_start = cur;
+		misses = 0;
+
+		// Insert the remaining positions covered by the match
+		crush_lazy_insert_range(lookup, in, next_insert,
+		                        cur < last_match_pos ? cur : last_match_pos,
+		                        base, bits, max_depth);
+	}
+
+	// Output any remaining literals
+	crush_put_literals(&lbw, &in[lit_start], src_end - lit_start);
+
+	crush_stats_find_time(stats, start);
+
+	// Return compressed size
+	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
+}
+
+#endif /* CRUSH_LAZY_H_INCLUDED */
@@ -28,20 +28,48 @@
 #ifndef CRUSH_LEPARSE_H_INCLUDED
 #define CRUSH_LEPARSE_H_INCLUDED
 
+// Small inputs put the lookups before the other arrays, large inputs
+// overlap them with mpos. Always adding the lookup size keeps the size
+// increasing in src_size.
 static size_t
-crush_leparse_workmem_size(size_t src_size)
+crush_leparse_workmem_size(size_t src_size, int hash_bits)
 {
-	return (LOOKUP_SIZE < 2 * src_size ? 3 * src_size : src_size + LOOKUP_SIZE)
-	     * sizeof(uint32_t);
+	return (3 * src_size + (1UL << hash_bits)) * sizeof(uint32_t);
 }
 
+// Backwards dynamic programming parse with left-extension of matches.
+//
+// Match candidates come from two hash tables, like in CRUSH. Hash chains
+// on four bytes give the candidates for matches of length 4 and up, which
+// keeps the chains short on data with many small matches. A table on three
+// bytes gives the closest candidate for a match of length 3.
+//
+// src points to hist_size bytes of history followed by the src_size bytes to
+// compress. The history is added to the hash chains, so workmem is sized for
+// hist_size + src_size bytes.
+//
+// base is the lookup tag base, see crush_lookup_init. For inputs up to half
+// of 2^hash_bits the lookups use hash_bits and are kept at the start of
+// workmem, otherwise they scale with the input, are overlapped with mpos,
+// and always cleared. *keep is set to indicate if the lookups can be reused.
+// Matches are at most window bytes back, and the search depth is given by
+// max_depth and node_budget, see crush_depth. token_weight adds
+// crush_token_cost to the cost of each token. If stats is not NULL, the
+// searches and time are added to it.
+//
 static unsigned long
-crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *workmem,
-                   const unsigned long max_depth, const unsigned long accept_len)
+crush_pack_leparse(const void *src, unsigned long hist_size, void *dst,
+                   unsigned long src_size, void *workmem, uint32_t base,
+                   int *keep, const int hash_bits, const unsigned long window,
+                   const unsigned long max_depth, const unsigned long accept_len,
+                   const unsigned long node_budget, const int token_weight,
+                   struct crush_stats *stats)
 {
 	struct lsb_bitwriter lbw;
 	const unsigned char *const in = (const unsigned char *) src;
-	const unsigned long last_match_pos = src_size > 3 ? src_size - 3 : 0;
+	const unsigned long src_end = hist_size + src_size;
+	const unsigned long last_match_pos = src_end > 3 ? src_end - 3 : 0;
+	clock_t start = crush_stats_clock(stats);
 
 	// Check for empty input
 	if (src_size == 0) {
@@ -51,79 +79,140 @@ crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *wor
 	lbw_init(&lbw, (unsigned char *) dst);
 
 	if (src_size < 4) {
-		for (unsigned long i = 0; i < src_size; ++i) {
-			lbw_putbits(&lbw, (uint32_t) in[i] << 1, 9);
+		for (unsigned long i = hist_size; i < src_end; ++i) {
+			crush_put_literal(&lbw, in[i]);
 		}
 
 		return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
 	}
 
-	// With a bit of careful ordering we can fit in 3 * src_size words.
+	// For small inputs the lookups are put before the other arrays, so
+	// they are in the same place for any src_size and can be reused.
+	const unsigned long lookup_size = 1UL << hash_bits;
+	const int small = 2 * src_end < lookup_size;
+
+	*keep = small;
+
+	// With a bit of careful ordering we can fit in 3 * src_end words.
 	//
-	// The idea is that the lookup is only used in the first phase to
-	// build the hash chains, so we overlap it with mpos and mlen.
+	// The idea is that the lookups are only used in the first phase to
+	// build the hash chains, so we overlap them with mpos. The closest
+	// three byte match for each position is stored in mlen, which we
+	// read in phase two right before filling in that position.
 	// Also, since we are using prev from right to left in phase two,
 	// and that is the order we fill in cost, we can overlap these.
 	//
-	// One detail is that we actually use src_size + 1 elements of cost,
-	// but we put mpos after it, where we do not need the first element.
+	// One detail is that we actually use src_end + 1 elements of cost,
+	// but we put mlen after it, where we do not need the first element.
 	//
-	uint32_t *const prev = (uint32_t *) workmem;
-	uint32_t *const mpos = prev + src_size;
-	uint32_t *const mlen = mpos + src_size;
+	uint32_t *const prev = (uint32_t *) workmem + (small ? lookup_size : 0);
+	uint32_t *const mlen = prev + src_end;
+	uint32_t *const mpos = mlen + src_end;
 	uint32_t *const cost = prev;
-	uint32_t *const lookup = mpos;
+	uint32_t *const near3 = mlen;
 
 	// Phase 1: Build hash chains
-	const int bits = 2 * src_size < LOOKUP_SIZE ? CRUSH_HASH_BITS : crush_log2(src_size);
+	const int bits = small ? hash_bits : crush_log2(src_end);
+	const int bits4 = bits - 1;
+	const int bits3 = bits - 2;
 
-	// Initialize lookup
-	for (unsigned long i = 0; i < (1UL << bits); ++i) {
-		lookup[i] = NO_MATCH_POS;
-	}
+	uint32_t *const lookup4 = small ? (uint32_t *) workmem : mpos;
+	uint32_t *const lookup3 = lookup4 + (1UL << bits4);
 
-	// Build hash chains in prev
+	// Initialize lookups
+	base = crush_lookup_init(lookup4, (1UL << bits4) + (1UL << bits3),
+	                         small ? base : 0);
+
+	// Build hash chains on four bytes in prev, and closest three byte
+	// match in near3
 	if (last_match_pos > 0) {
+		for (unsigned long i = 0; i < last_match_pos; ++i) {
+			const unsigned long hash = crush_hash4_bits(&in[i], bits4);
+			prev[i] = crush_lookup_pos(lookup4[hash], base);
+			lookup4[hash] = i + base;
+		}
+
+		prev[last_match_pos] = NO_MATCH_POS;
+
 		for (unsigned long i = 0; i <= last_match_pos; ++i) {
-			const unsigned long hash = crush_hash3_bits(&in[i], bits);
-			prev[i] = lookup[hash];
-			lookup[hash] = i;
+			const unsigned long hash = crush_hash3_bits(&in[i], bits3);
+			near3[i] = crush_lookup_pos(lookup3[hash], base);
+			lookup3[hash] = i + base;
 		}
 	}
 
 	// Initialize last two positions as literals
-	mlen[src_size - 2] = 1;
-	mlen[src_size - 1] = 1;
+	mlen[src_end - 2] = 1;
+	mlen[src_end - 1] = 1;
+
+	const unsigned long lit_cost = 9 + crush_token_cost(token_weight);
+
+	cost[src_end - 2] = 2 * lit_cost;
+	cost[src_end - 1] = lit_cost;
+	cost[src_end] = 0;
+
+	// Without history the first position is always a literal
+	const unsigned long first_match_pos = hist_size > 0 ? hist_size : 1;
 
-	cost[src_size - 2] = 18;
-	cost[src_size - 1] = 9;
-	cost[src_size] = 0;
+	struct crush_depth depth;
+
+	crush_depth_init(&depth, max_depth, node_budget);
 
 	// Phase 2: Find lowest cost path from each position to end
-	for (unsigned long cur = last_match_pos; cur > 0; --cur) {
+	for (unsigned long cur = last_match_pos; cur >= first_match_pos; --cur) {
 		// Since we updated prev to the end in the first phase, we
 		// do not need to hash, but can simply look up the previous
 		// position directly.
 		unsigned long pos = prev[cur];
+		const unsigned long pos3 = near3[cur];
 
 		assert(pos == NO_MATCH_POS || pos < cur);
+		assert(pos3 == NO_MATCH_POS || pos3 < cur);
 
 		// Start with a literal
-		cost[cur] = cost[cur + 1] + 9;
+		cost[cur] = cost[cur + 1] + lit_cost;
 		mlen[cur] = 1;
 
 		unsigned long max_len = MIN_MATCH - 1;
 
-		const unsigned long len_limit = src_size - cur > MAX_MATCH ? MAX_MATCH : src_size - cur;
-		unsigned long num_chain = max_depth;
+		const unsigned long len_limit = src_end - cur > MAX_MATCH ? MAX_MATCH : src_end - cur;
+		unsigned long num_chain = depth.depth;
+		unsigned long num_nodes = 0;
+		unsigned long best_node = 0;
+
+		// Check closest match of length 3
+		//
+		// Any match of length 4 or more is also a three byte match,
+		// so it can be no closer than pos3, and will be found in the
+		// four byte hash chain. Hence we only consider length 3 here.
+		// It is taken at any distance where it costs less than three
+		// literals.
+		//
+		if (pos3 != NO_MATCH_POS && pos3 != pos && cur - pos3 <= window
+		 && in[pos3] == in[cur] && in[pos3 + 1] == in[cur + 1] && in[pos3 + 2] == in[cur + 2]) {
+			unsigned long match_cost = crush_match_cost(cur - pos3 - 1, MIN_MATCH)
+			                         + crush_token_cost(token_weight);
+			assert(match_cost < UINT32_MAX - cost[cur + MIN_MATCH]);
+			unsigned long cost_here = match_cost + cost[cur + MIN_MATCH];
+
+			if (cost_here < cost[cur]) {
+				cost[cur] = cost_here;
+				mpos[cur] = pos3;
+				mlen[cur] = MIN_MATCH;
+			}
+
+			max_len = MIN_MATCH;
+		}
 
 		// Go through the chain of prev matches
 		for (; pos != NO_MATCH_POS && num_chain--; pos = prev[pos]) {
-			// Limit offset to W_SIZE
-			if (cur - pos > W_SIZE) {
+			// Limit offset to window
+			if (cur - pos > window) {
 				break;
 			}
 
+			++num_nodes;
+
 			// The CRUSH packer drops length 3 matches further
 			// away than TOO_FAR (64k). The actual point at which
 			// a match is longer than 3 literals is 1M, so this
@@ -142,9 +231,7 @@ crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *wor
 			// If next byte matches, so this has a chance to be a longer match
 			if (max_len < len_limit && in[pos + max_len] == in[cur + max_len]) {
 				// Find match len
-				while (len < len_limit && in[pos + len] == in[cur + len]) {
-					++len;
-				}
+				len = crush_match_len(&in[pos], &in[cur], len, len_limit);
 			}
 
 			// Extend current match if possible
@@ -155,12 +242,14 @@ crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *wor
 			// max length will always be longer or equal, so we need
 			// only consider the extension.
 			if (len > max_len) {
+				const unsigned long offs_cost = crush_offs_cost(cur - pos - 1)
+				                              + crush_token_cost(token_weight);
 				unsigned long min_cost = UINT32_MAX;
 				unsigned long min_cost_len = MIN_MATCH - 1;
 
 				// Find lowest cost match length
 				for (unsigned long i = max_len + 1; i <= len; ++i) {
-					unsigned long match_cost = crush_match_cost(cur - pos - 1, i);
+					unsigned long match_cost = offs_cost + crush_len_cost(i);
 					assert(match_cost < UINT32_MAX - cost[cur + i]);
 					unsigned long cost_here = match_cost + cost[cur + i];
 
@@ -177,20 +266,24 @@ crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *wor
 					cost[cur] = min_cost;
 					mpos[cur] = pos;
 					mlen[cur] = min_cost_len;
+					best_node = num_nodes;
 
 					// Left-extend current match if possible
-					if (pos > 0 && in[pos - 1] == in[cur - 1] && min_cost_len < MAX_MATCH) {
+					//
+					// The offset stays the same, so only the
+					// length cost changes.
+					if (pos > 0 && cur > first_match_pos && in[pos - 1] == in[cur - 1] && min_cost_len < MAX_MATCH) {
 						do {
 							--cur;
 							--pos;
 							++min_cost_len;
-							unsigned long match_cost = crush_match_cost(cur - pos - 1, min_cost_len);
+							unsigned long match_cost = offs_cost + crush_len_cost(min_cost_len);
 							assert(match_cost < UINT32_MAX - cost[cur + min_cost_len]);
 							unsigned long cost_here = match_cost + cost[cur + min_cost_len];
 							cost[cur] = cost_here;
 							mpos[cur] = pos;
 							mlen[cur] = min_cost_len;
-						} while (pos > 0 && in[pos - 1] == in[cur - 1] && min_cost_len < MAX_MATCH);
+						} while (pos > 0 && cur > first_match_pos && in[pos - 1] == in[cur - 1] && min_cost_len < MAX_MATCH);
 						break;
 					}
 				}
@@ -200,61 +293,28 @@ crush_pack_leparse(const void *src, void *dst, unsigned long src_size, void *wor
 				break;
 			}
 		}
+
+		crush_stats_search(stats, num_nodes, depth.depth);
+		crush_depth_search(&depth, num_nodes, best_node);
 	}
 
 	mpos[0] = 0;
 	mlen[0] = 1;
 
+	start = crush_stats_find_time(stats, start);
+
 	// Phase 3: Output compressed data, following lowest cost path
-	for (unsigned long i = 0; i < src_size; i += mlen[i]) {
+	for (unsigned long i = hist_size; i < src_end; i += mlen[i]) {
 		if (mlen[i] == 1) {
-			lbw_putbits(&lbw, (uint32_t) in[i] << 1, 9);
+			crush_put_literal(&lbw, in[i]);
 		}
 		else {
-			const unsigned long offs = i - mpos[i] - 1;
-
-			lbw_putbits(&lbw, 1, 1);
-
-			const unsigned long l = mlen[i] - MIN_MATCH;
-
-			if (l < A) {
-				lbw_putbits(&lbw, 1UL, 1);
-				lbw_putbits(&lbw, l, A_BITS);
-			}
-			else if (l < B) {
-				lbw_putbits(&lbw, 1UL << 1, 2);
-				lbw_putbits(&lbw, l - A, B_BITS);
-			}
-			else if (l < C) {
-				lbw_putbits(&lbw, 1UL << 2, 3);
-				lbw_putbits(&lbw, l - B, C_BITS);
-			}
-			else if (l < D) {
-				lbw_putbits(&lbw, 1UL << 3, 4);
-				lbw_putbits(&lbw, l - C, D_BITS);
-			}
-			else if (l < E) {
-				lbw_putbits(&lbw, 1UL << 4, 5);
-				lbw_putbits(&lbw, l - D, E_BITS);
-			}
-			else {
-				lbw_putbits(&lbw, 0, 5);
-				lbw_putbits(&lbw, l - E, F_BITS);
-			}
-
-			if (offs >= (2UL << (W_BITS - NUM_SLOTS))) {
-				unsigned long mlog = crush_log2(offs);
-
-				lbw_putbits(&lbw, mlog - (W_BITS - NUM_SLOTS), SLOT_BITS);
-				lbw_putbits(&lbw, offs - (1UL << mlog), mlog);
-			}
-			else {
-				lbw_putbits(&lbw, 0, SLOT_BITS);
-				lbw_putbits(&lbw, offs, W_BITS - (NUM_SLOTS - 1));
-			}
+			crush_put_match(&lbw, i - mpos[i] - 1, mlen[i]);
 		}
 	}
 
+	crush_stats_output_time(stats, start);
+
 	// Return compressed size
 	return (unsigned long) (lbw_finalize(&lbw) - (unsigned char *) dst);
 }
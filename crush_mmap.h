@@ -0,0 +1,261 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Minimal portable memory-mapped files
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+
+#ifndef CRUSH_MMAP_H_INCLUDED
+#define CRUSH_MMAP_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+// A file mapped into memory.
+//
+// An empty file has data set to NULL, since it cannot be mapped.
+//
+struct crush_map {
+	unsigned char *data;
+	size_t size;
+#if defined(_WIN32)
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+// Initialize map, so crush_map_close is safe to call.
+static void
+crush_map_init(struct crush_map *m)
+{
+	m->data = NULL;
+	m->size = 0;
+#if defined(_WIN32)
+	m->file = INVALID_HANDLE_VALUE;
+	m->mapping = NULL;
+#else
+	m->fd = -1;
+#endif
+}
+
+#if defined(_WIN32)
+static int
+crush_map_view(struct crush_map *m, DWORD protect, DWORD access)
+{
+	if (m->size == 0) {
+		m->data = NULL;
+		return 0;
+	}
+
+	m->mapping = CreateFileMappingA(m->file, NULL, protect,
+	                                (DWORD) ((uint64_t) m->size >> 32),
+	                                (DWORD) m->size, NULL);
+
+	if (m->mapping == NULL) {
+		return -1;
+	}
+
+	m->data = (unsigned char *) MapViewOfFile(m->mapping, access, 0, 0, m->size);
+
+	return m->data != NULL ? 0 : -1;
+}
+#endif
+
+// Map file name for reading, returns 0 on success.
+//
+// The map must be initialized, and closed even on failure.
+//
+static int
+crush_map_read(struct crush_map *m, const char *name)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER size;
+
+	m->file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL,
+	                      OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (m->file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	if (!GetFileSizeEx(m->file, &size)
+	 || (uint64_t) size.QuadPart > SIZE_MAX) {
+		return -1;
+	}
+
+	m->size = (size_t) size.QuadPart;
+
+	return crush_map_view(m, PAGE_READONLY, FILE_MAP_READ);
+#else
+	struct stat st;
+
+	if ((m->fd = open(name, O_RDONLY)) == -1) {
+		return -1;
+	}
+
+	if (fstat(m->fd, &st) != 0
+	 || (uintmax_t) st.st_size > SIZE_MAX) {
+		return -1;
+	}
+
+	m->size = (size_t) st.st_size;
+
+	if (m->size == 0) {
+		return 0;
+	}
+
+	m->data = (unsigned char *) mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
+
+	if (m->data == MAP_FAILED) {
+		m->data = NULL;
+		return -1;
+	}
+
+	return 0;
+#endif
+}
+
+// Create file name with size bytes and map it for writing, returns 0 on
+// success.
+//
+// The size may be reduced when closing, so it can be an upper bound.
+//
+static int
+crush_map_write(struct crush_map *m, const char *name, size_t size)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER li;
+
+	m->size = size;
+	m->file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+	                      CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (m->file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+
+	li.QuadPart = (LONGLONG) size;
+
+	if (!SetFilePointerEx(m->file, li, NULL, FILE_BEGIN)
+	 || !SetEndOfFile(m->file)) {
+		return -1;
+	}
+
+	return crush_map_view(m, PAGE_READWRITE, FILE_MAP_WRITE);
+#else
+	m->size = size;
+
+	if ((m->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666)) == -1) {
+		return -1;
+	}
+
+	if (size == 0) {
+		return 0;
+	}
+
+	if (ftruncate(m->fd, (off_t) size) != 0) {
+		return -1;
+	}
+
+	m->data = (unsigned char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+
+	if (m->data == MAP_FAILED) {
+		m->data = NULL;
+		return -1;
+	}
+
+	return 0;
+#endif
+}
+
+// Unmap file, and if it was mapped for writing, set its size to new_size.
+//
+// Returns 0 on success. Safe to call on a map that failed to open.
+//
+static int
+crush_map_close(struct crush_map *m, size_t new_size, int writable)
+{
+	int res = 0;
+
+#if defined(_WIN32)
+	if (m->data != NULL) {
+		if (writable && !FlushViewOfFile(m->data, 0)) {
+			res = -1;
+		}
+		UnmapViewOfFile(m->data);
+	}
+	if (m->mapping != NULL) {
+		CloseHandle(m->mapping);
+	}
+	if (m->file != INVALID_HANDLE_VALUE) {
+		if (writable && new_size != m->size) {
+			LARGE_INTEGER li;
+
+			li.QuadPart = (LONGLONG) new_size;
+
+			if (!SetFilePointerEx(m->file, li, NULL, FILE_BEGIN)
+			 || !SetEndOfFile(m->file)) {
+				res = -1;
+			}
+		}
+		CloseHandle(m->file);
+	}
+
+	m->mapping = NULL;
+	m->file = INVALID_HANDLE_VALUE;
+#else
+	if (m->data != NULL) {
+		munmap(m->data, m->size);
+	}
+	if (m->fd != -1) {
+		if (writable && new_size != m->size
+		 && ftruncate(m->fd, (off_t) new_size) != 0) {
+			res = -1;
+		}
+		if (close(m->fd) != 0) {
+			res = -1;
+		}
+	}
+
+	m->fd = -1;
+#endif
+
+	m->data = NULL;
+	m->size = 0;
+
+	return res;
+}
+
+#endif /* CRUSH_MMAP_H_INCLUDED */
@@ -0,0 +1,447 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Random access reader
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+
+#ifdef _MSC_VER
+#  define _CRT_SECURE_NO_WARNINGS
+#  define fseeko _fseeki64
+#  define ftello _ftelli64
+#else
+#  define _FILE_OFFSET_BITS 64
+#  define _POSIX_C_SOURCE 200112L
+#endif
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#define CRUSH_THREAD_MUTEX_ONLY
+#include "crush_thread.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A block of the file, and its place in the cache if it is there.
+//
+// Cached blocks are in a doubly linked list from the most recently used at
+// lru_head to the least recently used at lru_tail.
+struct crush_reader_block {
+	long long file_offset;      // Offset of compressed data in file
+	unsigned long long start;   // Offset of decompressed data
+	unsigned long packed_size;
+	unsigned long depacked_size;
+	unsigned char *data;        // Decompressed data, NULL if not cached
+	struct crush_reader_block *prev;
+	struct crush_reader_block *next;
+};
+
+// Allocate size bytes, at least 1, with the allocator of cr.
+static void *
+crush_reader_alloc(struct crush_reader *cr, size_t size)
+{
+	return cr->allocator.alloc(cr->allocator.opaque, size > 0 ? size : 1);
+}
+
+// Free ptr from crush_reader_alloc of size bytes, if not NULL.
+static void
+crush_reader_free(struct crush_reader *cr, void *ptr, size_t size)
+{
+	if (ptr != NULL) {
+		cr->allocator.free(cr->allocator.opaque, ptr, size > 0 ? size : 1);
+	}
+}
+
+static unsigned long
+read_le32(const unsigned char *p)
+{
+	return ((unsigned long) p[0])
+	     | ((unsigned long) p[1] << 8)
+	     | ((unsigned long) p[2] << 16)
+	     | ((unsigned long) p[3] << 24);
+}
+
+// Read the block index file of filename into cr->blocks.
+static int
+crush_reader_read_index(struct crush_reader *cr, const char *filename)
+{
+	const size_t name_size = strlen(filename) + sizeof(CRUSH_INDEX_SUFFIX);
+	char *name = (char *) crush_reader_alloc(cr, name_size);
+	FILE *file;
+	unsigned char buf[8];
+	long long file_size;
+	long long offset = 0;
+	unsigned long long start = 0;
+	unsigned long num_blocks;
+	int res = -1;
+
+	if (name == NULL) {
+		return -1;
+	}
+
+	strcpy(name, filename);
+	strcat(name, CRUSH_INDEX_SUFFIX);
+
+	file = fopen(name, "rb");
+
+	crush_reader_free(cr, name, name_size);
+
+	if (file == NULL) {
+		return -1;
+	}
+
+	if (fseeko(cr->file, 0, SEEK_END) != 0
+	 || (file_size = ftello(cr->file)) < 0
+	 || fread(buf, 1, 8, file) != 8
+	 || read_le32(buf) != CRUSH_INDEX_MAGIC) {
+		goto out;
+	}
+
+	num_blocks = read_le32(buf + 4);
+
+	// Each block has a 4 byte header
+	if ((long long) num_blocks > file_size / 4
+	 || num_blocks > (size_t) -1 / sizeof(*cr->blocks)) {
+		goto out;
+	}
+
+	cr->blocks = (struct crush_reader_block *) crush_reader_alloc(cr, num_blocks * sizeof(*cr->blocks));
+
+	if (cr->blocks == NULL) {
+		goto out;
+	}
+
+	memset(cr->blocks, 0, num_blocks * sizeof(*cr->blocks));
+	cr->num_blocks = num_blocks;
+
+	for (unsigned long i = 0; i < num_blocks; ++i) {
+		struct crush_reader_block *block = &cr->blocks[i];
+
+		if (fread(buf, 1, 8, file) != 8) {
+			goto out;
+		}
+
+		block->packed_size = read_le32(buf);
+		block->depacked_size = read_le32(buf + 4);
+
+		// The depacked size must fit in a size_t for the cache
+		if (block->packed_size > crush_max_packed_size(block->depacked_size)
+		 || (size_t) block->depacked_size != block->depacked_size) {
+			goto out;
+		}
+
+		block->file_offset = offset + 4;
+		block->start = start;
+
+		offset += 4 + (long long) block->packed_size;
+		start += block->depacked_size;
+	}
+
+	// Blocks must account for the entire file
+	if (offset == file_size && fread(buf, 1, 1, file) == 0) {
+		cr->size = start;
+		res = 0;
+	}
+
+out:
+	fclose(file);
+
+	return res;
+}
+
+int
+crush_reader_open(struct crush_reader *cr, const char *filename,
+                  size_t cache_max)
+{
+	return crush_reader_open_alloc(cr, filename, cache_max, NULL);
+}
+
+int
+crush_reader_open_alloc(struct crush_reader *cr, const char *filename,
+                        size_t cache_max,
+                        const struct crush_allocator *allocator)
+{
+	crush_allocator_init(&cr->allocator, allocator);
+
+	cr->file = NULL;
+	cr->blocks = NULL;
+	cr->lru_head = NULL;
+	cr->lru_tail = NULL;
+	cr->lock = NULL;
+	cr->num_blocks = 0;
+	cr->size = 0;
+	cr->cache_size = 0;
+	cr->cache_max = cache_max;
+
+	cr->file = fopen(filename, "rb");
+
+	if (cr->file == NULL) {
+		return -1;
+	}
+
+	cr->lock = crush_reader_alloc(cr, sizeof(crush_mutex));
+
+	if (cr->lock == NULL) {
+		crush_reader_close(cr);
+		return -1;
+	}
+
+	if (crush_mutex_init((crush_mutex *) cr->lock) != 0) {
+		crush_reader_free(cr, cr->lock, sizeof(crush_mutex));
+		cr->lock = NULL;
+		crush_reader_close(cr);
+		return -1;
+	}
+
+	if (crush_reader_read_index(cr, filename) != 0) {
+		crush_reader_close(cr);
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned long long
+crush_reader_size(const struct crush_reader *cr)
+{
+	return cr->size;
+}
+
+// Remove cached block from the LRU list.
+static void
+crush_reader_unlink(struct crush_reader *cr, struct crush_reader_block *block)
+{
+	if (block->prev != NULL) {
+		block->prev->next = block->next;
+	}
+	else {
+		cr->lru_head = block->next;
+	}
+
+	if (block->next != NULL) {
+		block->next->prev = block->prev;
+	}
+	else {
+		cr->lru_tail = block->prev;
+	}
+
+	block->prev = NULL;
+	block->next = NULL;
+}
+
+// Insert cached block at the front of the LRU list.
+static void
+crush_reader_push(struct crush_reader *cr, struct crush_reader_block *block)
+{
+	block->prev = NULL;
+	block->next = cr->lru_head;
+
+	if (cr->lru_head != NULL) {
+		cr->lru_head->prev = block;
+	}
+	else {
+		cr->lru_tail = block;
+	}
+
+	cr->lru_head = block;
+}
+
+// Read and decompress block to a new buffer, returns NULL on error.
+static unsigned char *
+crush_reader_load(struct crush_reader *cr, const struct crush_reader_block *block)
+{
+	unsigned char *packed = (unsigned char *) crush_reader_alloc(cr, block->packed_size);
+	unsigned char *data = (unsigned char *) crush_reader_alloc(cr, block->depacked_size);
+	unsigned char header[4];
+	int ok;
+
+	if (packed == NULL || data == NULL) {
+		crush_reader_free(cr, packed, block->packed_size);
+		crush_reader_free(cr, data, block->depacked_size);
+		return NULL;
+	}
+
+	// The file position is shared, so seek and read under the lock
+	crush_mutex_lock((crush_mutex *) cr->lock);
+
+	ok = fseeko(cr->file, block->file_offset - 4, SEEK_SET) == 0
+	  && fread(header, 1, 4, cr->file) == 4
+	  && read_le32(header) == block->depacked_size
+	  && fread(packed, 1, block->packed_size, cr->file) == block->packed_size;
+
+	crush_mutex_unlock((crush_mutex *) cr->lock);
+
+	// Decompress without holding the lock
+	ok = ok && crush_depack_safe(packed, block->packed_size, data,
+	                             block->depacked_size) == block->depacked_size;
+
+	crush_reader_free(cr, packed, block->packed_size);
+
+	if (!ok) {
+		crush_reader_free(cr, data, block->depacked_size);
+		return NULL;
+	}
+
+	return data;
+}
+
+// Copy size bytes at offs in block to buf, loading it if not cached.
+static int
+crush_reader_copy(struct crush_reader *cr, struct crush_reader_block *block,
+                  unsigned char *buf, size_t offs, size_t size)
+{
+	crush_mutex *lock = (crush_mutex *) cr->lock;
+	unsigned char *data;
+
+	crush_mutex_lock(lock);
+
+	if (block->data != NULL) {
+		memcpy(buf, block->data + offs, size);
+
+		crush_reader_unlink(cr, block);
+		crush_reader_push(cr, block);
+
+		crush_mutex_unlock(lock);
+
+		return 0;
+	}
+
+	crush_mutex_unlock(lock);
+
+	data = crush_reader_load(cr, block);
+
+	if (data == NULL) {
+		return -1;
+	}
+
+	memcpy(buf, data + offs, size);
+
+	crush_mutex_lock(lock);
+
+	// Cache the block, unless it is too large or another thread
+	// loaded it while we were decompressing
+	if (block->data == NULL && block->depacked_size <= cr->cache_max) {
+		while (cr->cache_size > cr->cache_max - block->depacked_size) {
+			struct crush_reader_block *lru = cr->lru_tail;
+
+			crush_reader_unlink(cr, lru);
+			cr->cache_size -= lru->depacked_size;
+			crush_reader_free(cr, lru->data, lru->depacked_size);
+			lru->data = NULL;
+		}
+
+		block->data = data;
+		cr->cache_size += block->depacked_size;
+		crush_reader_push(cr, block);
+		data = NULL;
+	}
+
+	crush_mutex_unlock(lock);
+
+	crush_reader_free(cr, data, block->depacked_size);
+
+	return 0;
+}
+
+size_t
+crush_reader_read(struct crush_reader *cr, void *buf, size_t size,
+                  unsigned long long offset)
+{
+	unsigned char *out = (unsigned char *) buf;
+	unsigned long lo = 0;
+	unsigned long hi = cr->num_blocks;
+	size_t done = 0;
+
+	if (offset >= cr->size || size == 0) {
+		return 0;
+	}
+
+	if (size > cr->size - offset) {
+		size = (size_t) (cr->size - offset);
+	}
+
+	// Find the last block starting at or before offset
+	while (hi - lo > 1) {
+		const unsigned long mid = lo + (hi - lo) / 2;
+
+		if (cr->blocks[mid].start <= offset) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (unsigned long i = lo; done < size; ++i) {
+		struct crush_reader_block *block = &cr->blocks[i];
+		const size_t offs = (size_t) (offset + done - block->start);
+		size_t len = block->depacked_size - offs;
+
+		// Skip empty blocks
+		if (block->depacked_size == 0) {
+			continue;
+		}
+
+		if (len > size - done) {
+			len = size - done;
+		}
+
+		if (crush_reader_copy(cr, block, out + done, offs, len) != 0) {
+			return (size_t) -1;
+		}
+
+		done += len;
+	}
+
+	return done;
+}
+
+void
+crush_reader_close(struct crush_reader *cr)
+{
+	for (unsigned long i = 0; cr->blocks != NULL && i < cr->num_blocks; ++i) {
+		crush_reader_free(cr, cr->blocks[i].data, cr->blocks[i].depacked_size);
+	}
+
+	crush_reader_free(cr, cr->blocks, cr->num_blocks * sizeof(*cr->blocks));
+
+	if (cr->lock != NULL) {
+		crush_mutex_destroy((crush_mutex *) cr->lock);
+		crush_reader_free(cr, cr->lock, sizeof(crush_mutex));
+	}
+
+	if (cr->file != NULL) {
+		fclose(cr->file);
+	}
+
+	cr->file = NULL;
+	cr->blocks = NULL;
+	cr->lru_head = NULL;
+	cr->lru_tail = NULL;
+	cr->lock = NULL;
+	cr->num_blocks = 0;
+	cr->cache_size = 0;
+}
@@ -0,0 +1,165 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Streaming compression
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#include "crush.h"
+#include "crush_internal.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+int
+crush_stream_init(struct crush_stream *cs, int level,
+                  unsigned long block_size, int flags)
+{
+	return crush_stream_init_alloc(cs, level, block_size, flags, NULL);
+}
+
+int
+crush_stream_init_alloc(struct crush_stream *cs, int level,
+                        unsigned long block_size, int flags,
+                        const struct crush_allocator *allocator)
+{
+	size_t workmem_size;
+
+	crush_allocator_init(&cs->allocator, allocator);
+
+	cs->buf = NULL;
+	cs->workmem = NULL;
+	cs->workmem_size = 0;
+	cs->block_size = block_size;
+	cs->hist_max = (flags & CRUSH_STREAM_LINKED) ? W_SIZE : 0;
+	cs->hist_size = 0;
+	cs->pending = 0;
+	cs->base = 0;
+	cs->level = level;
+
+	// The block header stores the depacked size in 32 bits
+	if (block_size == 0 || block_size > 0xFFFFFFFFUL
+	 || block_size > ULONG_MAX - cs->hist_max) {
+		return -1;
+	}
+
+	workmem_size = crush_workmem_size_level(cs->hist_max + block_size, level);
+
+	if (workmem_size == (size_t) -1) {
+		return -1;
+	}
+
+	cs->workmem_size = workmem_size > 0 ? workmem_size : 1;
+	cs->buf = (unsigned char *) cs->allocator.alloc(cs->allocator.opaque,
+	                                                cs->hist_max + block_size);
+	cs->workmem = cs->allocator.alloc(cs->allocator.opaque, cs->workmem_size);
+
+	if (cs->buf == NULL || cs->workmem == NULL) {
+		crush_stream_end(cs);
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned long
+crush_stream_bound(const struct crush_stream *cs)
+{
+	return 4 + crush_max_packed_size(cs->block_size);
+}
+
+unsigned long
+crush_stream_update(struct crush_stream *cs, const void *src,
+                    unsigned long src_size, void *dst,
+                    unsigned long *dst_size)
+{
+	unsigned long len = cs->block_size - cs->pending;
+
+	if (len > src_size) {
+		len = src_size;
+	}
+
+	memcpy(cs->buf + cs->hist_size + cs->pending, src, len);
+	cs->pending += len;
+
+	*dst_size = 0;
+
+	if (cs->pending == cs->block_size) {
+		*dst_size = crush_stream_flush(cs, dst);
+	}
+
+	return len;
+}
+
+unsigned long
+crush_stream_flush(struct crush_stream *cs, void *dst)
+{
+	unsigned char *p = (unsigned char *) dst;
+	unsigned long total = cs->hist_size + cs->pending;
+	uint32_t base = (uint32_t) cs->base;
+	unsigned long packed_size;
+
+	// Keep the end of the input as history for the next block
+	unsigned long keep = total < cs->hist_max ? total : cs->hist_max;
+
+	if (cs->pending == 0) {
+		return 0;
+	}
+
+	packed_size = crush_pack_level_stream(cs->buf, cs->hist_size, p + 4,
+	                                      cs->pending, cs->workmem, cs->level,
+	                                      &base, keep);
+
+	cs->base = base;
+
+	p[0] = cs->pending & 0x00FF;
+	p[1] = (cs->pending >> 8) & 0x00FF;
+	p[2] = (cs->pending >> 16) & 0x00FF;
+	p[3] = (cs->pending >> 24) & 0x00FF;
+
+	memmove(cs->buf, cs->buf + total - keep, keep);
+	cs->hist_size = keep;
+	cs->pending = 0;
+
+	return 4 + packed_size;
+}
+
+void
+crush_stream_end(struct crush_stream *cs)
+{
+	if (cs->buf != NULL) {
+		cs->allocator.free(cs->allocator.opaque, cs->buf,
+		                   cs->hist_max + cs->block_size);
+	}
+
+	if (cs->workmem != NULL) {
+		cs->allocator.free(cs->allocator.opaque, cs->workmem,
+		                   cs->workmem_size);
+	}
+
+	cs->buf = NULL;
+	cs->workmem = NULL;
+	cs->hist_size = 0;
+	cs->pending = 0;
+}
@@ -0,0 +1,138 @@
+//
+// bcrush - Example of CRUSH compression with BriefLZ algorithms
+//
+// Minimal portable threads
+//
+// Copyright (c) 2020 Joergen Ibsen
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//   1. The origin of this software must not be misrepresented; you must
+//      not claim that you wrote the original software. If you use this
+//      software in a product, an acknowledgment in the product
+//      documentation would be appreciated but is not required.
+//
+//   2. Altered source versions must be plainly marked as such, and must
+//      not be misrepresented as being the original software.
+//
+//   3. This notice may not be removed or altered from any source
+//      distribution.
+//
+
+#ifndef CRUSH_THREAD_H_INCLUDED
+#define CRUSH_THREAD_H_INCLUDED
+
+#if !defined(CRUSH_NO_THREADS)
+#  if defined(_WIN32)
+#    include <windows.h>
+#    include <process.h>
+#  else
+#    include <pthread.h>
+#  endif
+#endif
+
+// A mutex, crush_mutex_init returns 0 on success.
+//
+// With CRUSH_NO_THREADS defined, the mutex does nothing. Define
+// CRUSH_THREAD_MUTEX_ONLY before including this header to get only the
+// mutex, so the unused thread functions do not cause warnings.
+//
+#if defined(CRUSH_NO_THREADS)
+typedef int crush_mutex;
+#  define crush_mutex_init(m) (*(m) = 0)
+#  define crush_mutex_destroy(m) ((void) (m))
+#  define crush_mutex_lock(m) ((void) (m))
+#  define crush_mutex_unlock(m) ((void) (m))
+#elif defined(_WIN32)
+typedef CRITICAL_SECTION crush_mutex;
+#  define crush_mutex_init(m) (InitializeCriticalSection(m), 0)
+#  define crush_mutex_destroy(m) DeleteCriticalSection(m)
+#  define crush_mutex_lock(m) EnterCriticalSection(m)
+#  define crush_mutex_unlock(m) LeaveCriticalSection(m)
+#else
+typedef pthread_mutex_t crush_mutex;
+#  define crush_mutex_init(m) pthread_mutex_init((m), NULL)
+#  define crush_mutex_destroy(m) pthread_mutex_destroy(m)
+#  define crush_mutex_lock(m) pthread_mutex_lock(m)
+#  define crush_mutex_unlock(m) pthread_mutex_unlock(m)
+#endif
+
+#if !defined(CRUSH_NO_THREADS) && !defined(CRUSH_THREAD_MUTEX_ONLY)
+
+// A thread running fn(arg).
+//
+// The start routine signature differs between Win32 and POSIX threads, so
+// we keep fn and arg in the handle and call them from a common trampoline.
+//
+struct crush_thread {
+#if defined(_WIN32)
+	HANDLE handle;
+#else
+	pthread_t handle;
+#endif
+	void (*fn)(void *);
+	void *arg;
+};
+
+#if defined(_WIN32)
+static unsigned __stdcall
+crush_thread_start(void *p)
+{
+	struct crush_thread *t = (struct crush_thread *) p;
+
+	t->fn(t->arg);
+
+	return 0;
+}
+#else
+static void*
+crush_thread_start(void *p)
+{
+	struct crush_thread *t = (struct crush_thread *) p;
+
+	t->fn(t->arg);
+
+	return NULL;
+}
+#endif
+
+// Start a thread running fn(arg), returns 0 on success.
+//
+// The crush_thread structure must stay valid until it has been joined.
+//
+static int
+crush_thread_create(struct crush_thread *t, void (*fn)(void *), void *arg)
+{
+	t->fn = fn;
+	t->arg = arg;
+
+#if defined(_WIN32)
+	t->handle = (HANDLE) _beginthreadex(NULL, 0, crush_thread_start, t, 0, NULL);
+
+	return t->handle != 0 ? 0 : -1;
+#else
+	return pthread_create(&t->handle, NULL, crush_thread_start, t) == 0 ? 0 : -1;
+#endif
+}
+
+// Wait for thread to finish.
+static void
+crush_thread_join(struct crush_thread *t)
+{
+#if defined(_WIN32)
+	WaitForSingleObject(t->handle, INFINITE);
+	CloseHandle(t->handle);
+#else
+	pthread_join(t->handle, NULL);
+#endif
+}
+
+#endif /* !CRUSH_NO_THREADS && !CRUSH_THREAD_MUTEX_ONLY */
+
+#endif /* CRUSH_THREAD_H_INCLUDED */